@@ -8,36 +8,216 @@
 //using namespace std;
 #include <stdlib.h>   // free..
 #include <sys/stat.h> // struct stat, struct statbuf..
+#include <sys/mman.h> // mmap(),madvise()..
+#include <limits.h>   // IOV_MAX..
+#include <sys/syscall.h> // syscall(),__NR_io_uring_setup..
+#include <linux/io_uring.h>
+#include <string.h>   // strcmp(),strlen()..
+#include <strings.h>  // strcasecmp()..
+#include <stdint.h>   // uint64_t..
+#include <errno.h>    // errno..
+#include <time.h>     // localtime_r()..
+#include <fnmatch.h>  // fnmatch()..
+#include <poll.h>     // poll()..
+#include <sys/inotify.h> // inotify_init1(),inotify_add_watch()..
+#include <sys/eventfd.h> // eventfd()..
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2,AVX2..
+#endif
 #include "d3l.h"
+#include "d3l_gbk_table.h"
+#ifdef D3L_ZLIB
+#include <zlib.h>     // inflate(),deflate()..
+#endif
+#ifdef D3L_ZSTD
+#include <zstd.h>     // ZSTD_decompressStream()..
+#endif
 
 #define RWRWRW  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH
 #define RWXRXRX  S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH
 
+// SIMD level of cpu.
+#define D3L_CPU_SCALAR 0
+#define D3L_CPU_SSE2 1
+#define D3L_CPU_AVX2 2
+
+// Converter kind of charset pair.
+#define D3L_CHARSET_ICONV 0
+#define D3L_CHARSET_G2U 1
+#define D3L_CHARSET_U2G 2
+// Block number of each streaming conversion stage.
+#define D3L_CHARSET_DEPTH 3
+// Max bytes of an incomplete multibyte sequence carried between chunks.
+#define D3L_CHARSET_CARRY 16
+// Ways of a conversion memo set, and lock shards of the memo.
+#define D3L_MEMO_WAYS 8
+#define D3L_MEMO_SHARDS 64
+// Key and value bytes of a conversion memo slot, a slot takes 128 bytes.
+#define D3L_MEMO_SLOT_BYTES 116
+// Size classes of the memory pool, blocks of 16 << class bytes.
+#define D3L_MEM_CLASSES 9
+#define D3L_MEM_CLASS_LARGE 0xFFFFFFFFU
+// Slab carved into blocks of one size class.
+#define D3L_MEM_SLAB_SIZE (64 * 1024)
+// Cache line and huge page size.
+#define D3L_MEM_LINE_SIZE 64
+#define D3L_MEM_PAGE_SIZE 4096
+#define D3L_MEM_HUGE_SIZE (2 * 1024 * 1024)
+// Needles longer than this are searched by Two-Way.
+#define D3L_SIMD_MEMMEM_LONG 64
+// Verified bytes per scanned byte before SIMD search falls back to Two-Way.
+#define D3L_SIMD_MEMMEM_BUDGET 4
+// Lock shards of the file metadata cache.
+#define D3L_STAT_SHARDS 16
+// Paths of a metadata batch before statx goes through io_uring.
+#define D3L_STAT_URING_MIN 64
+// Magic, version and byte order mark of pack files.
+#define D3L_PACK_MAGIC "D3LPACK\n"
+#define D3L_PACK_VERSION 1
+#define D3L_PACK_ENDIAN 0x01020304U
+// Max array alignment in pack files.
+#define D3L_PACK_ALIGN_MAX 4096
+// Decompressed block number read ahead by each compressed stream.
+#define D3L_ZIP_DEPTH 4
+// Sidecar file suffix of line indexes.
+#define D3L_INDEX_SUFFIX ".lidx"
+// Bytes of each block sampled to tell an append from a rewrite, and blocks
+// sampled between the first and the last one.
+#define D3L_INDEX_SAMPLE 4096
+#define D3L_INDEX_SAMPLES 16
+// Events watched by the metadata cache on each directory.
+#define D3L_STAT_EVENTS (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+        IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
 //! Print a system error information.
 /*!
-  \brief Print a system error information on screen.
+  \brief Print a system error information through the background log writer.
   \param[in] sz_ptr error information.
   \param[in] sz_file error output file path.
  */
 void d3l_sys_err(const char *sz_err, const char *sz_file)
 {
-    char *sz_time = NULL;
-    d3l_sys_time(&sz_time);
-#ifdef D3L_NO_WARNING
-    std::ofstream log(sz_file, std::ios_base::app);
-    std::streambuf *old_buf = std::cout.rdbuf(log.rdbuf());
-#endif
-    std::cout << sz_time << std::endl << sz_err << std::endl;
-#ifdef D3L_NO_WARNING
-    std::cout.rdbuf(old_buf);
-#endif
-    d3l_mem_free(sz_time);
+    d3l_log_write(sz_err, sz_file);
     return;
 }
 
+//! Timezone generation, bumped by d3l_sys_tzset() to drop cached prefixes.
+static std::atomic<unsigned int> d3l_time_gen(1);
+
+//! Formatted prefix of one second, cached per thread and format.
+struct d3l_time_cache
+{
+    time_t sec;
+    unsigned int gen;
+    unsigned int prefix_len;
+    unsigned int zone_len;
+    char prefix[48];
+    char zone[8];
+};
+static thread_local d3l_time_cache d3l_time_tls[4];
+
+//! Reload timezone.
+/*!
+  \brief Reload timezone using tzset(), timestamps cached by all threads are
+         formatted again with the new timezone.
+ */
+void d3l_sys_tzset(void)
+{
+    tzset();
+    d3l_time_gen.fetch_add(1, std::memory_order_release);
+}
+
+//! Format a timestamp.
+/*!
+  \brief Format a timestamp into a buff. Date and time of the current second are
+         cached per thread, so only sub-second digits are written on later calls.
+  \param[in] ts time to format.
+  \param[out] buff output buff, terminated by '\\0'.
+  \param[in] len buff length.
+  \param[in] flags D3L_TIME_D3L or D3L_TIME_ISO, or'ed with D3L_TIME_MS,
+             D3L_TIME_US and D3L_TIME_UTC.
+  \retval >0 Timestamp length; ==0 Buff is too small.
+ */
+size_t d3l_sys_time_format_at(const struct timespec *ts, char *buff, size_t len, int flags)
+{
+    int kind = (flags & D3L_TIME_ISO) | ((flags & D3L_TIME_UTC) ? 2 : 0);
+    d3l_time_cache &cache = d3l_time_tls[kind];
+    unsigned int gen = d3l_time_gen.load(std::memory_order_acquire);
+    if(cache.sec != ts->tv_sec || cache.gen != gen)
+    {
+        struct tm t_tm;
+        if(flags & D3L_TIME_UTC)
+            gmtime_r(&ts->tv_sec, &t_tm);
+        else
+            localtime_r(&ts->tv_sec, &t_tm);
+        const char *sz_fmt = (flags & D3L_TIME_ISO) ? "%04d-%02d-%02dT%02d:%02d:%02d" :
+            "D3L::Time:%4d-%02d-%02d %02d:%02d:%02d";
+        cache.prefix_len = snprintf(cache.prefix, sizeof(cache.prefix), sz_fmt, t_tm.tm_year+1900,
+                t_tm.tm_mon+1, t_tm.tm_mday, t_tm.tm_hour, t_tm.tm_min, t_tm.tm_sec);
+        cache.zone_len = 0;
+        if((flags & D3L_TIME_ISO) && (flags & D3L_TIME_UTC))
+            cache.zone_len = snprintf(cache.zone, sizeof(cache.zone), "Z");
+        else if(flags & D3L_TIME_ISO)
+        {
+            long off = t_tm.tm_gmtoff / 60;
+            cache.zone_len = snprintf(cache.zone, sizeof(cache.zone), "%c%02ld:%02ld",
+                    off < 0 ? '-' : '+', labs(off) / 60, labs(off) % 60);
+        }
+        cache.sec = ts->tv_sec;
+        cache.gen = gen;
+    }
+
+    int digits = (flags & D3L_TIME_US) ? 6 : ((flags & D3L_TIME_MS) ? 3 : 0);
+    size_t need = cache.prefix_len + (digits > 0 ? digits + 1 : 0) + cache.zone_len;
+    if(need >= len)
+    {
+        if(len > 0)
+            buff[0] = '\0';
+        return 0;
+    }
+    memcpy(buff, cache.prefix, cache.prefix_len);
+    char *pos = buff + cache.prefix_len;
+    if(digits > 0)
+    {
+        long frac = ts->tv_nsec / (6 == digits ? 1000 : 1000000);
+        *pos = '.';
+        for(int i = digits; i > 0; i--, frac /= 10)
+            pos[i] = '0' + frac % 10;
+        pos += digits + 1;
+    }
+    memcpy(pos, cache.zone, cache.zone_len);
+    buff[need] = '\0';
+    return need;
+}
+
+//! Format current time.
+/*!
+  \brief Format current time into a buff using d3l_sys_time_format_at(). The
+         clock is read through vDSO, the coarse clock is used without sub-second
+         digits.
+  \param[out] buff output buff, terminated by '\\0'.
+  \param[in] len buff length.
+  \param[in] flags format flags of d3l_sys_time_format_at().
+  \retval >0 Timestamp length; ==0 Buff is too small.
+ */
+size_t d3l_sys_time_format(char *buff, size_t len, int flags)
+{
+    struct timespec ts;
+    clock_gettime((flags & (D3L_TIME_MS|D3L_TIME_US)) ? CLOCK_REALTIME : CLOCK_REALTIME_COARSE, &ts);
+    return d3l_sys_time_format_at(&ts, buff, len, flags);
+}
+
 //! Get system time.
 /*!
-  \brief Get system time using time();
+  \brief Get system time using d3l_sys_time_format();
   \param[out] psz_time time string to out.
   \retval ==0 Successed; <0 Failed.
  */
@@ -49,13 +229,7 @@ int d3l_sys_time(char **psz_time)
         *psz_time = NULL;
     }
     d3l_mem_create(*psz_time, 35);
-
-    time_t timer;
-    struct tm* t_tm;
-    time(&timer);
-    t_tm = localtime(&timer);
-    sprintf(*psz_time, "D3L::Time:%4d-%02d-%02d %02d:%02d:%02d", t_tm->tm_year+1900,
-            t_tm->tm_mon+1, t_tm->tm_mday, t_tm->tm_hour, t_tm->tm_min, t_tm->tm_sec);
+    d3l_sys_time_format(*psz_time, 35, D3L_TIME_D3L);
     return 0;
 }
 
@@ -99,403 +273,6805 @@ int d3l_sys_time_up(char **psz_time, struct timeval *ptv_start,
     struct timeval tv_end;
     struct timezone tz_end;
     gettimeofday(&tv_end, &tz_end);
+    (void)ptz_start; // the timezone of the start stays as the caller got it
 
     if(NULL != *psz_time)
     {
         d3l_mem_free(*psz_time);
         *psz_time = NULL;
     }
-    d3l_mem_create(*psz_time, 50);
-    //! compute time
-    sprintf(*psz_time, "D3l:Cost time: %8ld sec %8ld usec\n", 
-            tv_end.tv_sec - ptv_start->tv_sec,tv_end.tv_usec-ptv_start->tv_usec);
-    return 0;
-}
-
-//! Return a file access stat.
-/*!
-  \brief Return a file access stat using access function.
-  \param[in] sz_file file path.
-  \param[in] mode R_OK(Read) W_OK(Write) X_OK(Execute) F_OK(Exist).
-  \retval ==0 Successed; <0 Failed.
- */
-int d3l_fop_access(const char *sz_file, int mode)
-{
-    if(access(sz_file, R_OK) < 0)
+    d3l_mem_create(*psz_time, 72);
+    //! compute time, borrow a second when usec is behind
+    long sec = tv_end.tv_sec - ptv_start->tv_sec;
+    long usec = tv_end.tv_usec - ptv_start->tv_usec;
+    if(usec < 0)
     {
-        std::string str_err = "ERROR d3l::d3l_fop_access(const char *, int) File ";
-        str_err = str_err + sz_file + " access error!";
-        d3l_sys_err(str_err.c_str());
-        return -1;
+        sec--;
+        usec += 1000000;
     }
-
+    snprintf(*psz_time, 72, "D3l:Cost time: %8ld sec %8ld usec\n", sec, usec);
     return 0;
 }
 
-//! Remove a file from disk.
+//! Get monotonic clock.
 /*!
-  \brief Remove a file from disk using unlink command.
-  \param[in] sz_file file path.
-  \retval ==0 Successed; <0 Failed.
+  \brief Get monotonic clock using clock_gettime(CLOCK_MONOTONIC), it's read
+         through vDSO without a system call.
+  \retval Nanoseconds since an unspecified start point.
  */
-int d3l_fop_remove(const char *sz_file)
+uint64_t d3l_sys_clock_ns(void)
 {
-    if(unlink(sz_file) < 0)
-    {
-        std::string str_err = "ERROR d3l::d3l_fop_remove(const char *) File ";
-        str_err = str_err + sz_file + " can't be removed!";
-        d3l_sys_err(str_err.c_str());
-        return -1;
-    }
-    return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
 }
 
-//! Get line number of file.
-/*!
-  \brief Get line number of file by open the file.
-  \param[in] sz_file file path.
-  \retval >=0 Line num; <0 Failed.
- */
-int d3l_fop_linenum(const char *sz_file)
+// Sub buckets of each power of two in timing histograms.
+#define D3L_TIMER_SUB_BITS 3
+#define D3L_TIMER_SUB (1 << D3L_TIMER_SUB_BITS)
+#define D3L_TIMER_BUCKETS ((64 - D3L_TIMER_SUB_BITS + 1) * D3L_TIMER_SUB)
+
+//! Log-bucketed latency histogram, written by one thread and read by reports.
+struct d3l_timer_hist
 {
-    std::ifstream ifs;
-    ifs.open(sz_file);
-    if(ifs.fail())
-    {
-        std::string str_err = "ERROR d3l::d3l_fop_linenum(const char *) File ";
-        str_err = str_err + sz_file + " can't be removed!";
-        d3l_sys_err(str_err.c_str());
-        return -1;
-    }
+    std::atomic<uint64_t> counts[D3L_TIMER_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+//! Timing histograms of one thread.
+struct d3l_timer_local
+{
+    std::atomic<d3l_timer_hist *> hists[D3L_TIMER_SITES];
+    d3l_timer_local();
+    ~d3l_timer_local();
+};
 
-    int num = 0;
-    std::string str_line;
-    while(getline(ifs, str_line))
-        num++;
+//! Timing sites and histograms of all threads.
+struct d3l_timer_registry
+{
+    std::mutex mtx;
+    std::vector<std::string> names;
+    std::vector<d3l_timer_local *> locals;
+    d3l_timer_hist *retired[D3L_TIMER_SITES];   //!< merged histograms of exited threads.
+};
 
-    return num;
+//! Get timing registry, it is never destroyed since timers may run in static destructors.
+static d3l_timer_registry *d3l_timer_inst()
+{
+    static d3l_timer_registry *registry = new d3l_timer_registry();
+    return registry;
 }
 
-//! Get the size of file.
-/*!
-  \brief Get the size of file by open the file.
-  \param[in] sz_file file path.
-  \retval >=0 File size; <0 Failed.
- */
-int d3l_fop_size(const char *sz_file)
+//! Create an empty histogram.
+static d3l_timer_hist *d3l_timer_hist_new()
 {
-    FILE *fp = fopen(sz_file,"r");
-    fseek(fp,0L,SEEK_END);
-    int size = ftell(fp);
-    fclose(fp);
-    return size;
+    d3l_timer_hist *hist = new d3l_timer_hist;
+    for(int i = 0; i < D3L_TIMER_BUCKETS; i++)
+        hist->counts[i].store(0, std::memory_order_relaxed);
+    hist->count.store(0, std::memory_order_relaxed);
+    hist->sum.store(0, std::memory_order_relaxed);
+    hist->max.store(0, std::memory_order_relaxed);
+    return hist;
 }
 
-//! Open a file using ifstream.
-/*!
-  \brief Open a file using ifstream.
-  \param[in] ifstream infile stream.
-  \param[in] sz_file file path.
-  \retval ==0 Successed; <0 Failed.
- */
-int d3l_fop_open_ifstream(std::ifstream &ifs_in, const char *sz_file)
+//! Add a histogram into another, dest must not be written concurrently.
+static void d3l_timer_hist_merge(d3l_timer_hist *dest, const d3l_timer_hist *src)
 {
-    ifs_in.open(sz_file);
-    if(ifs_in.fail())
+    for(int i = 0; i < D3L_TIMER_BUCKETS; i++)
     {
-        std::string str_err = "ERROR d3l::d3l_fop_open_ifstream(ifstream &, char *) File ";
-        str_err = str_err + sz_file + " can't be opened!";
-        d3l_sys_err(str_err.c_str());
-        return -1;
+        uint64_t count = src->counts[i].load(std::memory_order_relaxed);
+        if(0 != count)
+            dest->counts[i].store(dest->counts[i].load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
     }
-    return 0;
+    dest->count.store(dest->count.load(std::memory_order_relaxed) + src->count.load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+    dest->sum.store(dest->sum.load(std::memory_order_relaxed) + src->sum.load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+    dest->max.store(std::max(dest->max.load(std::memory_order_relaxed), src->max.load(std::memory_order_relaxed)),
+            std::memory_order_relaxed);
 }
 
-//! Code convert from one to another.
-/*!
-  \brief Code convert from one to another using iconv.
-  \param[in] from_charset src code charset.
-  \param[in] to_charset dest code charset.
-  \param[in] inbuf src string.
-  \param[in] inlen src string length.
-  \param[out] outbuf dest string.
-  \param[in] outlen dest string length.
-  \retval ==0 Successed; <0 Failed.
- */
-int d3l_charset_code_convert(char *from_charset, char *to_charset, char *inbuf, int inlen, char *outbuf, int outlen)
+d3l_timer_local::d3l_timer_local()
 {
-    iconv_t cd;
-    char **pin = &inbuf;
-    char **pout = &outbuf;
+    for(int i = 0; i < D3L_TIMER_SITES; i++)
+        hists[i].store(NULL, std::memory_order_relaxed);
+    d3l_timer_registry *registry = d3l_timer_inst();
+    std::lock_guard<std::mutex> lock(registry->mtx);
+    registry->locals.push_back(this);
+}
 
-    cd = iconv_open(to_charset, from_charset);
-    if (0 == cd)
-    {
-        std::string str_err = "ERROR d3l::int d3l_charset_code_convert(char *from_charset,char *to_charset,char *inbuf,int inlen,char *outbuf,int outlen) \n iconv_open(to_charset, from_charset)";
-        d3l_sys_err(str_err.c_str());
-        return -1;
-    }
-    memset(outbuf, 0, outlen);
-    if (-1 == static_cast<int>(iconv(cd, pin, reinterpret_cast<size_t *>(&inlen), pout, reinterpret_cast<size_t *>(&outlen))))
-    //if (-1 == iconv(cd, pin, &inlen, pout, &outlen))
+d3l_timer_local::~d3l_timer_local()
+{
+    d3l_timer_registry *registry = d3l_timer_inst();
+    std::lock_guard<std::mutex> lock(registry->mtx);
+    registry->locals.erase(std::find(registry->locals.begin(), registry->locals.end(), this));
+    for(int i = 0; i < D3L_TIMER_SITES; i++)
     {
-        std::string str_err = "ERROR d3l::int d3l_charset_code_convert(char *from_charset,char *to_charset,char *inbuf,int inlen,char *outbuf,int outlen) \n iconv(cd, pin, &inlen, pout, &outlen)";
-        d3l_sys_err(str_err.c_str());
-        return -1;
+        d3l_timer_hist *hist = hists[i].load(std::memory_order_relaxed);
+        if(NULL == hist)
+            continue;
+        if(NULL == registry->retired[i])
+            registry->retired[i] = d3l_timer_hist_new();
+        d3l_timer_hist_merge(registry->retired[i], hist);
+        delete hist;
     }
-    iconv_close(cd);
-    return 0;
 }
 
-//! Code convert string from UNICODE to GB2312.
-/*!
-  \brief Code convert string from UNICODE to GB2312 using iconv.
-  \param[in] inbuf src string.
-  \param[in] inlen src string length.
-  \param[out] outbuf dest string.
-  \param[in] outlen dest string length.
-  \retval ==0 Successed; <0 Failed.
- */
-// UNICODE code to GB2312 code
-// Example: char *in_utf8 = "utf8字符串";
-//          rec = u2g(in_utf8,strlen(in_utf8),out,OUTLEN);
-//          printf("unicode-->gb2312 out=%s\n",out);
-int d3l_charset_u2g(char *inbuf,size_t inlen,char *outbuf,size_t outlen)
-{
-    //return d3l_charset_code_convert("utf-8","gb2312",inbuf,inlen,outbuf,outlen);
-    return d3l_charset_code_convert(const_cast<char *>("utf-8"),const_cast<char *>(D3L_GB_CODE),inbuf,inlen,outbuf,outlen);
-}
+static thread_local d3l_timer_local d3l_timer_tls;
 
-//! Code convert string from GB2312 to UNICODE.
-/*!
-  \brief Code convert string from GB2312 to UNICODE using iconv.
-  \param[in] inbuf src string.
-  \param[in] inlen src string.
-  \param[out] outbuf dest string.
-  \param[in] outlen dest string length.
-  \retval ==0 Successed; <0 Failed.
- */
-// GB2312 code to UNICODE code
-// Example: char *in_gb2312 = "\xbe\xb2\xcc\xac\xc4\xa3\xca\xbd";
-//          rec = g2u(in_gb2312,strlen(in_gb2312),out,OUTLEN);
-//          printf("gb2312-->unicode out=%s \n",out);
-int d3l_charset_g2u(char *inbuf,size_t inlen,char *outbuf,size_t outlen)
+//! Get histogram bucket of a duration.
+static inline int d3l_timer_bucket(uint64_t ns)
 {
-    //return d3l_charset_code_convert("gb2312","utf-8",inbuf,inlen,outbuf,outlen);
-    return d3l_charset_code_convert(const_cast<char *>(D3L_GB_CODE),const_cast<char *>("utf-8"),inbuf,inlen,outbuf,outlen);
+    if(ns < D3L_TIMER_SUB)
+        return static_cast<int>(ns);
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = static_cast<int>(ns >> (exp - D3L_TIMER_SUB_BITS)) & (D3L_TIMER_SUB - 1);
+    return (exp - D3L_TIMER_SUB_BITS + 1) * D3L_TIMER_SUB + sub;
 }
 
-//! Code convert string object from UNICODE to GB2312.
-/*!
-  \brief Code convert string object from UNICODE to GB2312 using iconv.
-  \param[in] str_in src string object.
-  \param[out] str_out dest string object.
-  \retval ==0 Successed; *<0 Failed.*
- */
-int d3l_charset_u2g(const std::string &str_in, std::string &str_out)
+//! Get the highest duration of a histogram bucket.
+static uint64_t d3l_timer_bucket_max(int bucket)
 {
-    char *sz_in = NULL, *sz_out = NULL;
-    size_t buf_size = (str_in.length() + 1) * 2;
-    sz_in = strdup(str_in.c_str());
-    d3l_mem_create(sz_out, buf_size);
-    d3l_charset_code_convert(const_cast<char *>("utf-8"),const_cast<char *>(D3L_GB_CODE),sz_in,str_in.length(),sz_out,buf_size);
-    str_out = sz_out;
-    free(sz_in);
-    d3l_mem_free(sz_out);
-    return 0;
+    if(bucket < D3L_TIMER_SUB)
+        return bucket;
+    int exp = bucket / D3L_TIMER_SUB + D3L_TIMER_SUB_BITS - 1;
+    uint64_t sub = D3L_TIMER_SUB + bucket % D3L_TIMER_SUB;
+    return ((sub + 1) << (exp - D3L_TIMER_SUB_BITS)) - 1;
 }
 
-//! Code convert string object from GB2312 to UNICODE.
+//! Register a timing site.
 /*!
-  \brief Code convert string object from GB2312 to UNICODE using iconv.
-  \param[in] str_in src string object.
-  \param[out] str_out dest string object.
-  \retval ==0 Successed; *<0 Failed.*
+  \brief Register a named timing site, registering an existing name returns its id.
+  \param[in] sz_name site name.
+  \retval >=0 Site id; <0 Failed.
  */
-int d3l_charset_g2u(const std::string &str_in, std::string &str_out)
+int d3l_sys_timer_site(const char *sz_name)
 {
-    char *sz_in = NULL, *sz_out = NULL;
-    size_t buf_size = (str_in.length() + 1) * 20;
-    sz_in = strdup(str_in.c_str());
-    d3l_mem_create(sz_out, buf_size);
-    d3l_charset_code_convert(const_cast<char *>(D3L_GB_CODE),const_cast<char *>("utf-8"),sz_in,str_in.length(),sz_out,buf_size);
-    str_out = sz_out;
-    free(sz_in);
-    d3l_mem_free(sz_out);
-    return 0;
+    d3l_timer_registry *registry = d3l_timer_inst();
+    std::lock_guard<std::mutex> lock(registry->mtx);
+    for(size_t i = 0; i < registry->names.size(); i++)
+    {
+        if(registry->names[i] == sz_name)
+            return static_cast<int>(i);
+    }
+    if(registry->names.size() >= D3L_TIMER_SITES)
+        return -1;
+    registry->names.push_back(sz_name);
+    return static_cast<int>(registry->names.size() - 1);
 }
 
-//! Print char content using 16bit format.
+//! Record a duration of a timing site.
 /*!
-  \brief Print char content using 16bit format, using cout.
-  \param[in] ch src string.
-  \retval ==0 Successed; *<0 Failed.*
+  \brief Record a duration into the histogram of current thread, only the first
+         record of a site in a thread allocates.
+  \param[in] site site id of d3l_sys_timer_site().
+  \param[in] ns duration in nanoseconds.
  */
-int d3l_charset_printc(const char *sz_c)
+void d3l_sys_timer_record(int site, uint64_t ns)
 {
-    char *ch = const_cast<char *>(sz_c);
-    std::cout << "Hex Char Code:" << std::endl;
-    do
-        std::cout << std::hex << static_cast<unsigned int>(*ch++) << " ";
-    while(*ch != '\0');
-    std::cout << std::endl;
-    return 0;
+    if(site < 0 || site >= D3L_TIMER_SITES)
+        return;
+    d3l_timer_hist *hist = d3l_timer_tls.hists[site].load(std::memory_order_relaxed);
+    if(NULL == hist)
+    {
+        hist = d3l_timer_hist_new();
+        d3l_timer_tls.hists[site].store(hist, std::memory_order_release);
+    }
+    // Only the owner thread writes, so relaxed load and store are enough.
+    std::atomic<uint64_t> &count = hist->counts[d3l_timer_bucket(ns)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    hist->count.store(hist->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    hist->sum.store(hist->sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    if(ns > hist->max.load(std::memory_order_relaxed))
+        hist->max.store(ns, std::memory_order_relaxed);
 }
 
-//! Open dirent.
-/*!
-  \brief Open dirent using opendir().
-  \param[out] dpp DIR point point.
-  \param[in] sz_dir dir path.
-  \retval ==0 Successed; <0 Failed.
- */
-int d3l_dop_open(DIR **dpp, const char *sz_dir)
+//! Merge histograms of a site from all threads, registry lock must be held.
+static void d3l_timer_collect(d3l_timer_registry *registry, int site, d3l_timer_hist *hist)
 {
-    struct stat statbuf;
-    //! Check dirent status.
-    if (lstat(sz_dir, &statbuf) < 0)
+    if(NULL != registry->retired[site])
+        d3l_timer_hist_merge(hist, registry->retired[site]);
+    for(size_t i = 0; i < registry->locals.size(); i++)
     {
-        std::string str_err = sz_dir;
-        str_err = "ERROR: Dir " + str_err + " stat error!";
-        d3l_sys_err(str_err.c_str());
-        return -1;
+        d3l_timer_hist *local = registry->locals[i]->hists[site].load(std::memory_order_acquire);
+        if(NULL != local)
+            d3l_timer_hist_merge(hist, local);
     }
-    if (S_ISDIR(statbuf.st_mode) == 0)
+}
+
+//! Get statistics from a merged histogram.
+static void d3l_timer_stat_fill(const d3l_timer_hist *hist, struct d3l_sys_timer_stat *stat)
+{
+    uint64_t count = 0;
+    uint64_t counts[D3L_TIMER_BUCKETS];
+    for(int i = 0; i < D3L_TIMER_BUCKETS; i++)
     {
-        std::string str_err = sz_dir;
-        str_err = "ERROR: " + str_err + " is not a directory!";
-        d3l_sys_err(str_err.c_str());
-        return -2;
+        counts[i] = hist->counts[i].load(std::memory_order_relaxed);
+        count += counts[i];
     }
-    if(NULL == (*dpp = opendir(sz_dir)))
+    stat->count = count;
+    stat->max = hist->max.load(std::memory_order_relaxed);
+    stat->mean = (0 == count) ? 0 : hist->sum.load(std::memory_order_relaxed) / count;
+
+    const double quantiles[3] = {0.5, 0.99, 0.999};
+    uint64_t *values[3] = {&stat->p50, &stat->p99, &stat->p999};
+    for(int q = 0; q < 3; q++)
     {
-        std::string str_err = sz_dir;
-        str_err = "ERROR: Can't open dir " + str_err + " !";
-        d3l_sys_err(str_err.c_str());
-        return -3;
+        uint64_t rank = static_cast<uint64_t>(quantiles[q] * count + 0.5);
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        *values[q] = 0;
+        for(int i = 0; i < D3L_TIMER_BUCKETS && 0 != count; i++)
+        {
+            seen += counts[i];
+            if(seen >= rank)
+            {
+                *values[q] = std::min(d3l_timer_bucket_max(i), stat->max);
+                break;
+            }
+        }
     }
-    return 0;
 }
 
-//! Close dirent.
+//! Get statistics of a timing site.
 /*!
-  \brief Close dirent using closedir().
-  \param[out] dpp DIR point point.
+  \brief Get statistics of a timing site merged from all threads, percentiles
+         are the highest value of their bucket, within 1/8 of the exact value.
+  \param[in] site site id of d3l_sys_timer_site().
+  \param[out] stat statistics in nanoseconds.
   \retval ==0 Successed; <0 Failed.
  */
-int d3l_dop_close(DIR **dpp)
+int d3l_sys_timer_stats(int site, struct d3l_sys_timer_stat *stat)
 {
-    if(closedir(*dpp) < 0)
+    d3l_timer_registry *registry = d3l_timer_inst();
+    d3l_timer_hist *hist = d3l_timer_hist_new();
     {
-        std::string str_err = "ERROR: Can't close dirent!";
-        d3l_sys_err(str_err.c_str());
-        return -1;
+        std::lock_guard<std::mutex> lock(registry->mtx);
+        if(site < 0 || site >= static_cast<int>(registry->names.size()))
+        {
+            delete hist;
+            return -1;
+        }
+        d3l_timer_collect(registry, site, hist);
     }
+    d3l_timer_stat_fill(hist, stat);
+    delete hist;
     return 0;
 }
 
-//! Get file number of dirent.
+//! Report timing histograms.
 /*!
-  \brief Get file number of dirent using D3L.
-  \param[in] sz_dir dir path.
-  \retval >=0 File num; <0 Failed.
+  \brief Report count, mean, p50, p99, p999 and max of every timing site in
+         microseconds as one log record.
+  \param[in] sz_file report output file path.
+  \retval ==0 Successed; <0 Failed.
  */
-int d3l_dop_filenum(const char *sz_dir)
+int d3l_sys_timer_report(const char *sz_file)
 {
-    struct dirent *dirp;
-    DIR *dp;
-    if(d3l_dop_open(&dp, sz_dir) < 0)
-        return -1;
-
-    int num = 0;
-    //! 循环读取目录中文件
-    while(NULL != (dirp = readdir(dp)))
+    d3l_timer_registry *registry = d3l_timer_inst();
+    std::string str_report = "D3L::Timer report";
+    d3l_timer_hist *hist = d3l_timer_hist_new();
+    std::lock_guard<std::mutex> lock(registry->mtx);
+    for(size_t i = 0; i < registry->names.size(); i++)
     {
-        if(0 == strcmp(dirp->d_name, ".") ||
-           0 == strcmp(dirp->d_name, "..") )
-            continue;
-        num++;
+        for(int j = 0; j < D3L_TIMER_BUCKETS; j++)
+            hist->counts[j].store(0, std::memory_order_relaxed);
+        hist->count.store(0, std::memory_order_relaxed);
+        hist->sum.store(0, std::memory_order_relaxed);
+        hist->max.store(0, std::memory_order_relaxed);
+        d3l_timer_collect(registry, static_cast<int>(i), hist);
+        struct d3l_sys_timer_stat stat;
+        d3l_timer_stat_fill(hist, &stat);
+
+        char sz_line[128];
+        snprintf(sz_line, sizeof(sz_line), " count=%llu mean=%.3f p50=%.3f p99=%.3f p999=%.3f max=%.3f us",
+                static_cast<unsigned long long>(stat.count), stat.mean / 1e3, stat.p50 / 1e3,
+                stat.p99 / 1e3, stat.p999 / 1e3, stat.max / 1e3);
+        str_report = str_report + "\n" + registry->names[i] + sz_line;
     }
-    return num;
+    delete hist;
+    return d3l_log_write(str_report.c_str(), sz_file);
 }
 
-//! Create dirent by path.
-/*!
-  \brief Create dirent by path using makedir.
-  \param[in] sz_dir dir path.
-  \retval ==0 Successed; <0 Failed.
- */
-int d3l_dop_create(const char *sz_dir)
+//! Log record slot, a long record takes several continuous slots.
+struct d3l_log_slot
 {
-    char *dirname = NULL;
-    int pos = 0;
-    d3l_mem_create(dirname, strlen(sz_dir) + 1, '\0');
-    while('\0' != sz_dir[pos])
-    {
-        dirname[pos] = sz_dir[pos];
-        if('/' == sz_dir[pos] || strlen(sz_dir) - 1 == pos)
-        {
-            if (access(dirname,F_OK)<0)
-            {
-                if (mkdir(dirname, RWXRXRX)<0)
-                {
-                    std::string str_err = "ERROR: d3l:: int d3l_dop_create(const char *) Can't create dirent.";
-                    d3l_sys_err(str_err.c_str());
-                }
-                else
-                {
-                    std::string str_err = "ERROR: d3l:: int d3l_dop_create(const char *) ";
-                    str_err += dirname;
-                    str_err += "has been created.";
-                    d3l_sys_err(str_err.c_str());
+    time_t time;                //!< record time.
+    unsigned short file;        //!< index of the log file.
+    unsigned short len;         //!< payload length of this slot.
+    unsigned int more;          //!< 1 if the record continues in next slot.
+    char data[D3L_LOG_SLOT_SIZE - sizeof(time_t) - 8];
+};
+
+//! Single producer single consumer log ring owned by one thread.
+struct d3l_log_ring
+{
+    alignas(64) std::atomic<size_t> head;   //!< read index, written by log writer.
+    alignas(64) std::atomic<size_t> tail;   //!< write index, written by owner thread.
+    std::atomic<bool> closed;               //!< owner thread has exited.
+    d3l_log_slot slots[D3L_LOG_RING_SLOTS];
+};
+
+//! Log writer state.
+struct d3l_log_engine
+{
+    std::mutex mtx;
+    std::condition_variable cv_wake;
+    std::condition_variable cv_done;
+    std::vector<d3l_log_ring *> rings;
+    std::deque<std::string> files;      //!< push_back keeps addresses of registered names.
+    std::vector<int> fds;
+    std::thread writer;
+    std::atomic<int> state;     //!< 0 idle, 1 running, 2 stopping, 3 stopped.
+    std::atomic<unsigned long> queued;
+    std::atomic<unsigned long> dropped;
+    unsigned long written;
+    bool wake;
+    std::atomic<int> policy;    //!< read by writing threads without the lock.
+    int flush_ms;
+};
+
+//! Get log writer state, it is never destroyed since records may come from static destructors.
+static d3l_log_engine *d3l_log_inst()
+{
+    static d3l_log_engine *engine = new d3l_log_engine();
+    return engine;
+}
+
+//! Thread ring holder, mark the ring closed when thread exits.
+struct d3l_log_holder
+{
+    d3l_log_ring *ring;
+    const char *last_file;
+    unsigned short last_id;
+    bool dead;      //!< destroyed, later records of the thread are written directly.
+    d3l_log_holder() : ring(NULL), last_file(NULL), last_id(0), dead(false) {}
+    ~d3l_log_holder()
+    {
+        // The writer frees a closed ring once it is empty.
+        if(NULL != ring)
+            ring->closed.store(true, std::memory_order_release);
+        ring = NULL;
+        dead = true;
+    }
+};
+static thread_local d3l_log_holder d3l_log_local;
+
+//! Format log record head "D3L::Time:YYYY-MM-DD HH:MM:SS".
+static size_t d3l_log_format_time(time_t timer, char *sz_time, size_t len)
+{
+    struct timespec ts = {timer, 0};
+    return d3l_sys_time_format_at(&ts, sz_time, len, D3L_TIME_D3L);
+}
+
+//! Open a log file for append, or stdout when warnings are printed on screen.
+static int d3l_log_open(const char *sz_file)
+{
+#ifdef D3L_NO_WARNING
+    return open(sz_file, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+#else
+    (void)sz_file;
+    return dup(STDOUT_FILENO);
+#endif
+}
+
+//! Write all bytes to fd, retry on short write and EINTR.
+static int d3l_log_write_all(int fd, const char *buff, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t rs = write(fd, buff, len);
+        if(rs < 0)
+        {
+            if(EINTR == errno)
+                continue;
+            return -1;
+        }
+        buff += rs;
+        len -= rs;
+    }
+    return 0;
+}
+
+//! Write a log record directly, used when the writer is not running.
+static int d3l_log_write_sync(const char *sz_err, const char *sz_file)
+{
+    char sz_time[64];
+    size_t len = d3l_log_format_time(time(NULL), sz_time, sizeof(sz_time));
+    std::string str_rec(sz_time, len);
+    str_rec += '\n';
+    str_rec += sz_err;
+    str_rec += '\n';
+
+    int fd = d3l_log_open(sz_file);
+    if(fd < 0)
+        return -1;
+    int rs = d3l_log_write_all(fd, str_rec.data(), str_rec.size());
+    close(fd);
+    return rs;
+}
+
+//! Get index of log file, register it at first use.
+static unsigned short d3l_log_file_id(const char *sz_file)
+{
+    d3l_log_holder &local = d3l_log_local;
+    if(NULL != local.last_file && 0 == strcmp(local.last_file, sz_file))
+        return local.last_id;
+
+    std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+    size_t id = 0;
+    while(id < d3l_log_inst()->files.size() && d3l_log_inst()->files[id] != sz_file)
+        id++;
+    if(id == d3l_log_inst()->files.size())
+    {
+        d3l_log_inst()->files.push_back(sz_file);
+        d3l_log_inst()->fds.push_back(-1);
+    }
+    // Registered names are never erased or moved, so the pointer stays valid.
+    local.last_file = d3l_log_inst()->files[id].c_str();
+    local.last_id = static_cast<unsigned short>(id);
+    return local.last_id;
+}
+
+//! Get ring of current thread, create and register it at first use.
+static d3l_log_ring *d3l_log_thread_ring()
+{
+    d3l_log_holder &local = d3l_log_local;
+    if(NULL == local.ring)
+    {
+        d3l_log_ring *ring = new d3l_log_ring();
+        ring->head.store(0);
+        ring->tail.store(0);
+        ring->closed.store(false);
+        std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+        d3l_log_inst()->rings.push_back(ring);
+        local.ring = ring;
+    }
+    return local.ring;
+}
+
+//! Log writer buffers, one batch per log file.
+struct d3l_log_batch
+{
+    std::vector<std::string> batches;
+    std::vector<d3l_log_ring *> rings;
+    time_t last_time;
+    size_t time_len;
+    char sz_time[64];
+    d3l_log_batch() : last_time(0), time_len(0) {}
+};
+
+//! Move records of one ring into the per file batches.
+static size_t d3l_log_drain(d3l_log_ring *ring, d3l_log_batch &batch)
+{
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    size_t tail = ring->tail.load(std::memory_order_acquire);
+    size_t num = 0;
+    bool begin = true;
+    while(head != tail)
+    {
+        const d3l_log_slot &slot = ring->slots[head % D3L_LOG_RING_SLOTS];
+        if(slot.file >= batch.batches.size())
+            batch.batches.resize(slot.file + 1);
+        std::string &str_out = batch.batches[slot.file];
+        if(begin)
+        {
+            if(slot.time != batch.last_time)
+            {
+                batch.last_time = slot.time;
+                batch.time_len = d3l_log_format_time(slot.time, batch.sz_time, sizeof(batch.sz_time));
+            }
+            str_out.append(batch.sz_time, batch.time_len);
+            str_out += '\n';
+        }
+        str_out.append(slot.data, slot.len);
+        begin = (0 == slot.more);
+        if(begin)
+        {
+            str_out += '\n';
+            num++;
+        }
+        head++;
+    }
+    // A record is published with all its slots, so the ring ends on a record boundary.
+    ring->head.store(head, std::memory_order_release);
+    return num;
+}
+
+//! Write the batches to log files, called with the engine lock held.
+static void d3l_log_write_batch(d3l_log_batch &batch)
+{
+    for(size_t id = 0; id < batch.batches.size(); id++)
+    {
+        std::string &str_out = batch.batches[id];
+        if(str_out.empty())
+            continue;
+        if(d3l_log_inst()->fds[id] < 0)
+            d3l_log_inst()->fds[id] = d3l_log_open(d3l_log_inst()->files[id].c_str());
+        if(d3l_log_inst()->fds[id] >= 0)
+            d3l_log_write_all(d3l_log_inst()->fds[id], str_out.data(), str_out.size());
+        str_out.clear();
+    }
+}
+
+//! Close log files, called with the engine lock held.
+static void d3l_log_close_files()
+{
+    for(size_t id = 0; id < d3l_log_inst()->fds.size(); id++)
+    {
+        if(d3l_log_inst()->fds[id] >= 0)
+            close(d3l_log_inst()->fds[id]);
+        d3l_log_inst()->fds[id] = -1;
+    }
+}
+
+//! Write records a thread put into its ring after the final drain of d3l_log_stop().
+static void d3l_log_drain_stopped(d3l_log_ring *ring)
+{
+    std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+    // A restarted writer owns the ring again.
+    if(3 != d3l_log_inst()->state.load())
+        return;
+    d3l_log_batch batch;
+    d3l_log_inst()->written += d3l_log_drain(ring, batch);
+    d3l_log_write_batch(batch);
+    d3l_log_close_files();
+}
+
+//! Background log writer loop.
+static void d3l_log_run()
+{
+    d3l_log_batch batch;
+    for(;;)
+    {
+        bool stopping = false;
+        {
+            std::unique_lock<std::mutex> lock(d3l_log_inst()->mtx);
+            if(!d3l_log_inst()->wake)
+                d3l_log_inst()->cv_wake.wait_for(lock, std::chrono::milliseconds(d3l_log_inst()->flush_ms));
+            d3l_log_inst()->wake = false;
+            stopping = (2 == d3l_log_inst()->state.load());
+            batch.rings = d3l_log_inst()->rings;
+        }
+
+        // Rings are only released by this thread, so they are drained without the lock.
+        size_t num = 0;
+        for(size_t i = 0; i < batch.rings.size(); i++)
+            num += d3l_log_drain(batch.rings[i], batch);
+
+        std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+        d3l_log_write_batch(batch);
+
+        // Release rings of exited threads once they are empty.
+        for(size_t i = 0; i < d3l_log_inst()->rings.size(); )
+        {
+            d3l_log_ring *ring = d3l_log_inst()->rings[i];
+            if(ring->closed.load(std::memory_order_acquire) &&
+               ring->head.load() == ring->tail.load(std::memory_order_acquire))
+            {
+                d3l_log_inst()->rings[i] = d3l_log_inst()->rings.back();
+                d3l_log_inst()->rings.pop_back();
+                delete ring;
+            }
+            else
+                i++;
+        }
+
+        d3l_log_inst()->written += num;
+        d3l_log_inst()->cv_done.notify_all();
+        if(stopping)
+            break;
+    }
+}
+
+//! Stop the writer at process exit so queued records are not lost.
+static void d3l_log_exit()
+{
+    d3l_log_stop();
+}
+
+//! Start the background log writer.
+/*!
+  \brief Start the background log writer thread, log files stay opened.
+  \param[in] policy D3L_LOG_BLOCK, D3L_LOG_DROP or D3L_LOG_SYNC for full rings.
+  \param[in] flush_ms max milliseconds a record waits before written.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_log_start(int policy, int flush_ms)
+{
+    static std::once_flag exit_flag;
+    std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+    if(1 == d3l_log_inst()->state.load() || 2 == d3l_log_inst()->state.load())
+        return 0;
+    d3l_log_inst()->policy.store(policy, std::memory_order_relaxed);
+    d3l_log_inst()->flush_ms = flush_ms > 0 ? flush_ms : D3L_LOG_FLUSH_MS;
+    d3l_log_inst()->wake = false;
+    d3l_log_inst()->state.store(1);
+    d3l_log_inst()->writer = std::thread(d3l_log_run);
+    std::call_once(exit_flag, []{ atexit(d3l_log_exit); });
+    return 0;
+}
+
+//! Put a log record into the log writer.
+/*!
+  \brief Put a log record into the ring of current thread, no lock is taken
+         after the first call of the thread. The writer is started at first use.
+  \param[in] sz_err log information.
+  \param[in] sz_file log file path.
+  \retval ==0 Successed; ==1 Dropped; <0 Failed.
+ */
+int d3l_log_write(const char *sz_err, const char *sz_file)
+{
+    if(0 == d3l_log_inst()->state.load(std::memory_order_acquire))
+        d3l_log_start(D3L_LOG_BLOCK, D3L_LOG_FLUSH_MS);
+    if(1 != d3l_log_inst()->state.load(std::memory_order_acquire))
+        return d3l_log_write_sync(sz_err, sz_file);
+
+    const size_t payload = sizeof(((d3l_log_slot *)0)->data);
+    size_t len = strlen(sz_err);
+    size_t need = len / payload + 1;
+    // Thread locals destroyed after the holder still log, but without a ring.
+    if(need > D3L_LOG_RING_SLOTS || d3l_log_local.dead)
+        return d3l_log_write_sync(sz_err, sz_file);
+
+    unsigned short file = d3l_log_file_id(sz_file);
+    d3l_log_ring *ring = d3l_log_thread_ring();
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    while(tail + need - ring->head.load(std::memory_order_acquire) > D3L_LOG_RING_SLOTS)
+    {
+        int policy = d3l_log_inst()->policy.load(std::memory_order_relaxed);
+        if(D3L_LOG_DROP == policy)
+        {
+            d3l_log_inst()->dropped.fetch_add(1, std::memory_order_relaxed);
+            return 1;
+        }
+        if(D3L_LOG_SYNC == policy)
+            return d3l_log_write_sync(sz_err, sz_file);
+        // The writer is stopping or gone, nobody will free the ring.
+        if(1 != d3l_log_inst()->state.load(std::memory_order_acquire))
+            return d3l_log_write_sync(sz_err, sz_file);
+        {
+            std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+            d3l_log_inst()->wake = true;
+        }
+        d3l_log_inst()->cv_wake.notify_one();
+        std::this_thread::yield();
+    }
+
+    time_t timer = time(NULL);
+    for(size_t i = 0; i < need; i++)
+    {
+        d3l_log_slot &slot = ring->slots[(tail + i) % D3L_LOG_RING_SLOTS];
+        size_t n = len > payload ? payload : len;
+        slot.time = timer;
+        slot.file = file;
+        slot.len = static_cast<unsigned short>(n);
+        slot.more = (i + 1 < need);
+        memcpy(slot.data, sz_err, n);
+        sz_err += n;
+        len -= n;
+    }
+    d3l_log_inst()->queued.fetch_add(1, std::memory_order_relaxed);
+    ring->tail.store(tail + need, std::memory_order_release);
+
+    // Pairs with the fence of d3l_log_stop(): either its final drain sees the record,
+    // or this thread sees the writer stopped and writes the record itself.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(3 == d3l_log_inst()->state.load(std::memory_order_relaxed))
+    {
+        d3l_log_drain_stopped(ring);
+        return 0;
+    }
+
+    // Wake the writer early when the ring is half full.
+    if(tail + need - ring->head.load(std::memory_order_relaxed) > D3L_LOG_RING_SLOTS / 2)
+    {
+        {
+            std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+            d3l_log_inst()->wake = true;
+        }
+        d3l_log_inst()->cv_wake.notify_one();
+    }
+    return 0;
+}
+
+//! Wait until all queued log records are written.
+/*!
+  \brief Wake the log writer and wait until records queued before the call are written.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_log_flush(void)
+{
+    std::unique_lock<std::mutex> lock(d3l_log_inst()->mtx);
+    if(1 != d3l_log_inst()->state.load())
+        return 0;
+    unsigned long target = d3l_log_inst()->queued.load();
+    d3l_log_inst()->wake = true;
+    d3l_log_inst()->cv_wake.notify_one();
+    d3l_log_inst()->cv_done.wait(lock, [target]{ return d3l_log_inst()->written >= target ||
+            1 != d3l_log_inst()->state.load(); });
+    return 0;
+}
+
+//! Stop the background log writer.
+/*!
+  \brief Write all queued records, stop the writer and close log files.
+         Later records are written directly until d3l_log_start() is called.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_log_stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+        if(1 != d3l_log_inst()->state.load())
+            return 0;
+        d3l_log_inst()->state.store(2);
+        d3l_log_inst()->wake = true;
+    }
+    d3l_log_inst()->cv_wake.notify_one();
+    d3l_log_inst()->writer.join();
+
+    // Records put while the writer was exiting, later ones are written by their threads.
+    std::lock_guard<std::mutex> lock(d3l_log_inst()->mtx);
+    d3l_log_inst()->state.store(3);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    d3l_log_batch batch;
+    for(size_t i = 0; i < d3l_log_inst()->rings.size(); i++)
+        d3l_log_inst()->written += d3l_log_drain(d3l_log_inst()->rings[i], batch);
+    d3l_log_write_batch(batch);
+    d3l_log_close_files();
+    d3l_log_inst()->cv_done.notify_all();
+    return 0;
+}
+
+//! Get number of dropped log records.
+/*!
+  \brief Get number of log records dropped by D3L_LOG_DROP policy.
+  \retval dropped record number.
+ */
+unsigned long d3l_log_dropped(void)
+{
+    return d3l_log_inst()->dropped.load(std::memory_order_relaxed);
+}
+
+//! Get SIMD level of current cpu.
+/*!
+  \brief Get SIMD level of current cpu, checked once at first use.
+  \retval D3L_CPU_AVX2, D3L_CPU_SSE2 or D3L_CPU_SCALAR.
+ */
+static int d3l_cpu_level()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const int level = __builtin_cpu_supports("avx2") ? D3L_CPU_AVX2 :
+        (__builtin_cpu_supports("sse2") ? D3L_CPU_SSE2 : D3L_CPU_SCALAR);
+    return level;
+#else
+    return D3L_CPU_SCALAR;
+#endif
+}
+
+//! Count a byte in memory one byte at a time.
+static size_t d3l_simd_memcount_c(const unsigned char *buff, size_t len, unsigned char c)
+{
+    size_t num = 0;
+    for(size_t i = 0; i < len; i++)
+        num += (buff[i] == c);
+    return num;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//! Count a byte in memory 16 bytes at a time.
+__attribute__((target("sse2")))
+static size_t d3l_simd_memcount_sse2(const unsigned char *buff, size_t len, unsigned char c)
+{
+    const __m128i needle = _mm_set1_epi8(static_cast<char>(c));
+    const __m128i zero = _mm_setzero_si128();
+    size_t num = 0;
+    size_t i = 0;
+    while(i + 16 <= len)
+    {
+        // Byte counters overflow after 255 rounds.
+        __m128i acc = zero;
+        size_t round = std::min<size_t>((len - i) / 16, 255);
+        for(size_t k = 0; k < round; k++, i += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buff + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, needle));
+        }
+        __m128i sum = _mm_sad_epu8(acc, zero);
+        num += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+    return num + d3l_simd_memcount_c(buff + i, len - i, c);
+}
+
+//! Count a byte in memory 32 bytes at a time.
+__attribute__((target("avx2")))
+static size_t d3l_simd_memcount_avx2(const unsigned char *buff, size_t len, unsigned char c)
+{
+    const __m256i needle = _mm256_set1_epi8(static_cast<char>(c));
+    const __m256i zero = _mm256_setzero_si256();
+    size_t num = 0;
+    size_t i = 0;
+    while(i + 32 <= len)
+    {
+        // Byte counters overflow after 255 rounds.
+        __m256i acc = zero;
+        size_t round = std::min<size_t>((len - i) / 32, 255);
+        for(size_t k = 0; k < round; k++, i += 32)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buff + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, needle));
+        }
+        __m256i sum = _mm256_sad_epu8(acc, zero);
+        num += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+            _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+    }
+    return num + d3l_simd_memcount_c(buff + i, len - i, c);
+}
+#endif
+
+//! Count a byte in memory.
+/*!
+  \brief Count a byte in memory using the widest SIMD kernel of current cpu.
+  \param[in] buff memory point.
+  \param[in] len memory size.
+  \param[in] c byte to count.
+  \retval byte number.
+ */
+size_t d3l_simd_memcount(const void *buff, size_t len, int c)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(buff);
+#if defined(__x86_64__) || defined(__i386__)
+    if(D3L_CPU_AVX2 == d3l_cpu_level())
+        return d3l_simd_memcount_avx2(p, len, static_cast<unsigned char>(c));
+    if(D3L_CPU_SSE2 == d3l_cpu_level())
+        return d3l_simd_memcount_sse2(p, len, static_cast<unsigned char>(c));
+#endif
+    return d3l_simd_memcount_c(p, len, static_cast<unsigned char>(c));
+}
+
+//! Find the first of two bytes in memory one byte at a time.
+static const unsigned char *d3l_simd_memchr2_c(const unsigned char *buff, size_t len,
+        unsigned char c1, unsigned char c2)
+{
+    for(size_t i = 0; i < len; i++)
+    {
+        if(buff[i] == c1 || buff[i] == c2)
+            return buff + i;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//! Find the first of two bytes in memory 16 bytes at a time.
+__attribute__((target("sse2")))
+static const unsigned char *d3l_simd_memchr2_sse2(const unsigned char *buff, size_t len,
+        unsigned char c1, unsigned char c2)
+{
+    const __m128i n1 = _mm_set1_epi8(static_cast<char>(c1));
+    const __m128i n2 = _mm_set1_epi8(static_cast<char>(c2));
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buff + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, n1), _mm_cmpeq_epi8(v, n2)));
+        if(0 != mask)
+            return buff + i + __builtin_ctz(mask);
+    }
+    return d3l_simd_memchr2_c(buff + i, len - i, c1, c2);
+}
+
+//! Find the first of two bytes in memory 32 bytes at a time.
+__attribute__((target("avx2")))
+static const unsigned char *d3l_simd_memchr2_avx2(const unsigned char *buff, size_t len,
+        unsigned char c1, unsigned char c2)
+{
+    const __m256i n1 = _mm256_set1_epi8(static_cast<char>(c1));
+    const __m256i n2 = _mm256_set1_epi8(static_cast<char>(c2));
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buff + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, n1),
+                    _mm256_cmpeq_epi8(v, n2)));
+        if(0 != mask)
+            return buff + i + __builtin_ctz(mask);
+    }
+    return d3l_simd_memchr2_c(buff + i, len - i, c1, c2);
+}
+#endif
+
+//! Find the first of two bytes in memory.
+/*!
+  \brief Find the first of two bytes in memory using the widest SIMD kernel of
+         current cpu.
+  \param[in] buff memory point.
+  \param[in] len memory size.
+  \param[in] c1 first byte to find.
+  \param[in] c2 second byte to find.
+  \retval point of the first c1 or c2; NULL if not found.
+ */
+const void *d3l_simd_memchr2(const void *buff, size_t len, int c1, int c2)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(buff);
+#if defined(__x86_64__) || defined(__i386__)
+    if(D3L_CPU_AVX2 == d3l_cpu_level())
+        return d3l_simd_memchr2_avx2(p, len, static_cast<unsigned char>(c1), static_cast<unsigned char>(c2));
+    if(D3L_CPU_SSE2 == d3l_cpu_level())
+        return d3l_simd_memchr2_sse2(p, len, static_cast<unsigned char>(c1), static_cast<unsigned char>(c2));
+#endif
+    return d3l_simd_memchr2_c(p, len, static_cast<unsigned char>(c1), static_cast<unsigned char>(c2));
+}
+
+//! Get bit mask of a byte in up to 64 bytes, one byte at a time.
+static uint64_t d3l_simd_bytemask_c(const unsigned char *buff, size_t len, unsigned char c)
+{
+    uint64_t mask = 0;
+    for(size_t i = 0; i < len; i++)
+        mask |= static_cast<uint64_t>(buff[i] == c) << i;
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//! Get bit mask of a byte in up to 64 bytes, 16 bytes at a time.
+__attribute__((target("sse2")))
+static uint64_t d3l_simd_bytemask_sse2(const unsigned char *buff, size_t len, unsigned char c)
+{
+    if(len < 64)
+        return d3l_simd_bytemask_c(buff, len, c);
+    const __m128i needle = _mm_set1_epi8(static_cast<char>(c));
+    uint64_t mask = 0;
+    for(int i = 0; i < 4; i++)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buff + i * 16));
+        mask |= static_cast<uint64_t>(static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)))) << (i * 16);
+    }
+    return mask;
+}
+
+//! Get bit mask of a byte in up to 64 bytes, 32 bytes at a time.
+__attribute__((target("avx2")))
+static uint64_t d3l_simd_bytemask_avx2(const unsigned char *buff, size_t len, unsigned char c)
+{
+    if(len < 64)
+        return d3l_simd_bytemask_c(buff, len, c);
+    const __m256i needle = _mm256_set1_epi8(static_cast<char>(c));
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buff));
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buff + 32));
+    uint64_t mask_lo = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle)));
+    uint64_t mask_hi = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)));
+    return mask_lo | (mask_hi << 32);
+}
+#endif
+
+//! Byte mask kernel.
+typedef uint64_t (*d3l_simd_bytemask_fn)(const unsigned char *, size_t, unsigned char);
+
+//! Get byte mask kernel of current cpu.
+static d3l_simd_bytemask_fn d3l_simd_bytemask_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(D3L_CPU_AVX2 == d3l_cpu_level())
+        return d3l_simd_bytemask_avx2;
+    if(D3L_CPU_SSE2 == d3l_cpu_level())
+        return d3l_simd_bytemask_sse2;
+#endif
+    return d3l_simd_bytemask_c;
+}
+
+//! Find a needle in memory using Two-Way.
+/*!
+  \brief glibc memmem() implements Two-Way, linear in the haystack for any
+         needle, so it is used for long needles and periodic text.
+ */
+static const unsigned char *d3l_simd_memmem_twoway(const unsigned char *hay, size_t len,
+        const unsigned char *needle, size_t needle_len)
+{
+    return static_cast<const unsigned char *>(memmem(hay, len, needle, needle_len));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//! Find a needle in memory matching its first and last bytes 16 positions at a time.
+__attribute__((target("sse2")))
+static const unsigned char *d3l_simd_memmem_sse2(const unsigned char *hay, size_t len,
+        const unsigned char *needle, size_t needle_len)
+{
+    const __m128i first = _mm_set1_epi8(static_cast<char>(needle[0]));
+    const __m128i last = _mm_set1_epi8(static_cast<char>(needle[needle_len - 1]));
+    size_t verified = 0;
+    size_t i = 0;
+    for(; i + needle_len + 15 <= len; i += 16)
+    {
+        __m128i bf = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hay + i));
+        __m128i bl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hay + i + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+        while(0 != mask)
+        {
+            size_t pos = i + __builtin_ctz(mask);
+            if(0 == memcmp(hay + pos + 1, needle + 1, needle_len - 2))
+                return hay + pos;
+            mask &= mask - 1;
+            verified += needle_len;
+        }
+        // Too many false candidates, the text is periodic.
+        if(verified > D3L_SIMD_MEMMEM_BUDGET * (i + 16) + 4096)
+            break;
+    }
+    return d3l_simd_memmem_twoway(hay + i, len - i, needle, needle_len);
+}
+
+//! Find a needle in memory matching its first and last bytes 32 positions at a time.
+__attribute__((target("avx2")))
+static const unsigned char *d3l_simd_memmem_avx2(const unsigned char *hay, size_t len,
+        const unsigned char *needle, size_t needle_len)
+{
+    const __m256i first = _mm256_set1_epi8(static_cast<char>(needle[0]));
+    const __m256i last = _mm256_set1_epi8(static_cast<char>(needle[needle_len - 1]));
+    size_t verified = 0;
+    size_t i = 0;
+    for(; i + needle_len + 31 <= len; i += 32)
+    {
+        __m256i bf = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hay + i));
+        __m256i bl = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hay + i + needle_len - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+                    _mm256_cmpeq_epi8(bl, last)));
+        while(0 != mask)
+        {
+            size_t pos = i + __builtin_ctz(mask);
+            if(0 == memcmp(hay + pos + 1, needle + 1, needle_len - 2))
+                return hay + pos;
+            mask &= mask - 1;
+            verified += needle_len;
+        }
+        // Too many false candidates, the text is periodic.
+        if(verified > D3L_SIMD_MEMMEM_BUDGET * (i + 32) + 4096)
+            break;
+    }
+    return d3l_simd_memmem_twoway(hay + i, len - i, needle, needle_len);
+}
+#endif
+
+//! Find a needle in memory.
+/*!
+  \brief Find a needle in memory. Candidates whose first and last bytes match
+         are found with the widest SIMD kernel of current cpu and verified by
+         memcmp(). Needles longer than D3L_SIMD_MEMMEM_LONG, and text where
+         verification costs too much, use the Two-Way fallback.
+  \param[in] hay memory point.
+  \param[in] len memory size.
+  \param[in] needle needle point.
+  \param[in] needle_len needle size.
+  \retval point of the first match; NULL if not found.
+ */
+const void *d3l_simd_memmem(const void *hay, size_t len, const void *needle, size_t needle_len)
+{
+    const unsigned char *h = static_cast<const unsigned char *>(hay);
+    const unsigned char *n = static_cast<const unsigned char *>(needle);
+    if(0 == needle_len)
+        return hay;
+    if(needle_len > len)
+        return NULL;
+    if(1 == needle_len)
+        return memchr(hay, n[0], len);
+#if defined(__x86_64__) || defined(__i386__)
+    if(needle_len <= D3L_SIMD_MEMMEM_LONG)
+    {
+        if(D3L_CPU_AVX2 == d3l_cpu_level())
+            return d3l_simd_memmem_avx2(h, len, n, needle_len);
+        if(D3L_CPU_SSE2 == d3l_cpu_level())
+            return d3l_simd_memmem_sse2(h, len, n, needle_len);
+    }
+#endif
+    return d3l_simd_memmem_twoway(h, len, n, needle_len);
+}
+
+//! Header in front of every pool block.
+struct d3l_mem_head
+{
+    uint32_t cls;       //!< size class, D3L_MEM_CLASS_LARGE for malloc() blocks.
+    uint32_t pad;
+    uint64_t size;      //!< requested size.
+};
+
+//! Free block of a size class.
+struct d3l_mem_node
+{
+    d3l_mem_node *next;
+};
+
+//! Free lists shared by all threads, filled when a thread caches too much or exits.
+struct d3l_mem_depot
+{
+    std::mutex mtx;
+    d3l_mem_node *lists[D3L_MEM_CLASSES];
+};
+
+//! Get free list depot, it is never destroyed since blocks may be freed in static destructors.
+static d3l_mem_depot *d3l_mem_depot_inst()
+{
+    static d3l_mem_depot *depot = new d3l_mem_depot();
+    return depot;
+}
+
+//! Free lists of one thread.
+struct d3l_mem_cache
+{
+    d3l_mem_node *lists[D3L_MEM_CLASSES];
+    size_t counts[D3L_MEM_CLASSES];
+    ~d3l_mem_cache()
+    {
+        d3l_mem_depot *depot = d3l_mem_depot_inst();
+        std::lock_guard<std::mutex> lock(depot->mtx);
+        for(int i = 0; i < D3L_MEM_CLASSES; i++)
+        {
+            while(NULL != lists[i])
+            {
+                d3l_mem_node *node = lists[i];
+                lists[i] = node->next;
+                node->next = depot->lists[i];
+                depot->lists[i] = node;
+            }
+            counts[i] = 0;
+        }
+    }
+};
+static thread_local d3l_mem_cache d3l_mem_tls;
+
+//! Get size class of a block size, block sizes are powers of two from 16.
+static inline int d3l_mem_class(size_t size)
+{
+    return (size <= 16) ? 0 : 64 - __builtin_clzll(size - 1) - 4;
+}
+
+//! Refill the free list of a size class from the depot or a new slab.
+static d3l_mem_node *d3l_mem_refill(int cls)
+{
+    size_t block = static_cast<size_t>(16) << cls;
+    d3l_mem_depot *depot = d3l_mem_depot_inst();
+    {
+        std::lock_guard<std::mutex> lock(depot->mtx);
+        d3l_mem_node *node = depot->lists[cls];
+        if(NULL != node)
+        {
+            d3l_mem_node *last = node;
+            size_t num = 1;
+            for(; NULL != last->next && num < D3L_MEM_POOL_CACHE / 2; num++)
+                last = last->next;
+            depot->lists[cls] = last->next;
+            last->next = NULL;
+            d3l_mem_tls.counts[cls] += num;
+            return node;
+        }
+    }
+
+    // Slabs are never returned, blocks move between threads through the depot.
+    char *slab = static_cast<char *>(malloc(D3L_MEM_SLAB_SIZE));
+    if(NULL == slab)
+        return NULL;
+    size_t num = D3L_MEM_SLAB_SIZE / block;
+    d3l_mem_node *head = NULL;
+    for(size_t i = num; i > 0; i--)
+    {
+        d3l_mem_node *node = reinterpret_cast<d3l_mem_node *>(slab + (i - 1) * block);
+        node->next = head;
+        head = node;
+    }
+    d3l_mem_tls.counts[cls] += num;
+    return head;
+}
+
+//! Allocate memory from the pool.
+/*!
+  \brief Allocate memory aligned to 16 bytes. Blocks up to D3L_MEM_POOL_MAX come
+         from per-thread size-class free lists, larger ones from malloc().
+  \param[in] size memory size.
+  \retval memory point; NULL if failed.
+ */
+void *d3l_mem_alloc(size_t size)
+{
+    size_t total = size + sizeof(d3l_mem_head);
+    d3l_mem_head *head = NULL;
+    if(total <= D3L_MEM_POOL_MAX)
+    {
+        int cls = d3l_mem_class(total);
+        d3l_mem_node *node = d3l_mem_tls.lists[cls];
+        if(NULL == node && NULL == (node = d3l_mem_refill(cls)))
+            return NULL;
+        d3l_mem_tls.lists[cls] = node->next;
+        d3l_mem_tls.counts[cls]--;
+        head = reinterpret_cast<d3l_mem_head *>(node);
+        head->cls = cls;
+    }
+    else
+    {
+        if(total < size || NULL == (head = static_cast<d3l_mem_head *>(malloc(total))))
+            return NULL;
+        head->cls = D3L_MEM_CLASS_LARGE;
+    }
+    head->size = size;
+    return head + 1;
+}
+
+//! Free memory of the pool.
+/*!
+  \brief Free memory of d3l_mem_alloc() into the free list of current thread,
+         half of a full list moves to the shared depot.
+  \param[in] ptr memory point, NULL is ignored.
+ */
+void d3l_mem_release(void *ptr)
+{
+    if(NULL == ptr)
+        return;
+    d3l_mem_head *head = static_cast<d3l_mem_head *>(ptr) - 1;
+    if(D3L_MEM_CLASS_LARGE == head->cls)
+    {
+        free(head);
+        return;
+    }
+    int cls = head->cls;
+    d3l_mem_node *node = reinterpret_cast<d3l_mem_node *>(head);
+    node->next = d3l_mem_tls.lists[cls];
+    d3l_mem_tls.lists[cls] = node;
+    if(++d3l_mem_tls.counts[cls] < D3L_MEM_POOL_CACHE)
+        return;
+
+    d3l_mem_node *first = d3l_mem_tls.lists[cls];
+    d3l_mem_node *last = first;
+    for(size_t i = 1; i < D3L_MEM_POOL_CACHE / 2; i++)
+        last = last->next;
+    d3l_mem_tls.lists[cls] = last->next;
+    d3l_mem_tls.counts[cls] -= D3L_MEM_POOL_CACHE / 2;
+    d3l_mem_depot *depot = d3l_mem_depot_inst();
+    std::lock_guard<std::mutex> lock(depot->mtx);
+    last->next = depot->lists[cls];
+    depot->lists[cls] = first;
+}
+
+//! Get requested size of pool memory.
+/*!
+  \brief Get requested size of pool memory.
+  \param[in] ptr memory point of d3l_mem_alloc().
+  \retval memory size.
+ */
+size_t d3l_mem_size(const void *ptr)
+{
+    return (static_cast<const d3l_mem_head *>(ptr) - 1)->size;
+}
+
+//! Allocate aligned memory.
+/*!
+  \brief Allocate memory aligned to align bytes using posix_memalign(). With
+         D3L_MEM_HUGEPAGE it is mapped in 2MB aligned huge pages instead, from
+         reserved huge pages when possible, else transparent huge pages.
+  \param[in] size memory size.
+  \param[in] align alignment, a power of two such as 64 or 4096.
+  \param[in] flags D3L_MEM_HUGEPAGE or 0.
+  \retval memory point, free it with d3l_mem_aligned_free(); NULL if failed.
+ */
+void *d3l_mem_aligned(size_t size, size_t align, int flags)
+{
+    if(flags & D3L_MEM_HUGEPAGE)
+    {
+        size_t len = (size + D3L_MEM_HUGE_SIZE - 1) & ~static_cast<size_t>(D3L_MEM_HUGE_SIZE - 1);
+        void *addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if(MAP_FAILED != addr)
+            return addr;
+        // Map one more huge page and trim the edges so the range is 2MB aligned.
+        char *raw = static_cast<char *>(mmap(NULL, len + D3L_MEM_HUGE_SIZE, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+        if(MAP_FAILED == static_cast<void *>(raw))
+            return NULL;
+        uintptr_t start = (reinterpret_cast<uintptr_t>(raw) + D3L_MEM_HUGE_SIZE - 1) &
+            ~static_cast<uintptr_t>(D3L_MEM_HUGE_SIZE - 1);
+        char *aligned = reinterpret_cast<char *>(start);
+        if(aligned != raw)
+            munmap(raw, aligned - raw);
+        size_t tail = (raw + len + D3L_MEM_HUGE_SIZE) - (aligned + len);
+        if(tail > 0)
+            munmap(aligned + len, tail);
+        madvise(aligned, len, MADV_HUGEPAGE);
+        return aligned;
+    }
+    void *ptr = NULL;
+    if(0 != posix_memalign(&ptr, std::max(align, sizeof(void *)), size))
+        return NULL;
+    return ptr;
+}
+
+//! Free aligned memory.
+/*!
+  \brief Free memory of d3l_mem_aligned().
+  \param[in] ptr memory point, NULL is ignored.
+  \param[in] size memory size passed to d3l_mem_aligned().
+  \param[in] flags flags passed to d3l_mem_aligned().
+ */
+void d3l_mem_aligned_free(void *ptr, size_t size, int flags)
+{
+    if(NULL == ptr)
+        return;
+    if(flags & D3L_MEM_HUGEPAGE)
+        munmap(ptr, (size + D3L_MEM_HUGE_SIZE - 1) & ~static_cast<size_t>(D3L_MEM_HUGE_SIZE - 1));
+    else
+        free(ptr);
+}
+
+//! Create an arena.
+/*!
+  \brief Create an arena allocating blocks of block_size bytes on demand.
+  \param[in] block_size default block size.
+ */
+d3l_mem_arena::d3l_mem_arena(size_t block_size)
+    : cur_(0), end_(0), block_(0), block_size_(block_size)
+{
+}
+
+d3l_mem_arena::~d3l_mem_arena()
+{
+    for(size_t i = 0; i < blocks_.size(); i++)
+        d3l_mem_aligned_free(blocks_[i], sizes_[i], 0);
+}
+
+//! Move to a block with room, reusing blocks kept by reset().
+void *d3l_mem_arena::grow(size_t size, size_t align)
+{
+    size_t need = size + align;
+    while(block_ < blocks_.size() && sizes_[block_] < need)
+        block_++;
+    if(block_ == blocks_.size())
+    {
+        size_t len = std::max(block_size_, need);
+        char *block = static_cast<char *>(d3l_mem_aligned(len, D3L_MEM_LINE_SIZE, 0));
+        if(NULL == block)
+            return NULL;
+        blocks_.push_back(block);
+        sizes_.push_back(len);
+    }
+    cur_ = reinterpret_cast<uintptr_t>(blocks_[block_]);
+    end_ = cur_ + sizes_[block_];
+    block_++;
+    return alloc(size, align);
+}
+
+//! Reset the arena to a mark.
+/*!
+  \brief Reset the arena to a mark of mark(), memory allocated after it is
+         reused by later allocations. Blocks are kept.
+  \param[in] mark arena mark.
+ */
+void d3l_mem_arena::reset(const d3l_mem_arena_mark &mark)
+{
+    block_ = mark.block;
+    cur_ = mark.cur;
+    end_ = (0 == block_) ? 0 : reinterpret_cast<uintptr_t>(blocks_[block_ - 1]) + sizes_[block_ - 1];
+}
+
+//! Return a file access stat.
+/*!
+  \brief Return a file access stat using access function.
+  \param[in] sz_file file path.
+  \param[in] mode R_OK(Read) W_OK(Write) X_OK(Execute) F_OK(Exist).
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_access(const char *sz_file, int mode)
+{
+    if(access(sz_file, mode) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_access(const char *, int) File ";
+        str_err = str_err + sz_file + " access error!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+//! Remove a file from disk.
+/*!
+  \brief Remove a file from disk using unlink command.
+  \param[in] sz_file file path.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_remove(const char *sz_file)
+{
+    if(unlink(sz_file) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_remove(const char *) File ";
+        str_err = str_err + sz_file + " can't be removed!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//! Count newlines of memory in parallel.
+static int64_t d3l_fop_count_lines(const char *buff, size_t len)
+{
+    size_t thread_num = std::thread::hardware_concurrency();
+    thread_num = std::min<size_t>(thread_num, len / (D3L_FOP_PARALLEL_SIZE / 4));
+    if(len < D3L_FOP_PARALLEL_SIZE || thread_num < 2)
+        return d3l_simd_memcount(buff, len, '\n');
+
+    std::vector<std::thread> threads;
+    std::vector<size_t> nums(thread_num, 0);
+    size_t step = len / thread_num;
+    for(size_t i = 0; i < thread_num; i++)
+    {
+        size_t begin = i * step;
+        size_t size = (i + 1 == thread_num) ? len - begin : step;
+        threads.push_back(std::thread([buff, begin, size, &nums, i]
+        {
+            nums[i] = d3l_simd_memcount(buff + begin, size, '\n');
+        }));
+    }
+    int64_t num = 0;
+    for(size_t i = 0; i < thread_num; i++)
+    {
+        threads[i].join();
+        num += nums[i];
+    }
+    return num;
+}
+
+//! Get compression format by magic bytes.
+/*!
+  \brief Get compression format by magic bytes, only formats compiled in are reported.
+         A gzip head needs the deflate method and clear reserved flags too, so raw
+         binary data rarely passes for compressed.
+  \retval D3L_ZIP_NONE, D3L_ZIP_GZIP or D3L_ZIP_ZSTD.
+ */
+static int d3l_zip_format(const unsigned char *head, size_t len)
+{
+#ifdef D3L_ZLIB
+    if(len >= 4 && 0x1F == head[0] && 0x8B == head[1] && 8 == head[2] && 0 == (head[3] & 0xE0))
+        return D3L_ZIP_GZIP;
+#endif
+#ifdef D3L_ZSTD
+    if(len >= 4 && 0x28 == head[0] && 0xB5 == head[1] && 0x2F == head[2] && 0xFD == head[3])
+        return D3L_ZIP_ZSTD;
+#endif
+    (void)head;
+    (void)len;
+    return D3L_ZIP_NONE;
+}
+
+//! Get line number of file.
+/*!
+  \brief Get line number of file by counting '\n' of the mapped file, a last
+         line without '\n' is counted too. Files not mappable and compressed
+         files are read in blocks through d3l_fop_zreader, and large files are
+         counted by several threads.
+  \param[in] sz_file file path.
+  \retval >=0 Line num; <0 Failed.
+ */
+int64_t d3l_fop_linenum(const char *sz_file)
+{
+    int fd = open(sz_file, O_RDONLY|O_CLOEXEC);
+    struct stat statbuf;
+    if(fd < 0 || fstat(fd, &statbuf) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_linenum(const char *) File ";
+        str_err = str_err + sz_file + " can't be opened!";
+        d3l_sys_err(str_err.c_str());
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    int64_t num = 0;
+    char last = '\n';
+    void *addr = MAP_FAILED;
+    unsigned char head[4];
+    ssize_t head_len = pread(fd, head, sizeof(head), 0);
+    bool zip = (D3L_ZIP_NONE != d3l_zip_format(head, std::max<ssize_t>(head_len, 0)));
+    if(S_ISREG(statbuf.st_mode) && statbuf.st_size > 0 && !zip)
+        addr = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(MAP_FAILED != addr)
+    {
+        size_t size = statbuf.st_size;
+        madvise(addr, size, MADV_SEQUENTIAL);
+        num = d3l_fop_count_lines(static_cast<const char *>(addr), size);
+        last = static_cast<const char *>(addr)[size - 1];
+        munmap(addr, size);
+    }
+    else
+    {
+        // Pipes and compressed files are read through the decompressor.
+        d3l_fop_zreader reader;
+        char *buff = static_cast<char *>(d3l_mem_aligned(D3L_FOP_BLOCK_SIZE, D3L_MEM_PAGE_SIZE, 0));
+        int64_t len = (NULL == buff) ? -1 : reader.attach(fd);
+        while(len >= 0 && (len = reader.read(buff, D3L_FOP_BLOCK_SIZE)) > 0)
+        {
+            num += d3l_simd_memcount(buff, len, '\n');
+            last = buff[len - 1];
+        }
+        reader.close();
+        d3l_mem_aligned_free(buff, D3L_FOP_BLOCK_SIZE, 0);
+        if(NULL == buff || len < 0)
+        {
+            std::string str_err = "ERROR d3l::d3l_fop_linenum(const char *) File ";
+            str_err = str_err + sz_file + " read error!";
+            d3l_sys_err(str_err.c_str());
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return '\n' == last ? num : num + 1;
+}
+
+//! Get the size of file.
+/*!
+  \brief Get the size of file using d3l_fop_stat(), without opening it.
+  \param[in] sz_file file path.
+  \retval >=0 File size; <0 Failed.
+ */
+int64_t d3l_fop_size(const char *sz_file)
+{
+    struct d3l_fop_meta meta;
+    if(d3l_fop_stat(sz_file, &meta, 0) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_size(const char *) File ";
+        str_err = str_err + sz_file + " can't be stat!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    return meta.size;
+}
+
+//! Read a range of fd with pread(), retry on short read and EINTR.
+static int64_t d3l_fop_pread_all(int fd, char *buff, uint64_t size, uint64_t offset)
+{
+    uint64_t done = 0;
+    while(done < size)
+    {
+        ssize_t len = pread(fd, buff + done, std::min<uint64_t>(size - done, 1U << 30), offset + done);
+        if(len < 0 && EINTR == errno)
+            continue;
+        if(len < 0)
+            return -1;
+        if(0 == len)
+            break;
+        done += len;
+    }
+    return done;
+}
+
+//! Read a file into a buffer by several threads.
+/*!
+  \brief Read a file into a preallocated buffer, split into D3L_FOP_CHUNK_SIZE
+         ranges taken by threads in turn, each filled by pread(). With
+         D3L_READ_DIRECT the whole pages are read with O_DIRECT, bypassing the
+         page cache, and the last partial page through the cache; it needs a
+         buffer aligned to the page size, and falls back to cached reading when
+         the buffer isn't or the file system refuses O_DIRECT.
+  \param[in] sz_file file path.
+  \param[out] buff memory point to output.
+  \param[in] size buffer size, not less than the file size.
+  \param[in] threads thread number, 0 means one per cpu.
+  \param[in] flags D3L_READ_DIRECT.
+  \param[in] progress called with bytes read and file size after each range,
+             from one reader thread at a time; NULL for none.
+  \param[in] arg argument passed to progress.
+  \retval >=0 File size; <0 Failed.
+ */
+int64_t d3l_fop_read_parallel(const char *sz_file, void *buff, uint64_t size, unsigned int threads,
+        int flags, d3l_fop_progress progress, void *arg)
+{
+    int fd = open(sz_file, O_RDONLY|O_CLOEXEC);
+    struct stat statbuf;
+    if(fd < 0 || fstat(fd, &statbuf) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_read_parallel(const char *, void *, uint64_t, unsigned int, int, d3l_fop_progress, void *) File ";
+        str_err = str_err + sz_file + " can't be opened!";
+        d3l_sys_err(str_err.c_str());
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    uint64_t file_size = statbuf.st_size;
+    if(file_size > size)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_read_parallel(const char *, void *, uint64_t, unsigned int, int, d3l_fop_progress, void *) File ";
+        str_err = str_err + sz_file + " is larger than the buffer!";
+        d3l_sys_err(str_err.c_str());
+        close(fd);
+        return -2;
+    }
+
+    char *out = static_cast<char *>(buff);
+    int direct_fd = -1;
+    uint64_t direct_size = 0;
+    if((flags & D3L_READ_DIRECT) && 0 == reinterpret_cast<uintptr_t>(out) % D3L_MEM_PAGE_SIZE)
+        direct_fd = open(sz_file, O_RDONLY|O_CLOEXEC|O_DIRECT);
+    if(direct_fd >= 0)
+        direct_size = file_size / D3L_MEM_PAGE_SIZE * D3L_MEM_PAGE_SIZE;
+    else
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t chunk_num = (file_size + D3L_FOP_CHUNK_SIZE - 1) / D3L_FOP_CHUNK_SIZE;
+    if(0 == threads)
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    threads = std::max<uint64_t>(std::min<uint64_t>(threads, chunk_num), 1);
+    std::atomic<uint64_t> next(0);
+    std::atomic<int> rs(0);
+    std::mutex progress_mutex;
+    uint64_t done = 0;
+    auto reader = [&]
+    {
+        uint64_t idx;
+        while(0 == rs.load(std::memory_order_relaxed) && (idx = next.fetch_add(1)) < chunk_num)
+        {
+            uint64_t begin = idx * D3L_FOP_CHUNK_SIZE;
+            uint64_t end = std::min<uint64_t>(begin + D3L_FOP_CHUNK_SIZE, file_size);
+            // Whole pages of [begin, mid) go through O_DIRECT.
+            uint64_t mid = std::max(begin, std::min(end, direct_size));
+            int64_t len = 0;
+            if(mid > begin)
+                len = d3l_fop_pread_all(direct_fd, out + begin, mid - begin, begin);
+            if(len == static_cast<int64_t>(mid - begin) && end > mid)
+            {
+                int64_t tail = d3l_fop_pread_all(fd, out + mid, end - mid, mid);
+                len = (tail < 0) ? tail : len + tail;
+            }
+            if(len != static_cast<int64_t>(end - begin))
+            {
+                int expected = 0;
+                rs.compare_exchange_strong(expected, -3);
+                break;
+            }
+            if(NULL != progress)
+            {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                done += end - begin;
+                if(0 != progress(done, file_size, arg))
+                {
+                    int expected = 0;
+                    rs.compare_exchange_strong(expected, -4);
+                }
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for(unsigned int i = 1; i < threads; i++)
+        pool.push_back(std::thread(reader));
+    reader();
+    for(size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+    if(direct_fd >= 0)
+        close(direct_fd);
+    close(fd);
+    if(-3 == rs.load())
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_read_parallel(const char *, void *, uint64_t, unsigned int, int, d3l_fop_progress, void *) File ";
+        str_err = str_err + sz_file + " read error!";
+        d3l_sys_err(str_err.c_str());
+    }
+    return (0 == rs.load()) ? static_cast<int64_t>(file_size) : rs.load();
+}
+
+//! Open a file using ifstream.
+/*!
+  \brief Open a file using ifstream.
+  \param[in] ifstream infile stream.
+  \param[in] sz_file file path.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_open_ifstream(std::ifstream &ifs_in, const char *sz_file)
+{
+    ifs_in.open(sz_file);
+    if(ifs_in.fail())
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_open_ifstream(ifstream &, char *) File ";
+        str_err = str_err + sz_file + " can't be opened!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//! Write all buffers to fd, retry on short write and EINTR.
+static int64_t d3l_fop_writev_all(int fd, const struct iovec *iov, int iovcnt)
+{
+    std::vector<struct iovec> vec(iov, iov + iovcnt);
+    size_t pos = 0;
+    int64_t sum = 0;
+    while(pos < vec.size())
+    {
+        if(0 == vec[pos].iov_len)
+        {
+            pos++;
+            continue;
+        }
+        int num = static_cast<int>(std::min<size_t>(vec.size() - pos, IOV_MAX));
+        ssize_t rs = writev(fd, &vec[pos], num);
+        if(rs < 0 && EINTR == errno)
+            continue;
+        if(rs < 0)
+            return -1;
+        sum += rs;
+        // Skip the written buffers and move into the partly written one.
+        while(rs > 0 && pos < vec.size())
+        {
+            size_t len = std::min<size_t>(rs, vec[pos].iov_len);
+            vec[pos].iov_base = static_cast<char *>(vec[pos].iov_base) + len;
+            vec[pos].iov_len -= len;
+            rs -= len;
+            if(0 == vec[pos].iov_len)
+                pos++;
+        }
+    }
+    return sum;
+}
+
+//! Create a named temp file next to sz_file with the mode new files get.
+static int d3l_fop_temp_open(const std::string &str_file, std::string &str_tmp)
+{
+    static std::atomic<unsigned int> counter(0);
+    for(;;)
+    {
+        char sz_suffix[64];
+        snprintf(sz_suffix, sizeof(sz_suffix), ".%d.%u", static_cast<int>(getpid()), counter++);
+        str_tmp = str_file + sz_suffix;
+        int fd = open(str_tmp.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0777);
+        if(fd >= 0 || EEXIST != errno)
+            return fd;
+    }
+}
+
+//! Fill a temp file, set its mode and sync it.
+/*!
+  \brief Fill a temp file, set its mode and sync it as given by flags.
+  \retval >=0 Written size; <0 Failed with str_err set.
+ */
+static int64_t d3l_fop_temp_fill(int fd, const struct iovec *iov, int iovcnt, int flags,
+        int mode, std::string &str_err)
+{
+    int64_t sum = 0;
+    if(mode >= 0 && fchmod(fd, mode) < 0)
+        str_err = " mode can't be set!";
+    if(str_err.empty() && (flags & D3L_WRITE_PREALLOC))
+    {
+        for(int i = 0; i < iovcnt; i++)
+            sum += iov[i].iov_len;
+        if(sum > 0 && fallocate(fd, 0, 0, sum) < 0 && EOPNOTSUPP != errno)
+            str_err = " space can't be allocated!";
+    }
+    if(str_err.empty() && (sum = d3l_fop_writev_all(fd, iov, iovcnt)) < 0)
+        str_err = " can't be written!";
+    if(str_err.empty() && D3L_SYNC_DATA == (flags & D3L_SYNC_MASK) && fdatasync(fd) < 0)
+        str_err = " can't be synced!";
+    if(str_err.empty() && D3L_SYNC_FULL == (flags & D3L_SYNC_MASK) && fsync(fd) < 0)
+        str_err = " can't be synced!";
+    return str_err.empty() ? sum : -1;
+}
+
+//! Write buffers to a file atomically.
+/*!
+  \brief Write buffers into a temp file in the directory of sz_file, then rename
+         it over sz_file, so readers see either the old or the whole new file.
+         O_TMPFILE is used when the file system supports it and /proc can name
+         it, so a crash leaves no temp file behind, otherwise a named temp file.
+         The new file keeps the mode of the old one, or gets 0777 minus umask
+         as d3l_fop_write() always created files.
+  \param[in] sz_file file path.
+  \param[in] iov buffers to write.
+  \param[in] iovcnt buffer number.
+  \param[in] flags D3L_SYNC_NONE, D3L_SYNC_DATA (fdatasync) or D3L_SYNC_FULL (fsync
+             file and directory), optionally with D3L_WRITE_PREALLOC.
+  \retval >=0 Written size; <0 Failed.
+ */
+int64_t d3l_fop_writev(const char *sz_file, const struct iovec *iov, int iovcnt, int flags)
+{
+    // Set once linkat() of /proc/self/fd failed, as without /proc mounted.
+    static std::atomic<bool> no_proc_link(false);
+    std::string str_file = sz_file;
+    std::string::size_type pos = str_file.rfind('/');
+    std::string str_dir = std::string::npos == pos ? "." : (0 == pos ? "/" : str_file.substr(0, pos));
+    std::string str_tmp;
+    std::string str_err;
+
+    // Both temp files are created 0777 minus umask, an existing file keeps its mode.
+    struct stat statbuf;
+    int mode = (0 == stat(sz_file, &statbuf)) ? static_cast<int>(statbuf.st_mode & 07777) : -1;
+
+    int64_t sum = -1;
+    int fd = -1;
+#ifdef O_TMPFILE
+    if(!no_proc_link.load(std::memory_order_relaxed))
+        fd = open(str_dir.c_str(), O_TMPFILE|O_WRONLY|O_CLOEXEC, 0777);
+    if(fd >= 0 && (sum = d3l_fop_temp_fill(fd, iov, iovcnt, flags, mode, str_err)) >= 0)
+    {
+        // Give the anonymous file a temp name, it can't replace sz_file directly.
+        char sz_proc[64];
+        snprintf(sz_proc, sizeof(sz_proc), "/proc/self/fd/%d", fd);
+        static std::atomic<unsigned int> counter(0);
+        for(;;)
+        {
+            char sz_suffix[64];
+            snprintf(sz_suffix, sizeof(sz_suffix), ".%d.t%u", static_cast<int>(getpid()), counter++);
+            str_tmp = str_file + sz_suffix;
+            if(0 == linkat(AT_FDCWD, sz_proc, AT_FDCWD, str_tmp.c_str(), AT_SYMLINK_FOLLOW))
+                break;
+            if(EEXIST != errno)
+            {
+                // Write again through a named temp file.
+                str_tmp.clear();
+                no_proc_link.store(true, std::memory_order_relaxed);
+                close(fd);
+                fd = -1;
+                break;
+            }
+        }
+    }
+#endif
+    if(fd < 0 && str_err.empty())
+    {
+        fd = d3l_fop_temp_open(str_file, str_tmp);
+        if(fd < 0)
+        {
+            str_err = "ERROR d3l::d3l_fop_writev(const char *, const struct iovec *, int, int) File ";
+            str_err = str_err + sz_file + " temp file can't be created!";
+            d3l_sys_err(str_err.c_str());
+            return -1;
+        }
+        sum = d3l_fop_temp_fill(fd, iov, iovcnt, flags, mode, str_err);
+    }
+
+    if(close(fd) < 0 && str_err.empty())
+        str_err = " can't be closed!";
+    if(str_err.empty() && rename(str_tmp.c_str(), sz_file) < 0)
+        str_err = " can't be replaced!";
+    if(!str_err.empty())
+    {
+        if(!str_tmp.empty())
+            unlink(str_tmp.c_str());
+        str_err = "ERROR d3l::d3l_fop_writev(const char *, const struct iovec *, int, int) File " + str_file + str_err;
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+
+    if(D3L_SYNC_FULL == (flags & D3L_SYNC_MASK))
+    {
+        int fd_dir = open(str_dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if(fd_dir < 0 || fsync(fd_dir) < 0)
+        {
+            str_err = "ERROR d3l::d3l_fop_writev(const char *, const struct iovec *, int, int) Dir ";
+            str_err = str_err + str_dir + " can't be synced!";
+            d3l_sys_err(str_err.c_str());
+            sum = -1;
+        }
+        if(fd_dir >= 0)
+            close(fd_dir);
+    }
+    return sum;
+}
+
+//! Write a buffer to a file atomically.
+/*!
+  \brief Write a buffer to a file atomically using d3l_fop_writev().
+  \param[in] sz_file file path.
+  \param[in] buff memory point to input.
+  \param[in] size input memory size in bytes.
+  \param[in] flags D3L_SYNC_NONE, D3L_SYNC_DATA or D3L_SYNC_FULL, optionally with D3L_WRITE_PREALLOC.
+  \retval >=0 Written size; <0 Failed.
+ */
+int64_t d3l_fop_write_atomic(const char *sz_file, const void *buff, size_t size, int flags)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<void *>(buff);
+    iov.iov_len = size;
+    return d3l_fop_writev(sz_file, &iov, 1, flags);
+}
+
+//! Read one file of a batch using blocking calls.
+static void d3l_fop_batch_read_one(struct d3l_fop_batch_item *item)
+{
+    item->buff = NULL;
+    item->size = 0;
+    item->status = 0;
+    int fd = open(item->path, O_RDONLY|O_CLOEXEC);
+    struct stat statbuf;
+    if(fd < 0 || fstat(fd, &statbuf) < 0)
+    {
+        item->status = -errno;
+        if(fd >= 0)
+            close(fd);
+        return;
+    }
+    item->buff = static_cast<char *>(malloc(statbuf.st_size + 1));
+    if(NULL == item->buff)
+    {
+        item->status = -ENOMEM;
+        close(fd);
+        return;
+    }
+    while(item->size < statbuf.st_size)
+    {
+        ssize_t rs = pread(fd, item->buff + item->size, statbuf.st_size - item->size, item->size);
+        if(rs < 0 && EINTR == errno)
+            continue;
+        if(rs < 0)
+            item->status = -errno;
+        if(rs <= 0)
+            break;
+        item->size += rs;
+    }
+    item->buff[item->size] = '\0';
+    close(fd);
+}
+
+//! Read a batch of files using a thread pool.
+static int d3l_fop_batch_threads(struct d3l_fop_batch_item *items, size_t num, unsigned int depth)
+{
+    std::atomic<size_t> next(0);
+    size_t thread_num = std::min<size_t>(std::min<size_t>(depth, num), D3L_BATCH_MAX_THREADS);
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < thread_num; i++)
+    {
+        threads.push_back(std::thread([items, num, &next]
+        {
+            size_t idx;
+            while((idx = next.fetch_add(1)) < num)
+                d3l_fop_batch_read_one(&items[idx]);
+        }));
+    }
+    for(size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    return 0;
+}
+
+#ifdef __NR_io_uring_setup
+//! Minimal io_uring instance, only what the batch reader needs.
+struct d3l_uring
+{
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned int sq_local_tail;
+    unsigned int inflight;
+};
+
+//! Release an io_uring instance.
+static void d3l_uring_exit(d3l_uring *ring)
+{
+    if(NULL != ring->sqes && MAP_FAILED != static_cast<void *>(ring->sqes))
+        munmap(ring->sqes, ring->sqes_size);
+    if(NULL != ring->cq_ptr && MAP_FAILED != ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if(NULL != ring->sq_ptr && MAP_FAILED != ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if(ring->fd >= 0)
+        close(ring->fd);
+}
+
+//! Set up an io_uring instance supporting the batch reader operations.
+static int d3l_uring_init(d3l_uring *ring, unsigned int entries)
+{
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0)
+        return -1;
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_size = ring->cq_size = std::max(ring->sq_size, ring->cq_size);
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == ring->sq_ptr)
+    {
+        d3l_uring_exit(ring);
+        return -1;
+    }
+    ring->cq_ptr = ring->sq_ptr;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                ring->fd, IORING_OFF_CQ_RING);
+        if(MAP_FAILED == ring->cq_ptr)
+        {
+            d3l_uring_exit(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = static_cast<struct io_uring_sqe *>(mmap(NULL, ring->sqes_size,
+                PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES));
+    if(MAP_FAILED == static_cast<void *>(ring->sqes))
+    {
+        d3l_uring_exit(ring);
+        return -1;
+    }
+
+    char *sq = static_cast<char *>(ring->sq_ptr);
+    char *cq = static_cast<char *>(ring->cq_ptr);
+    ring->sq_head = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+    ring->sq_tail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+    ring->cq_head = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    // Opening, statx and close through the ring need kernel 5.6 or later.
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    std::vector<char> probe_buf(probe_size, 0);
+    struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(&probe_buf[0]);
+    const int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE};
+    bool supported = (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) >= 0);
+    for(size_t i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++)
+        supported = (ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED));
+    if(!supported)
+    {
+        d3l_uring_exit(ring);
+        return -1;
+    }
+    return 0;
+}
+
+static int d3l_uring_submit(d3l_uring *ring, bool wait);
+
+//! Get a cleared submission queue entry, submitting the queued ones when the queue is full.
+static struct io_uring_sqe *d3l_uring_get_sqe(d3l_uring *ring, int opcode, uint64_t user_data)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(ring->sq_local_tail - head >= ring->sq_entries && d3l_uring_submit(ring, false) < 0)
+        return NULL;
+    unsigned int idx = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+//! Submit all queued entries.
+/*!
+  \brief Submit queued entries until the kernel has taken all of them, and
+         wait for at least one completion when wait is set and entries are in
+         flight. Taken entries are counted in inflight until their completion
+         is reaped.
+  \retval ==0 Successed; <0 Failed, the kernel took nothing.
+ */
+static int d3l_uring_submit(d3l_uring *ring, bool wait)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    for(;;)
+    {
+        unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        unsigned int submit = ring->sq_local_tail - head;
+        unsigned int complete = (wait && ring->inflight + submit > 0) ? 1 : 0;
+        if(0 == submit && 0 == complete)
+            return 0;
+        int rs = syscall(__NR_io_uring_enter, ring->fd, submit, complete,
+                complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        unsigned int taken = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) - head;
+        ring->inflight += taken;
+        if(rs < 0 && EINTR == errno)
+            continue;
+        // The kernel skips waiting when it takes only part of the entries.
+        if(rs >= 0 && taken == submit)
+            return 0;
+        if(0 == taken)
+            return -1;
+    }
+}
+
+//! Drop the queued entries the kernel has not taken yet.
+static void d3l_uring_discard(d3l_uring *ring)
+{
+    ring->sq_local_tail = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+// Operation tags kept in the low bits of user_data.
+#define D3L_BATCH_OPEN 0
+#define D3L_BATCH_STAT 1
+#define D3L_BATCH_READ 2
+#define D3L_BATCH_CLOSE 3
+
+//! io_uring state of one file in a batch.
+struct d3l_batch_file
+{
+    int fd;
+    int pending;
+    struct statx stx;
+};
+
+//! Queue the next read or the close of a file.
+static int d3l_fop_batch_next(d3l_uring *ring, d3l_batch_file *file,
+        struct d3l_fop_batch_item *item, size_t idx)
+{
+    struct io_uring_sqe *sqe = NULL;
+    if(0 == item->status && item->size < static_cast<int64_t>(file->stx.stx_size))
+    {
+        sqe = d3l_uring_get_sqe(ring, IORING_OP_READ, (idx << 2) | D3L_BATCH_READ);
+        if(NULL == sqe)
+            return -1;
+        sqe->fd = file->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(item->buff + item->size);
+        sqe->len = std::min<uint64_t>(file->stx.stx_size - item->size, 1U << 30);
+        sqe->off = item->size;
+    }
+    else
+    {
+        item->buff[item->size] = '\0';
+        sqe = d3l_uring_get_sqe(ring, IORING_OP_CLOSE, (idx << 2) | D3L_BATCH_CLOSE);
+        if(NULL == sqe)
+            return -1;
+        sqe->fd = file->fd;
+    }
+    file->pending = 1;
+    return 0;
+}
+
+//! Read a batch of files using io_uring.
+/*!
+  \brief Read a batch of files using io_uring. After a failed submission no
+         more entries are queued, and the ones in flight are waited for, as
+         the kernel still writes into the statx buffers and items, before the
+         caller may fall back to another reader.
+ */
+static int d3l_fop_batch_uring(struct d3l_fop_batch_item *items, size_t num, unsigned int depth)
+{
+    d3l_uring ring;
+    if(d3l_uring_init(&ring, depth) < 0)
+        return -1;
+
+    // Each file has at most two operations in flight.
+    size_t max_active = std::max<size_t>(ring.sq_entries / 2, 1);
+    std::vector<d3l_batch_file> files(num);
+    for(size_t i = 0; i < num; i++)
+        files[i].fd = -1;
+    size_t next = 0;
+    size_t active = 0;
+    size_t done = 0;
+    bool failed = false;
+    while(ring.inflight > 0 || (!failed && done < num))
+    {
+        for(; !failed && active < max_active && next < num; next++, active++)
+        {
+            d3l_batch_file &file = files[next];
+            file.pending = 2;
+            items[next].buff = NULL;
+            items[next].size = 0;
+            items[next].status = 0;
+            struct io_uring_sqe *sqe = d3l_uring_get_sqe(&ring, IORING_OP_OPENAT, (next << 2) | D3L_BATCH_OPEN);
+            if(NULL == sqe)
+            {
+                failed = true;
+                break;
+            }
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(items[next].path);
+            sqe->open_flags = O_RDONLY|O_CLOEXEC;
+            sqe = d3l_uring_get_sqe(&ring, IORING_OP_STATX, (next << 2) | D3L_BATCH_STAT);
+            if(NULL == sqe)
+            {
+                failed = true;
+                break;
+            }
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(items[next].path);
+            sqe->len = STATX_SIZE;
+            sqe->off = reinterpret_cast<uint64_t>(&file.stx);
+        }
+        if(failed)
+            d3l_uring_discard(&ring);
+        if(d3l_uring_submit(&ring, true) < 0)
+        {
+            if(failed)
+                break; // Nothing can be waited for any more.
+            failed = true;
+            continue;
+        }
+
+        unsigned int head = *ring.cq_head;
+        unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++)
+        {
+            const struct io_uring_cqe &cqe = ring.cqes[head & *ring.cq_mask];
+            size_t idx = cqe.user_data >> 2;
+            int op = cqe.user_data & 3;
+            d3l_batch_file &file = files[idx];
+            struct d3l_fop_batch_item &item = items[idx];
+            ring.inflight--;
+            file.pending--;
+            if(D3L_BATCH_OPEN == op || D3L_BATCH_STAT == op)
+            {
+                if(cqe.res < 0 && 0 == item.status)
+                    item.status = cqe.res;
+                if(D3L_BATCH_OPEN == op && cqe.res >= 0)
+                    file.fd = cqe.res;
+                if(failed || file.pending > 0)
+                    continue;
+                if(0 == item.status)
+                {
+                    item.buff = static_cast<char *>(malloc(file.stx.stx_size + 1));
+                    if(NULL == item.buff)
+                        item.status = -ENOMEM;
+                }
+                if(file.fd < 0)
+                {
+                    active--;
+                    done++;
+                    continue;
+                }
+                if(0 != item.status)
+                {
+                    struct io_uring_sqe *sqe = d3l_uring_get_sqe(&ring, IORING_OP_CLOSE, (idx << 2) | D3L_BATCH_CLOSE);
+                    if(NULL == sqe)
+                    {
+                        failed = true;
+                        continue;
+                    }
+                    sqe->fd = file.fd;
+                    file.pending = 1;
+                    continue;
+                }
+                if(d3l_fop_batch_next(&ring, &file, &item, idx) < 0)
+                    failed = true;
+            }
+            else if(D3L_BATCH_READ == op)
+            {
+                if(cqe.res < 0)
+                    item.status = cqe.res;
+                else if(0 == cqe.res)
+                    file.stx.stx_size = item.size; // File shrank since statx.
+                else
+                    item.size += cqe.res;
+                if(!failed && d3l_fop_batch_next(&ring, &file, &item, idx) < 0)
+                    failed = true;
+            }
+            else
+            {
+                file.fd = -1;
+                active--;
+                done++;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    d3l_uring_exit(&ring);
+    for(size_t i = 0; failed && i < num; i++)
+    {
+        if(files[i].fd >= 0)
+            close(files[i].fd);
+    }
+    return failed ? -1 : 0;
+}
+#endif
+
+//! Read a batch of files.
+/*!
+  \brief Read a batch of files into new buffers. Opening, statx and reading are
+         submitted through io_uring with up to depth operations in flight, or
+         done by a pool of depth threads when io_uring is not available.
+  \param[in] paths file paths.
+  \param[in] num file number.
+  \param[out] items result of each file: status 0 or -errno, contents terminated
+              by '\\0' and size, free them with d3l_fop_read_batch_free().
+  \param[in] depth queue depth, 0 means D3L_BATCH_DEPTH.
+  \param[in] flags D3L_BATCH_THREADS to always use the thread pool.
+  \retval >=0 Number of files read; <0 Failed.
+ */
+int64_t d3l_fop_read_batch(const char **paths, size_t num, struct d3l_fop_batch_item *items,
+        unsigned int depth, int flags)
+{
+    if(0 == depth)
+        depth = D3L_BATCH_DEPTH;
+    for(size_t i = 0; i < num; i++)
+    {
+        items[i].path = paths[i];
+        items[i].buff = NULL;
+        items[i].size = 0;
+        items[i].status = 0;
+    }
+
+    int rs = -1;
+#ifdef __NR_io_uring_setup
+    if(!(flags & D3L_BATCH_THREADS))
+        rs = d3l_fop_batch_uring(items, num, depth);
+#endif
+    if(rs < 0)
+    {
+        d3l_fop_read_batch_free(items, num);
+        rs = d3l_fop_batch_threads(items, num, depth);
+    }
+
+    int64_t sum = 0;
+    for(size_t i = 0; i < num; i++)
+    {
+        if(0 == items[i].status)
+            sum++;
+    }
+    return sum;
+}
+
+//! Free buffers of a batch read.
+/*!
+  \brief Free buffers of a batch read using free().
+  \param[in] items result of d3l_fop_read_batch().
+  \param[in] num file number.
+ */
+void d3l_fop_read_batch_free(struct d3l_fop_batch_item *items, size_t num)
+{
+    for(size_t i = 0; i < num; i++)
+    {
+        free(items[i].buff);
+        items[i].buff = NULL;
+        items[i].size = 0;
+    }
+}
+
+//! Fill file metadata from statx.
+static void d3l_fop_meta_fill(const struct statx &stx, struct d3l_fop_meta *meta)
+{
+    meta->status = 0;
+    if(S_ISREG(stx.stx_mode))
+        meta->type = D3L_WALK_FILE;
+    else if(S_ISDIR(stx.stx_mode))
+        meta->type = D3L_WALK_DIR;
+    else if(S_ISLNK(stx.stx_mode))
+        meta->type = D3L_WALK_LINK;
+    else
+        meta->type = D3L_WALK_OTHER;
+    meta->mode = stx.stx_mode & 07777;
+    meta->size = stx.stx_size;
+    meta->mtime = stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+}
+
+//! Get file metadata using statx.
+static int d3l_fop_statx(const char *sz_file, struct d3l_fop_meta *meta, int at_flags)
+{
+    struct statx stx;
+    if(statx(AT_FDCWD, sz_file, at_flags, STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME, &stx) < 0)
+    {
+        memset(meta, 0, sizeof(*meta));
+        meta->status = -errno;
+        return meta->status;
+    }
+    d3l_fop_meta_fill(stx, meta);
+    return 0;
+}
+
+//! Cached metadata of one lock shard, keyed by '0' or '1' (D3L_STAT_NOFOLLOW) and path.
+struct d3l_stat_shard
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, d3l_fop_meta> metas;
+};
+
+//! File metadata cache invalidated by inotify.
+/*!
+  \brief Each cached path has its parent directory watched, and its own
+         directory when it is one. Watches are keyed by the path prefix up to
+         the last '/', so an event on wd names prefix + name.
+ */
+struct d3l_stat_cache
+{
+    std::mutex mutex;                                       //!< guards the fields below but shards.
+    int fd;                                                 //!< inotify fd.
+    int stop_fd;                                            //!< eventfd waking the watcher to quit.
+    std::thread watcher;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> gen;                              //!< bumped before entries are invalidated.
+    std::unordered_map<std::string, int> prefix_wd;
+    std::unordered_map<int, std::vector<std::string> > wd_prefix;
+    d3l_stat_shard shards[D3L_STAT_SHARDS];
+
+    d3l_stat_cache() : fd(-1), stop_fd(-1), running(false), gen(0) {}
+};
+
+//! Get the file metadata cache.
+static d3l_stat_cache *d3l_stat_inst()
+{
+    static d3l_stat_cache *cache = new d3l_stat_cache();
+    return cache;
+}
+
+//! Get cache shard of a key.
+static d3l_stat_shard &d3l_stat_shard_of(d3l_stat_cache *cache, const std::string &key)
+{
+    return cache->shards[std::hash<std::string>()(key) % D3L_STAT_SHARDS];
+}
+
+//! Drop all cached metadata.
+static void d3l_stat_clear(d3l_stat_cache *cache)
+{
+    cache->gen.fetch_add(1);
+    for(int i = 0; i < D3L_STAT_SHARDS; i++)
+    {
+        std::lock_guard<std::mutex> lock(cache->shards[i].mutex);
+        cache->shards[i].metas.clear();
+    }
+}
+
+//! Drop cached metadata of a path.
+static void d3l_stat_erase(d3l_stat_cache *cache, std::string &key)
+{
+    for(char c = '0'; c <= '1'; c++)
+    {
+        key[0] = c;
+        d3l_stat_shard &shard = d3l_stat_shard_of(cache, key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.metas.erase(key);
+    }
+}
+
+//! Invalidate cached metadata named by an inotify event.
+static void d3l_stat_event(d3l_stat_cache *cache, const struct inotify_event *event)
+{
+    cache->gen.fetch_add(1);
+    if(event->mask & IN_Q_OVERFLOW)
+    {
+        d3l_stat_clear(cache);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    std::unordered_map<int, std::vector<std::string> >::iterator it = cache->wd_prefix.find(event->wd);
+    if(cache->wd_prefix.end() == it)
+        return;
+    if(event->mask & IN_IGNORED)
+    {
+        // The directory is gone, a new one at its path isn't watched.
+        for(size_t i = 0; i < it->second.size(); i++)
+            cache->prefix_wd.erase(it->second[i]);
+        cache->wd_prefix.erase(it);
+        d3l_stat_clear(cache);
+        return;
+    }
+    std::string key;
+    for(size_t i = 0; i < it->second.size(); i++)
+    {
+        const std::string &prefix = it->second[i];
+        if(event->len > 0 && '\0' != event->name[0])
+        {
+            key = "0" + prefix + event->name;
+            d3l_stat_erase(cache, key);
+        }
+        // Entries changed, so did the directory itself.
+        if(prefix.empty())
+            key = "0.";
+        else if(1 == prefix.size())
+            key = "0" + prefix;
+        else
+            key = "0" + prefix.substr(0, prefix.size() - 1);
+        d3l_stat_erase(cache, key);
+    }
+}
+
+//! Read inotify events until the cache is closed.
+static void d3l_stat_watch_loop(d3l_stat_cache *cache)
+{
+    alignas(struct inotify_event) char buff[64 * 1024];
+    struct pollfd fds[2];
+    fds[0].fd = cache->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = cache->stop_fd;
+    fds[1].events = POLLIN;
+    for(;;)
+    {
+        if(poll(fds, 2, -1) < 0 && EINTR != errno)
+            break;
+        if(fds[1].revents & POLLIN)
+            break;
+        if(!(fds[0].revents & POLLIN))
+            continue;
+        ssize_t len;
+        while((len = read(cache->fd, buff, sizeof(buff))) > 0)
+        {
+            for(ssize_t pos = 0; pos < len; )
+            {
+                const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(buff + pos);
+                d3l_stat_event(cache, event);
+                pos += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+}
+
+//! Watch a directory for the cache, cache->mutex is held.
+static bool d3l_stat_watch(d3l_stat_cache *cache, const std::string &prefix)
+{
+    if(cache->prefix_wd.count(prefix) > 0)
+        return true;
+    int wd = inotify_add_watch(cache->fd, prefix.empty() ? "." : prefix.c_str(), D3L_STAT_EVENTS);
+    if(wd < 0)
+        return false;
+    cache->prefix_wd[prefix] = wd;
+    cache->wd_prefix[wd].push_back(prefix);
+    return true;
+}
+
+//! Get file metadata through the cache.
+/*!
+  \brief Get file metadata through the cache. On a miss the watches are
+         added before statx and the result is kept only if no event came in
+         between, so a cached entry is never older than the last event.
+         Links are followed uncached since their target isn't watched.
+ */
+static int d3l_stat_cached(d3l_stat_cache *cache, const char *sz_file, struct d3l_fop_meta *meta, int flags)
+{
+    thread_local std::string key;
+    key.assign(1, (flags & D3L_STAT_NOFOLLOW) ? '1' : '0');
+    key.append(sz_file);
+    d3l_stat_shard &shard = d3l_stat_shard_of(cache, key);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::unordered_map<std::string, d3l_fop_meta>::const_iterator it = shard.metas.find(key);
+        if(shard.metas.end() != it)
+        {
+            *meta = it->second;
+            return meta->status;
+        }
+    }
+
+    size_t len = key.size() - 1;
+    size_t slash = key.rfind('/');
+    bool cacheable = (len > 0 && slash != key.size() - 1);
+    bool dir_watched = false;
+    uint64_t gen = cache->gen.load();
+    if(cacheable)
+    {
+        std::string prefix = (std::string::npos == slash || 0 == slash) ? std::string() : key.substr(1, slash);
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        cacheable = d3l_stat_watch(cache, prefix);
+        // Fails with ENOTDIR for anything but a directory.
+        dir_watched = cacheable && d3l_stat_watch(cache, key.substr(1) + "/");
+    }
+
+    d3l_fop_statx(sz_file, meta, AT_SYMLINK_NOFOLLOW);
+    if(0 == meta->status && D3L_WALK_LINK == meta->type && !(flags & D3L_STAT_NOFOLLOW))
+        return d3l_fop_statx(sz_file, meta, 0);
+    if(D3L_WALK_DIR == meta->type && !dir_watched)
+        return meta->status;
+    if(cacheable)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if(gen == cache->gen.load())
+            shard.metas[key] = *meta;
+    }
+    return meta->status;
+}
+
+//! Start the file metadata cache.
+/*!
+  \brief Start the file metadata cache used by D3L_STAT_CACHE queries. A
+         background thread reads inotify events and drops entries of changed
+         paths, so repeated queries of unchanged files make no syscall.
+         Relative paths assume the working directory doesn't change, and a
+         rename of a directory above the parent of a path isn't seen.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_stat_cache_open(void)
+{
+    d3l_stat_cache *cache = d3l_stat_inst();
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    if(cache->running.load())
+        return 0;
+    cache->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    cache->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if(cache->fd < 0 || cache->stop_fd < 0)
+    {
+        d3l_sys_err("ERROR d3l::d3l_fop_stat_cache_open() inotify can't be initialized!");
+        if(cache->fd >= 0)
+            close(cache->fd);
+        if(cache->stop_fd >= 0)
+            close(cache->stop_fd);
+        cache->fd = cache->stop_fd = -1;
+        return -1;
+    }
+    d3l_stat_clear(cache);
+    cache->watcher = std::thread(d3l_stat_watch_loop, cache);
+    cache->running.store(true);
+    return 0;
+}
+
+//! Stop the file metadata cache.
+/*!
+  \brief Stop the file metadata cache, remove its watches and drop entries.
+ */
+void d3l_fop_stat_cache_close(void)
+{
+    d3l_stat_cache *cache = d3l_stat_inst();
+    std::unique_lock<std::mutex> lock(cache->mutex);
+    if(!cache->running.load())
+        return;
+    cache->running.store(false);
+    uint64_t one = 1;
+    if(write(cache->stop_fd, &one, sizeof(one)) < 0)
+        d3l_sys_err("ERROR d3l::d3l_fop_stat_cache_close() Watcher can't be stopped!");
+    // The watcher takes the mutex for each event.
+    lock.unlock();
+    cache->watcher.join();
+    lock.lock();
+    close(cache->fd);
+    close(cache->stop_fd);
+    cache->fd = cache->stop_fd = -1;
+    cache->prefix_wd.clear();
+    cache->wd_prefix.clear();
+    d3l_stat_clear(cache);
+}
+
+//! Get metadata of file.
+/*!
+  \brief Get type, permission bits, 64-bit size and nanosecond mtime of a
+         file in one statx call, or from the cache without any syscall.
+  \param[in] sz_file file path.
+  \param[out] meta file metadata, status is 0 or -errno.
+  \param[in] flags D3L_STAT_NOFOLLOW and D3L_STAT_CACHE.
+  \retval ==0 Successed; <0 Failed, -errno.
+ */
+int d3l_fop_stat(const char *sz_file, struct d3l_fop_meta *meta, int flags)
+{
+    d3l_stat_cache *cache = d3l_stat_inst();
+    if((flags & D3L_STAT_CACHE) && cache->running.load(std::memory_order_acquire))
+        return d3l_stat_cached(cache, sz_file, meta, flags);
+    return d3l_fop_statx(sz_file, meta, (flags & D3L_STAT_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0);
+}
+
+#ifdef __NR_io_uring_setup
+//! Get metadata of a batch of files using io_uring.
+static int d3l_fop_stat_uring(const char **paths, size_t num, struct d3l_fop_meta *metas, int at_flags)
+{
+    d3l_uring ring;
+    if(d3l_uring_init(&ring, D3L_BATCH_DEPTH) < 0)
+        return -1;
+    std::vector<struct statx> stx(ring.sq_entries);
+    std::vector<size_t> slots;
+    std::vector<size_t> slot_idx(ring.sq_entries);
+    for(size_t i = 0; i < ring.sq_entries; i++)
+        slots.push_back(i);
+    size_t next = 0;
+    size_t done = 0;
+    bool failed = false;
+    while(ring.inflight > 0 || (!failed && done < num))
+    {
+        for(; !failed && !slots.empty() && next < num; next++)
+        {
+            size_t slot = slots.back();
+            struct io_uring_sqe *sqe = d3l_uring_get_sqe(&ring, IORING_OP_STATX, slot);
+            if(NULL == sqe)
+            {
+                failed = true;
+                break;
+            }
+            slots.pop_back();
+            slot_idx[slot] = next;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(paths[next]);
+            sqe->len = STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME;
+            sqe->off = reinterpret_cast<uint64_t>(&stx[slot]);
+            sqe->statx_flags = at_flags;
+        }
+        if(failed)
+            d3l_uring_discard(&ring);
+        if(d3l_uring_submit(&ring, true) < 0)
+        {
+            if(failed)
+                break; // Nothing can be waited for any more.
+            failed = true;
+            continue;
+        }
+        unsigned int head = *ring.cq_head;
+        unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++)
+        {
+            const struct io_uring_cqe &cqe = ring.cqes[head & *ring.cq_mask];
+            size_t slot = cqe.user_data;
+            ring.inflight--;
+            struct d3l_fop_meta *meta = &metas[slot_idx[slot]];
+            if(cqe.res < 0)
+            {
+                memset(meta, 0, sizeof(*meta));
+                meta->status = cqe.res;
+            }
+            else
+                d3l_fop_meta_fill(stx[slot], meta);
+            slots.push_back(slot);
+            done++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    d3l_uring_exit(&ring);
+    return failed ? -1 : 0;
+}
+#endif
+
+//! Get metadata of a batch of files.
+/*!
+  \brief Get metadata of a batch of files. Large uncached batches submit
+         statx through io_uring when available, otherwise each path is done
+         by d3l_fop_stat().
+  \param[in] paths file paths.
+  \param[in] num file number.
+  \param[out] metas metadata of each file, status is 0 or -errno.
+  \param[in] flags D3L_STAT_NOFOLLOW and D3L_STAT_CACHE.
+  \retval >=0 Number of files got; <0 Failed.
+ */
+int64_t d3l_fop_stat_batch(const char **paths, size_t num, struct d3l_fop_meta *metas, int flags)
+{
+    bool cached = (flags & D3L_STAT_CACHE) && d3l_stat_inst()->running.load(std::memory_order_acquire);
+    bool done = false;
+#ifdef __NR_io_uring_setup
+    if(!cached && num >= D3L_STAT_URING_MIN)
+        done = (0 == d3l_fop_stat_uring(paths, num, metas, (flags & D3L_STAT_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0));
+#endif
+    int64_t got = 0;
+    for(size_t i = 0; i < num; i++)
+    {
+        if(!done)
+            d3l_fop_stat(paths[i], &metas[i], flags);
+        got += (0 == metas[i].status);
+    }
+    return got;
+}
+
+//! Map a file.
+/*!
+  \brief Map a file read-only using mmap(), an empty file gives an empty view.
+  \param[in] sz_file file path.
+  \param[in] flags D3L_MAP_SEQUENTIAL, D3L_MAP_RANDOM, D3L_MAP_WILLNEED,
+             D3L_MAP_HUGEPAGE and D3L_MAP_POPULATE.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_map::open(const char *sz_file, int flags)
+{
+    close();
+    int fd = ::open(sz_file, O_RDONLY|O_CLOEXEC);
+    struct stat statbuf;
+    if(fd < 0 || fstat(fd, &statbuf) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_map::open(const char *, int) File ";
+        str_err = str_err + sz_file + " can't be opened!";
+        d3l_sys_err(str_err.c_str());
+        if(fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+    if(0 == statbuf.st_size)
+    {
+        ::close(fd);
+        return 0;
+    }
+
+    int map_flags = MAP_PRIVATE;
+    if(flags & D3L_MAP_POPULATE)
+        map_flags |= MAP_POPULATE;
+    void *addr = mmap(NULL, statbuf.st_size, PROT_READ, map_flags, fd, 0);
+    ::close(fd);
+    if(MAP_FAILED == addr)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_map::open(const char *, int) File ";
+        str_err = str_err + sz_file + " can't be mapped!";
+        d3l_sys_err(str_err.c_str());
+        return -2;
+    }
+    addr_ = addr;
+    size_ = statbuf.st_size;
+
+    if(flags & D3L_MAP_SEQUENTIAL)
+        madvise(addr_, size_, MADV_SEQUENTIAL);
+    if(flags & D3L_MAP_RANDOM)
+        madvise(addr_, size_, MADV_RANDOM);
+    if(flags & D3L_MAP_WILLNEED)
+        madvise(addr_, size_, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    if(flags & D3L_MAP_HUGEPAGE)
+        madvise(addr_, size_, MADV_HUGEPAGE);
+#endif
+    return 0;
+}
+
+//! Unmap the file.
+/*!
+  \brief Unmap the file using munmap(), views of it become invalid.
+ */
+void d3l_fop_map::close()
+{
+    if(NULL != addr_)
+        munmap(addr_, size_);
+    addr_ = NULL;
+    size_ = 0;
+}
+
+//! Decompression state of d3l_fop_zreader.
+/*!
+  \brief The worker fills a ring of D3L_ZIP_DEPTH blocks that the consumer
+         empties in turn; block length 0 is the end of data, <0 an error and
+         -3 input rejected by the decompressor before any output.
+ */
+struct d3l_zip_stream
+{
+    int fd;
+    bool own;
+    int stop_fd;                //!< eventfd waking a worker waiting for pipe input, -1 for regular files.
+    int format;
+    std::string name;
+    char *memory;
+    size_t memory_size;
+    char *blocks[D3L_ZIP_DEPTH];
+    ssize_t lens[D3L_ZIP_DEPTH];
+    char *in;                   //!< compressed input buffer.
+    size_t in_pos;
+    size_t in_len;
+    bool member_done;           //!< the last gzip member or zstd frame is complete.
+#ifdef D3L_ZLIB
+    z_stream z;
+#endif
+#ifdef D3L_ZSTD
+    ZSTD_DStream *zs;
+#endif
+    std::mutex mtx;
+    std::condition_variable cv;
+    uint64_t produced;
+    uint64_t consumed;
+    bool started;               //!< decompressed output was produced.
+    bool stop;
+    std::thread worker;
+    size_t pos;                 //!< read position in the consumer block.
+    bool done;                  //!< consumer got end of data or an error.
+};
+
+//! Read more compressed input, retry on EINTR.
+/*!
+  \brief Read more compressed input. Pipes and terminals are polled together
+         with stop_fd first, so closing the reader doesn't wait for input.
+  \retval ==1 Read; ==0 End of input; <0 Failed or stopped.
+ */
+static int d3l_zip_input(d3l_zip_stream *stream)
+{
+    struct pollfd fds[2];
+    fds[0].fd = stream->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stream->stop_fd;
+    fds[1].events = POLLIN;
+    for(;;)
+    {
+        if(stream->stop_fd >= 0)
+        {
+            if(poll(fds, 2, -1) < 0)
+            {
+                if(EINTR == errno)
+                    continue;
+                return -1;
+            }
+            if(fds[1].revents & POLLIN)
+                return -1;
+            if(0 == fds[0].revents)
+                continue;
+        }
+        ssize_t len = read(stream->fd, stream->in, D3L_FOP_BLOCK_SIZE);
+        if(len < 0 && EINTR == errno)
+            continue;
+        if(len < 0)
+            return -1;
+        stream->in_pos = 0;
+        stream->in_len = len;
+        return (0 == len) ? 0 : 1;
+    }
+}
+
+//! Fill a block with decompressed data.
+static ssize_t d3l_zip_fill(d3l_zip_stream *stream, char *out, size_t size)
+{
+    size_t len = 0;
+    if(D3L_ZIP_NONE == stream->format)
+    {
+        while(len < size)
+        {
+            if(stream->in_pos == stream->in_len)
+            {
+                int rs = d3l_zip_input(stream);
+                if(rs < 0)
+                    return -1;
+                if(0 == rs)
+                    break;
+            }
+            size_t n = std::min(size - len, stream->in_len - stream->in_pos);
+            memcpy(out + len, stream->in + stream->in_pos, n);
+            stream->in_pos += n;
+            len += n;
+        }
+        return len;
+    }
+#ifdef D3L_ZLIB
+    if(D3L_ZIP_GZIP == stream->format)
+    {
+        z_stream &z = stream->z;
+        z.next_out = reinterpret_cast<Bytef *>(out);
+        z.avail_out = size;
+        while(z.avail_out > 0)
+        {
+            if(0 == z.avail_in)
+            {
+                int rs = d3l_zip_input(stream);
+                if(rs < 0)
+                    return -1;
+                if(0 == rs)
+                    break;
+                z.next_in = reinterpret_cast<Bytef *>(stream->in);
+                z.avail_in = stream->in_len;
+            }
+            stream->member_done = false;
+            int rs = inflate(&z, Z_NO_FLUSH);
+            if(Z_STREAM_END == rs)
+            {
+                // Concatenated members make one gzip file.
+                stream->member_done = true;
+                inflateReset(&z);
+            }
+            else if(Z_OK != rs && Z_BUF_ERROR != rs)
+                return (stream->started || z.avail_out < size) ? -2 : -3;
+        }
+        len = size - z.avail_out;
+    }
+#endif
+#ifdef D3L_ZSTD
+    if(D3L_ZIP_ZSTD == stream->format)
+    {
+        ZSTD_outBuffer zout = {out, size, 0};
+        while(zout.pos < zout.size)
+        {
+            if(stream->in_pos == stream->in_len)
+            {
+                int rs = d3l_zip_input(stream);
+                if(rs < 0)
+                    return -1;
+                if(0 == rs)
+                    break;
+            }
+            ZSTD_inBuffer zin = {stream->in, stream->in_len, stream->in_pos};
+            size_t rs = ZSTD_decompressStream(stream->zs, &zout, &zin);
+            stream->in_pos = zin.pos;
+            if(ZSTD_isError(rs))
+                return (stream->started || zout.pos > 0) ? -2 : -3;
+            stream->member_done = (0 == rs);
+        }
+        len = zout.pos;
+    }
+#endif
+    // Input ended in the middle of a member or frame.
+    if(0 == len && !stream->member_done)
+        return -2;
+    stream->started = stream->started || len > 0;
+    return len;
+}
+
+//! Decompress blocks ahead of the consumer until end of data or stop.
+static void d3l_zip_worker(d3l_zip_stream *stream)
+{
+    for(;;)
+    {
+        std::unique_lock<std::mutex> lock(stream->mtx);
+        stream->cv.wait(lock, [stream]{ return stream->stop || stream->produced - stream->consumed < D3L_ZIP_DEPTH; });
+        if(stream->stop)
+            return;
+        size_t idx = stream->produced % D3L_ZIP_DEPTH;
+        lock.unlock();
+        ssize_t len = d3l_zip_fill(stream, stream->blocks[idx], D3L_FOP_BLOCK_SIZE);
+        lock.lock();
+        stream->lens[idx] = len;
+        stream->produced++;
+        stream->cv.notify_all();
+        if(len <= 0)
+            return;
+    }
+}
+
+//! Open a file.
+/*!
+  \brief Open a file for reading decompressed data, "-" reads stdin.
+  \param[in] sz_file file path.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_zreader::open(const char *sz_file)
+{
+    close();
+    if(0 == strcmp(sz_file, "-"))
+        return attach(STDIN_FILENO);
+    int fd = ::open(sz_file, O_RDONLY|O_CLOEXEC);
+    if(fd < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_zreader::open(const char *) File ";
+        str_err = str_err + sz_file + " can't be opened!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    if(attach(fd) < 0)
+    {
+        ::close(fd);
+        return -2;
+    }
+    stream_->own = true;
+    stream_->name = sz_file;
+    return 0;
+}
+
+//! Read an opened fd.
+/*!
+  \brief Read an opened fd from its current offset, the compression format is
+         found by its first bytes.
+  \param[in] fd file descriptor.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_zreader::attach(int fd)
+{
+    close();
+    d3l_zip_stream *stream = new d3l_zip_stream();
+    stream->fd = fd;
+    stream->own = false;
+    stream->stop_fd = -1;
+    stream->name = "fd";
+    stream->memory_size = (D3L_ZIP_DEPTH + 1) * static_cast<size_t>(D3L_FOP_BLOCK_SIZE);
+    stream->memory = static_cast<char *>(d3l_mem_aligned(stream->memory_size, D3L_MEM_PAGE_SIZE, 0));
+    if(NULL == stream->memory)
+    {
+        d3l_sys_err("ERROR d3l::d3l_fop_zreader::attach(int) Memory can't be allocated!");
+        delete stream;
+        return -1;
+    }
+    for(int i = 0; i < D3L_ZIP_DEPTH; i++)
+        stream->blocks[i] = stream->memory + i * static_cast<size_t>(D3L_FOP_BLOCK_SIZE);
+    stream->in = stream->memory + D3L_ZIP_DEPTH * static_cast<size_t>(D3L_FOP_BLOCK_SIZE);
+
+    // Magic bytes stay in the input buffer for the decompressor.
+    ssize_t len = 0;
+    while(len < 4)
+    {
+        ssize_t rs = ::read(fd, stream->in + len, 4 - len);
+        if(rs < 0 && EINTR == errno)
+            continue;
+        if(rs <= 0)
+            break;
+        len += rs;
+    }
+    stream->in_len = len;
+    stream->format = d3l_zip_format(reinterpret_cast<const unsigned char *>(stream->in), len);
+
+    int rs = 0;
+#ifdef D3L_ZLIB
+    if(D3L_ZIP_GZIP == stream->format)
+    {
+        stream->z.next_in = reinterpret_cast<Bytef *>(stream->in);
+        stream->z.avail_in = len;
+        rs = (Z_OK == inflateInit2(&stream->z, 15 + 32)) ? 1 : -1;
+    }
+#endif
+#ifdef D3L_ZSTD
+    if(D3L_ZIP_ZSTD == stream->format)
+    {
+        stream->zs = ZSTD_createDStream();
+        rs = (NULL != stream->zs) ? 1 : -1;
+    }
+#endif
+    if(D3L_ZIP_NONE == stream->format)
+        rs = 1;
+    if(rs <= 0)
+    {
+        d3l_sys_err("ERROR d3l::d3l_fop_zreader::attach(int) Compressed stream can't be decompressed!");
+        d3l_mem_aligned_free(stream->memory, stream->memory_size, 0);
+        delete stream;
+        return -2;
+    }
+    // Reads of regular files don't block for long, others may wait for a writer.
+    struct stat statbuf;
+    if(fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+        stream->stop_fd = eventfd(0, EFD_CLOEXEC);
+    stream_ = stream;
+    stream->worker = std::thread(d3l_zip_worker, stream);
+    return 0;
+}
+
+//! Get compression format of the input.
+/*!
+  \brief Get compression format of the input.
+  \retval D3L_ZIP_NONE, D3L_ZIP_GZIP or D3L_ZIP_ZSTD; <0 not opened.
+ */
+int d3l_fop_zreader::format() const
+{
+    return (NULL == stream_) ? -1 : stream_->format;
+}
+
+//! Read decompressed data.
+/*!
+  \brief Read decompressed data, waiting for the worker when no block is ready.
+  \param[out] buff memory point to output.
+  \param[in] size buffer size.
+  \retval >0 Read size; ==0 End of data; ==-3 Input rejected before any data
+          was decompressed; <0 Failed.
+ */
+int64_t d3l_fop_zreader::read(void *buff, size_t size)
+{
+    if(NULL == stream_)
+        return -1;
+    d3l_zip_stream *stream = stream_;
+    char *out = static_cast<char *>(buff);
+    size_t got = 0;
+    while(got < size && !stream->done)
+    {
+        std::unique_lock<std::mutex> lock(stream->mtx);
+        stream->cv.wait(lock, [stream]{ return stream->produced > stream->consumed; });
+        size_t idx = stream->consumed % D3L_ZIP_DEPTH;
+        ssize_t len = stream->lens[idx];
+        lock.unlock();
+        if(len <= 0)
+        {
+            stream->done = true;
+            if(len < 0)
+            {
+                std::string str_err = "ERROR d3l::d3l_fop_zreader::read(void *, size_t) File ";
+                str_err = str_err + stream->name + (-1 == len ? " read error!" : " can't be decompressed!");
+                d3l_sys_err(str_err.c_str());
+                return (-3 == len) ? -3 : -2;
+            }
+            break;
+        }
+        size_t n = std::min<size_t>(size - got, len - stream->pos);
+        memcpy(out + got, stream->blocks[idx] + stream->pos, n);
+        got += n;
+        stream->pos += n;
+        if(stream->pos == static_cast<size_t>(len))
+        {
+            stream->pos = 0;
+            lock.lock();
+            stream->consumed++;
+            stream->cv.notify_all();
+        }
+    }
+    return got;
+}
+
+//! Close the reader.
+/*!
+  \brief Stop the worker and close the file, a worker waiting for pipe input
+         is woken up.
+ */
+void d3l_fop_zreader::close()
+{
+    if(NULL == stream_)
+        return;
+    d3l_zip_stream *stream = stream_;
+    {
+        std::lock_guard<std::mutex> lock(stream->mtx);
+        stream->stop = true;
+    }
+    stream->cv.notify_all();
+    uint64_t one = 1;
+    if(stream->stop_fd >= 0 && write(stream->stop_fd, &one, sizeof(one)) < 0)
+        d3l_sys_err("ERROR d3l::d3l_fop_zreader::close() Worker can't be stopped!");
+    stream->worker.join();
+    if(stream->stop_fd >= 0)
+        ::close(stream->stop_fd);
+#ifdef D3L_ZLIB
+    if(D3L_ZIP_GZIP == stream->format)
+        inflateEnd(&stream->z);
+#endif
+#ifdef D3L_ZSTD
+    if(D3L_ZIP_ZSTD == stream->format)
+        ZSTD_freeDStream(stream->zs);
+#endif
+    if(stream->own)
+        ::close(stream->fd);
+    d3l_mem_aligned_free(stream->memory, stream->memory_size, 0);
+    delete stream;
+    stream_ = NULL;
+}
+
+//! Read a whole compressed file.
+/*!
+  \brief Read a whole file through d3l_fop_zreader into a string.
+  \param[in] sz_file file path.
+  \param[out] data decompressed file contents.
+  \retval >=0 Decompressed size; ==-4 Not a valid compressed stream; <0 Failed.
+ */
+int64_t d3l_fop_zip_read(const char *sz_file, std::string &data)
+{
+    d3l_fop_zreader reader;
+    data.clear();
+    if(reader.open(sz_file) < 0)
+        return -1;
+    int64_t len;
+    do
+    {
+        size_t used = data.size();
+        data.resize(used + D3L_FOP_BLOCK_SIZE);
+        len = reader.read(&data[used], D3L_FOP_BLOCK_SIZE);
+        data.resize(used + std::max<int64_t>(len, 0));
+    } while(len > 0);
+    if(len < 0)
+        return (-3 == len) ? -4 : -2;
+    return data.size();
+}
+
+//! Read a whole compressed file into a memory block.
+/*!
+  \brief Read a whole file through d3l_fop_zreader straight into a block from
+         d3l_mem_alloc(), which grows by doubling. The block is zero padded up to
+         a multiple of elem_size and holds at least one element.
+  \param[in] sz_file file path.
+  \param[out] buff memory block, free it with d3l_mem_release() or d3l_mem_free().
+  \param[in] elem_size element size of the block.
+  \retval >=0 Decompressed size; ==-4 Not a valid compressed stream, rejected
+          before any output; <0 Failed, buff is NULL.
+ */
+int64_t d3l_fop_zip_read(const char *sz_file, void *&buff, size_t elem_size)
+{
+    buff = NULL;
+    d3l_fop_zreader reader;
+    if(reader.open(sz_file) < 0)
+        return -1;
+    int64_t size = d3l_fop_size(sz_file);
+    size_t cap = std::max<size_t>(size > 0 ? size * 4 : 0, D3L_FOP_BLOCK_SIZE);
+    char *data = static_cast<char *>(d3l_mem_alloc(cap));
+    size_t used = 0;
+    int64_t len = 0;
+    while(NULL != data)
+    {
+        if(used == cap)
+        {
+            char *more = static_cast<char *>(d3l_mem_alloc(cap * 2));
+            if(NULL != more)
+                memcpy(more, data, used);
+            d3l_mem_release(data);
+            data = more;
+            cap *= 2;
+            continue;
+        }
+        len = reader.read(data + used, cap - used);
+        if(len <= 0)
+            break;
+        used += len;
+    }
+    if(NULL == data)
+        return -3;
+
+    size_t padded = std::max<size_t>((used + elem_size - 1) / elem_size, 1) * elem_size;
+    if(len < 0 || padded > cap)
+    {
+        // Padding needs room past a block filled exactly.
+        char *more = (len < 0) ? NULL : static_cast<char *>(d3l_mem_alloc(padded));
+        if(NULL != more)
+            memcpy(more, data, used);
+        d3l_mem_release(data);
+        data = more;
+        if(NULL == data)
+            return (len < 0) ? ((-3 == len) ? -4 : -2) : -3;
+    }
+    memset(data + used, 0, padded - used);
+    buff = data;
+    return used;
+}
+
+//! Get compression format of a file.
+/*!
+  \brief Get compression format of a file by its magic bytes.
+  \param[in] sz_file file path.
+  \retval D3L_ZIP_NONE, D3L_ZIP_GZIP or D3L_ZIP_ZSTD; <0 Failed.
+ */
+int d3l_fop_zip_detect(const char *sz_file)
+{
+    int fd = open(sz_file, O_RDONLY|O_CLOEXEC);
+    if(fd < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_zip_detect(const char *) File ";
+        str_err = str_err + sz_file + " can't be opened!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    unsigned char head[4];
+    ssize_t len = pread(fd, head, sizeof(head), 0);
+    close(fd);
+    return d3l_zip_format(head, std::max<ssize_t>(len, 0));
+}
+
+//! Compress a range into one gzip member or zstd frame.
+static int d3l_zip_compress(const char *data, size_t size, int format, int level, std::string &out)
+{
+#ifdef D3L_ZLIB
+    if(D3L_ZIP_GZIP == format)
+    {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        if(Z_OK != deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY))
+            return -1;
+        out.resize(deflateBound(&z, size));
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        z.avail_in = size;
+        z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+        z.avail_out = out.size();
+        int rs = deflate(&z, Z_FINISH);
+        out.resize(z.total_out);
+        deflateEnd(&z);
+        return (Z_STREAM_END == rs) ? 0 : -1;
+    }
+#endif
+#ifdef D3L_ZSTD
+    if(D3L_ZIP_ZSTD == format)
+    {
+        out.resize(ZSTD_compressBound(size));
+        size_t rs = ZSTD_compress(&out[0], out.size(), data, size, level);
+        if(ZSTD_isError(rs))
+            return -1;
+        out.resize(rs);
+        return 0;
+    }
+#endif
+    (void)data;
+    (void)size;
+    (void)format;
+    (void)level;
+    (void)out;
+    return -1;
+}
+
+//! Write a buffer to a compressed file atomically.
+/*!
+  \brief Compress a buffer by gzip or zstd and write it using d3l_fop_writev()
+         with the durability given by D3L_FOP_SYNC. D3L_FOP_CHUNK_SIZE ranges
+         are compressed by several threads into concatenated gzip members or
+         zstd frames, which decompress as one stream.
+  \param[in] sz_file file path.
+  \param[in] buff memory point to input.
+  \param[in] size input memory size in bytes.
+  \param[in] format D3L_ZIP_NONE, D3L_ZIP_GZIP or D3L_ZIP_ZSTD.
+  \param[in] level compression level of the format.
+  \retval >=0 Written size; <0 Failed.
+ */
+int64_t d3l_fop_write_zip(const char *sz_file, const void *buff, size_t size, int format, int level)
+{
+    if(D3L_ZIP_NONE == format)
+        return d3l_fop_write_atomic(sz_file, buff, size, D3L_FOP_SYNC);
+
+    const char *data = static_cast<const char *>(buff);
+    size_t chunk_num = std::max<size_t>((size + D3L_FOP_CHUNK_SIZE - 1) / D3L_FOP_CHUNK_SIZE, 1);
+    size_t thread_num = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()), chunk_num);
+    std::vector<std::string> outs(chunk_num);
+    std::atomic<size_t> next(0);
+    std::atomic<int> rs(0);
+    auto compressor = [&]
+    {
+        size_t idx;
+        while(0 == rs.load(std::memory_order_relaxed) && (idx = next.fetch_add(1)) < chunk_num)
+        {
+            size_t begin = idx * D3L_FOP_CHUNK_SIZE;
+            size_t len = std::min<size_t>(D3L_FOP_CHUNK_SIZE, size - begin);
+            if(d3l_zip_compress(data + begin, len, format, level, outs[idx]) < 0)
+                rs.store(-1);
+        }
+    };
+    std::vector<std::thread> pool;
+    for(size_t i = 1; i < thread_num; i++)
+        pool.push_back(std::thread(compressor));
+    compressor();
+    for(size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+    if(rs.load() < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_write_zip(const char *, const void *, size_t, int, int) File ";
+        str_err = str_err + sz_file + " can't be compressed!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+
+    std::vector<struct iovec> iov(chunk_num);
+    for(size_t i = 0; i < chunk_num; i++)
+    {
+        iov[i].iov_base = &outs[i][0];
+        iov[i].iov_len = outs[i].size();
+    }
+    return d3l_fop_writev(sz_file, &iov[0], iov.size(), D3L_FOP_SYNC);
+}
+
+//! Open a file.
+/*!
+  \brief Open a file for reading lines, "-" reads stdin. A gzip or zstd file
+         is decompressed by d3l_fop_zreader, D3L_LINE_FOLLOW has no effect on it.
+  \param[in] sz_file file path.
+  \param[in] flags D3L_LINE_STRIP_CR and D3L_LINE_FOLLOW.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_lines::open(const char *sz_file, int flags)
+{
+    close();
+    if(0 == strcmp(sz_file, "-"))
+        return attach(STDIN_FILENO, flags);
+    int fd = ::open(sz_file, O_RDONLY|O_CLOEXEC);
+    if(fd < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_lines::open(const char *, int) File ";
+        str_err = str_err + sz_file + " can't be opened!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    unsigned char head[4];
+    ssize_t len = pread(fd, head, sizeof(head), 0);
+    if(attach(fd, flags) < 0)
+    {
+        ::close(fd);
+        return -2;
+    }
+    own_ = true;
+    if(D3L_ZIP_NONE != d3l_zip_format(head, std::max<ssize_t>(len, 0)))
+    {
+        zin_ = new d3l_fop_zreader();
+        if(zin_->attach(fd) < 0)
+        {
+            close();
+            return -3;
+        }
+    }
+    return 0;
+}
+
+//! Read lines of an opened fd.
+/*!
+  \brief Read lines of an opened fd from its current offset, the kernel is
+         told to read ahead when the fd is a file.
+  \param[in] fd file descriptor.
+  \param[in] flags D3L_LINE_STRIP_CR and D3L_LINE_FOLLOW.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_lines::attach(int fd, int flags)
+{
+    close();
+    buff_ = static_cast<char *>(d3l_mem_aligned(D3L_FOP_BLOCK_SIZE, D3L_MEM_PAGE_SIZE, 0));
+    if(NULL == buff_)
+    {
+        d3l_sys_err("ERROR d3l::d3l_fop_lines::attach(int, int) Memory can't be allocated!");
+        return -1;
+    }
+    cap_ = D3L_FOP_BLOCK_SIZE;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    kernel_ = d3l_simd_bytemask_kernel();
+    fd_ = fd;
+    flags_ = flags;
+    return 0;
+}
+
+//! Close the reader.
+/*!
+  \brief Close the reader, lines got from it become invalid.
+ */
+void d3l_fop_lines::close()
+{
+    delete zin_;
+    zin_ = NULL;
+    if(own_ && fd_ >= 0)
+        ::close(fd_);
+    d3l_mem_aligned_free(buff_, cap_, 0);
+    fd_ = -1;
+    own_ = false;
+    buff_ = NULL;
+    cap_ = begin_ = base_ = scan_ = end_ = 0;
+    mask_ = 0;
+    eof_ = false;
+    num_ = 0;
+}
+
+//! Read next block behind the partial line.
+int d3l_fop_lines::fill()
+{
+    if(begin_ > 0)
+    {
+        memmove(buff_, buff_ + begin_, end_ - begin_);
+        base_ -= std::min(base_, begin_);
+        scan_ -= begin_;
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    if(end_ + D3L_FOP_BLOCK_SIZE / 2 > cap_)
+    {
+        size_t cap = cap_ * 2;
+        char *buff = static_cast<char *>(d3l_mem_aligned(cap, D3L_MEM_PAGE_SIZE, 0));
+        if(NULL == buff)
+        {
+            d3l_sys_err("ERROR d3l::d3l_fop_lines::next(string_view &) Memory can't be allocated!");
+            return -1;
+        }
+        memcpy(buff, buff_, end_);
+        d3l_mem_aligned_free(buff_, cap_, 0);
+        buff_ = buff;
+        cap_ = cap;
+    }
+    for(;;)
+    {
+        ssize_t len = (NULL != zin_) ? zin_->read(buff_ + end_, cap_ - end_) : read(fd_, buff_ + end_, cap_ - end_);
+        if(len < 0 && NULL == zin_ && EINTR == errno)
+            continue;
+        if(len < 0)
+        {
+            d3l_sys_err("ERROR d3l::d3l_fop_lines::next(string_view &) File read error!");
+            return -2;
+        }
+        end_ += len;
+        return 0 == len ? 0 : 1;
+    }
+}
+
+//! Get next line.
+/*!
+  \brief Get next line without '\n', the last line of the file may have no
+         '\n'. With D3L_LINE_FOLLOW, a last line without '\n' is held back and
+         calling next() again after end of file reads the data appended since.
+  \param[out] line view of the line, valid until the next call.
+  \retval ==1 Got a line; ==0 End of file; <0 Failed.
+ */
+int d3l_fop_lines::next(std::string_view &line)
+{
+    if(fd_ < 0)
+        return -1;
+    for(;;)
+    {
+        // '\n' of the buffer are found 64 bytes at a time, mask_ holds those
+        // not returned yet of the window at base_.
+        while(0 == mask_ && scan_ < end_)
+        {
+            size_t len = std::min<size_t>(64, end_ - scan_);
+            mask_ = kernel_(reinterpret_cast<const unsigned char *>(buff_ + scan_), len, '\n');
+            base_ = scan_;
+            scan_ += len;
+        }
+        size_t len = 0;
+        if(0 != mask_)
+        {
+            len = base_ + __builtin_ctzll(mask_) - begin_;
+            mask_ &= mask_ - 1;
+        }
+        else if(eof_ && !(flags_ & D3L_LINE_FOLLOW) && begin_ < end_)
+            len = end_ - begin_;
+        else if(eof_ && !(flags_ & D3L_LINE_FOLLOW))
+            return 0;
+        else
+        {
+            int ret = fill();
+            if(ret < 0)
+                return ret;
+            eof_ = (0 == ret);
+            if(eof_ && (flags_ & D3L_LINE_FOLLOW))
+                return 0;
+            continue;
+        }
+        if((flags_ & D3L_LINE_STRIP_CR) && len > 0 && '\r' == buff_[begin_ + len - 1])
+            line = std::string_view(buff_ + begin_, len - 1);
+        else
+            line = std::string_view(buff_ + begin_, len);
+        begin_ = std::min(begin_ + len + 1, end_);
+        num_++;
+        return 1;
+    }
+}
+
+//! Header of pack files.
+struct d3l_fop_pack_header
+{
+    char magic[8];              //!< D3L_PACK_MAGIC.
+    uint32_t version;           //!< D3L_PACK_VERSION.
+    uint32_t endian;            //!< D3L_PACK_ENDIAN in byte order of the writer.
+    uint64_t file_size;         //!< whole file size.
+    uint64_t index_offset;      //!< offset of d3l_fop_pack_entry array.
+    uint64_t index_num;         //!< array number.
+    uint64_t index_checksum;    //!< checksum of the index.
+    char reserved[16];
+};
+
+//! Rotate left a 64-bit word.
+static inline uint64_t d3l_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+//! Checksum of pack file data, four lanes of xxHash64 rounds.
+static uint64_t d3l_fop_pack_sum(const void *data, size_t len)
+{
+    const uint64_t p1 = 11400714785074694791ULL;
+    const uint64_t p2 = 14029467366897019727ULL;
+    const uint64_t p3 = 1609587929392839161ULL;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t lane[4] = {p1 + p2, p2, 0, 0 - p1};
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        for(int k = 0; k < 4; k++)
+        {
+            uint64_t w;
+            memcpy(&w, p + i + k * 8, 8);
+            lane[k] = d3l_rotl64(lane[k] + w * p2, 31) * p1;
+        }
+    }
+    uint64_t h = d3l_rotl64(lane[0], 1) + d3l_rotl64(lane[1], 7) +
+        d3l_rotl64(lane[2], 12) + d3l_rotl64(lane[3], 18) + len;
+    for(; i < len; i++)
+        h = d3l_rotl64(h ^ (p[i] * p3), 11) * p1;
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}
+
+//! Add an array.
+/*!
+  \brief Add an array to be written, the data isn't copied.
+  \param[in] name array name, 1 to 63 bytes and unique in the pack.
+  \param[in] type element type code.
+  \param[in] elem_size element size.
+  \param[in] data array data.
+  \param[in] count element number.
+  \param[in] align data alignment in the file, a power of two up to D3L_PACK_ALIGN_MAX.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_pack_writer::add_raw(const char *name, uint32_t type, uint32_t elem_size,
+        const void *data, size_t count, size_t align)
+{
+    size_t len = strlen(name);
+    bool unique = true;
+    for(size_t i = 0; i < items_.size(); i++)
+        unique = unique && (items_[i].name != name);
+    if(0 == len || len >= sizeof(static_cast<d3l_fop_pack_entry *>(NULL)->name) || !unique ||
+       0 == align || 0 != (align & (align - 1)) || align > D3L_PACK_ALIGN_MAX)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_pack_writer::add(const char *, const T *, size_t, size_t) Array ";
+        str_err = str_err + name + " can't be added!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    item it;
+    it.name = name;
+    it.type = type;
+    it.elem_size = elem_size;
+    it.align = std::max<size_t>(align, 1);
+    it.data = data;
+    it.count = count;
+    items_.push_back(it);
+    return 0;
+}
+
+//! Write all arrays to a file.
+/*!
+  \brief Write the header, arrays and index to a file through d3l_fop_writev(),
+         so the file is replaced atomically with the durability of D3L_FOP_SYNC.
+  \param[in] sz_file file path.
+  \param[in] flags D3L_PACK_CHECKSUM to store a checksum of each array.
+  \retval >=0 Written size; <0 Failed.
+ */
+int64_t d3l_fop_pack_writer::write(const char *sz_file, int flags) const
+{
+    static const char zeros[D3L_PACK_ALIGN_MAX] = {0};
+    d3l_fop_pack_header header;
+    std::vector<d3l_fop_pack_entry> index(items_.size());
+    std::vector<struct iovec> iov;
+    memset(&header, 0, sizeof(header));
+    iov.push_back({&header, sizeof(header)});
+
+    uint64_t offset = sizeof(header);
+    for(size_t i = 0; i < items_.size(); i++)
+    {
+        const item &it = items_[i];
+        d3l_fop_pack_entry &entry = index[i];
+        uint64_t pad = (it.align - offset % it.align) % it.align;
+        uint64_t bytes = it.count * it.elem_size;
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.name, it.name.data(), it.name.size());
+        entry.type = it.type;
+        entry.elem_size = it.elem_size;
+        entry.align = it.align;
+        entry.count = it.count;
+        entry.offset = offset + pad;
+        if(flags & D3L_PACK_CHECKSUM)
+        {
+            entry.flags |= D3L_PACK_CHECKSUM;
+            entry.checksum = d3l_fop_pack_sum(it.data, bytes);
+        }
+        if(pad > 0)
+            iov.push_back({const_cast<char *>(zeros), pad});
+        if(bytes > 0)
+            iov.push_back({const_cast<void *>(it.data), bytes});
+        offset = entry.offset + bytes;
+    }
+    uint64_t pad = (D3L_MEM_LINE_SIZE - offset % D3L_MEM_LINE_SIZE) % D3L_MEM_LINE_SIZE;
+    if(pad > 0)
+        iov.push_back({const_cast<char *>(zeros), pad});
+    if(!index.empty())
+        iov.push_back({&index[0], index.size() * sizeof(d3l_fop_pack_entry)});
+
+    memcpy(header.magic, D3L_PACK_MAGIC, sizeof(header.magic));
+    header.version = D3L_PACK_VERSION;
+    header.endian = D3L_PACK_ENDIAN;
+    header.index_offset = offset + pad;
+    header.index_num = index.size();
+    header.index_checksum = d3l_fop_pack_sum(index.data(), index.size() * sizeof(d3l_fop_pack_entry));
+    header.file_size = header.index_offset + index.size() * sizeof(d3l_fop_pack_entry);
+    return d3l_fop_writev(sz_file, &iov[0], iov.size(), D3L_FOP_SYNC);
+}
+
+//! Map a pack file.
+/*!
+  \brief Map a pack file and check its header, byte order, size, index and the
+         bounds and alignment of each array.
+  \param[in] sz_file file path.
+  \param[in] flags D3L_PACK_VERIFY to verify checksums of all arrays.
+  \param[in] map_flags flags of d3l_fop_map::open().
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_pack::open(const char *sz_file, int flags, int map_flags)
+{
+    close();
+    if(map_.open(sz_file, map_flags) < 0)
+        return -1;
+
+    const char *err = NULL;
+    d3l_fop_pack_header header;
+    if(map_.size() < sizeof(header))
+        err = " isn't a pack file!";
+    else
+    {
+        memcpy(&header, map_.data(), sizeof(header));
+        uint64_t index_size = header.index_num * sizeof(d3l_fop_pack_entry);
+        if(0 != memcmp(header.magic, D3L_PACK_MAGIC, sizeof(header.magic)))
+            err = " isn't a pack file!";
+        else if(D3L_PACK_VERSION != header.version)
+            err = " has unsupported pack version!";
+        else if(D3L_PACK_ENDIAN != header.endian)
+            err = " was written in another byte order!";
+        else if(header.file_size != map_.size())
+            err = " is truncated!";
+        else if(0 != header.index_offset % D3L_MEM_LINE_SIZE || header.index_offset > map_.size() ||
+                header.index_num > map_.size() / sizeof(d3l_fop_pack_entry) ||
+                index_size > map_.size() - header.index_offset ||
+                header.index_checksum != d3l_fop_pack_sum(map_.data() + header.index_offset, index_size))
+            err = " has corrupted index!";
+    }
+    if(NULL == err)
+    {
+        index_ = reinterpret_cast<const d3l_fop_pack_entry *>(map_.data() + header.index_offset);
+        num_ = header.index_num;
+    }
+    for(size_t i = 0; NULL == err && i < num_; i++)
+    {
+        const d3l_fop_pack_entry &entry = index_[i];
+        if('\0' != entry.name[sizeof(entry.name) - 1] || 0 == entry.elem_size ||
+           0 == entry.align || 0 != (entry.align & (entry.align - 1)) || 0 != entry.offset % entry.align ||
+           entry.offset > header.index_offset ||
+           entry.count > (header.index_offset - entry.offset) / entry.elem_size)
+            err = " has corrupted index!";
+        else if((flags & D3L_PACK_VERIFY) && verify(entry) < 0)
+            err = " has corrupted array!";
+    }
+    if(NULL != err)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_pack::open(const char *, int, int) File ";
+        str_err = str_err + sz_file + err;
+        d3l_sys_err(str_err.c_str());
+        close();
+        return -2;
+    }
+    return 0;
+}
+
+//! Unmap the pack file.
+/*!
+  \brief Unmap the pack file, views of its arrays become invalid.
+ */
+void d3l_fop_pack::close()
+{
+    map_.close();
+    index_ = NULL;
+    num_ = 0;
+}
+
+//! Find an array entry by name.
+/*!
+  \brief Find an array entry by name.
+  \param[in] name array name.
+  \retval entry point; NULL if not found.
+ */
+const d3l_fop_pack_entry *d3l_fop_pack::find(const char *name) const
+{
+    for(size_t i = 0; i < num_; i++)
+    {
+        if(0 == strcmp(index_[i].name, name))
+            return &index_[i];
+    }
+    return NULL;
+}
+
+//! Verify checksum of an array.
+/*!
+  \brief Verify checksum of an array, arrays written without checksum pass.
+  \param[in] entry array entry of this pack.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_pack::verify(const d3l_fop_pack_entry &entry) const
+{
+    if(!(entry.flags & D3L_PACK_CHECKSUM))
+        return 0;
+    uint64_t sum = d3l_fop_pack_sum(map_.data() + entry.offset, entry.count * entry.elem_size);
+    return sum == entry.checksum ? 0 : -1;
+}
+
+//! Checksum indexed bytes of a file.
+/*!
+  \brief Checksum the first len bytes of a file, all of them up to 18 sampled
+         blocks and otherwise the first, the last and D3L_INDEX_SAMPLES evenly
+         spaced blocks, so a rewrite of a large file keeping size and mtime is
+         only caught when a sampled block changed.
+ */
+static uint64_t d3l_fop_line_sum(const char *data, uint64_t len)
+{
+    if(len <= (D3L_INDEX_SAMPLES + 2) * D3L_INDEX_SAMPLE)
+        return d3l_fop_pack_sum(data, len);
+    uint64_t sum = len;
+    uint64_t gap = (len - D3L_INDEX_SAMPLE) / (D3L_INDEX_SAMPLES + 1);
+    for(int i = 0; i <= D3L_INDEX_SAMPLES + 1; i++)
+    {
+        uint64_t pos = (D3L_INDEX_SAMPLES + 1 == i) ? len - D3L_INDEX_SAMPLE : gap * i;
+        sum = d3l_rotl64(sum ^ d3l_fop_pack_sum(data + pos, D3L_INDEX_SAMPLE), 27) * 0x9E3779B185EBCA87ULL;
+    }
+    return sum;
+}
+
+//! Open a file and load or build its line index.
+/*!
+  \brief Open a file and load its line index from the sidecar file, built with
+         the same stride, then bring it up to date with refresh().
+  \param[in] sz_file file path.
+  \param[in] stride lines between indexed offsets, 1 indexes every line.
+  \param[in] flags D3L_INDEX_NOSAVE to keep the index in memory only.
+  \retval ==0 Successed; <0 Failed, the index is closed.
+ */
+int d3l_fop_line_index::open(const char *sz_file, size_t stride, int flags)
+{
+    close();
+    file_ = sz_file;
+    stride_ = std::max<size_t>(stride, 1);
+    flags_ = flags;
+    load();
+    return refresh();
+}
+
+//! Load the index from the sidecar file.
+int d3l_fop_line_index::load()
+{
+    std::string index_file = file_ + D3L_INDEX_SUFFIX;
+    if(access(index_file.c_str(), F_OK) < 0 || pack_.open(index_file.c_str(), D3L_PACK_VERIFY) < 0)
+        return -1;
+    d3l_span<uint64_t> meta;
+    d3l_span<uint64_t> offsets;
+    bool valid = (pack_.get("meta", meta) >= 0 && meta.size() >= 5 && pack_.get("offsets", offsets) >= 0 &&
+                  meta[2] == stride_ && meta[3] <= meta[0] && offsets.size() == meta[3] / stride_ + 1 &&
+                  0 == offsets[0]);
+    // Line starts ascend and stay within the indexed bytes.
+    for(size_t i = 1; valid && i < offsets.size(); i++)
+        valid = (offsets[i] > offsets[i - 1] && offsets[i] <= meta[0]);
+    if(!valid)
+    {
+        pack_.close();
+        return -1;
+    }
+    size_ = meta[0];
+    mtime_ = meta[1];
+    newlines_ = meta[3];
+    sum_ = meta[4];
+    offsets_ = offsets.data();
+    offset_num_ = offsets.size();
+    return 0;
+}
+
+//! Save the index to the sidecar file.
+void d3l_fop_line_index::save()
+{
+    uint64_t meta[5] = {size_, static_cast<uint64_t>(mtime_), stride_,
+                        static_cast<uint64_t>(newlines_), sum_};
+    d3l_fop_pack_writer writer;
+    writer.add("meta", meta, 5);
+    writer.add("offsets", offsets_, offset_num_);
+    writer.write((file_ + D3L_INDEX_SUFFIX).c_str(), D3L_PACK_CHECKSUM);
+}
+
+//! Index lines of the mapped file from a byte offset.
+int d3l_fop_line_index::build(uint64_t from)
+{
+    if(offsets_ != grown_.data())
+        grown_.assign(offsets_, offsets_ + offset_num_);
+    if(0 == from)
+    {
+        grown_.assign(1, 0);
+        newlines_ = 0;
+    }
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(map_.data());
+    uint64_t end = map_.size();
+    d3l_simd_bytemask_fn kernel = d3l_simd_bytemask_kernel();
+    // Newline count after which the next line offset is kept.
+    uint64_t next = (newlines_ / stride_ + 1) * stride_;
+    for(uint64_t pos = from; pos < end; pos += 64)
+    {
+        uint64_t mask = kernel(data + pos, std::min<uint64_t>(64, end - pos), '\n');
+        int num = __builtin_popcountll(mask);
+        if(static_cast<uint64_t>(newlines_ + num) < next)
+        {
+            newlines_ += num;
+            continue;
+        }
+        for(; 0 != mask; mask &= mask - 1)
+        {
+            if(static_cast<uint64_t>(++newlines_) == next)
+            {
+                grown_.push_back(pos + __builtin_ctzll(mask) + 1);
+                next += stride_;
+            }
+        }
+    }
+    offsets_ = grown_.data();
+    offset_num_ = grown_.size();
+    size_ = end;
+    sum_ = d3l_fop_line_sum(map_.data(), end);
+    pack_.close();
+    return 0;
+}
+
+//! Update the index to the current file contents.
+/*!
+  \brief Update the index when size or mtime of the file changed, or when an
+         index loaded from the sidecar file doesn't match the file contents. A
+         file that grew and still has the same sampled indexed bytes, see
+         d3l_fop_line_sum(), is taken as appended and only the new bytes are
+         scanned, otherwise it is indexed again. This is a heuristic for files
+         larger than the samples. The sidecar file is saved after each update.
+  \retval ==0 Successed; <0 Failed, the index is closed.
+ */
+int d3l_fop_line_index::refresh()
+{
+    struct d3l_fop_meta meta;
+    if(d3l_fop_stat(file_.c_str(), &meta, 0) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_fop_line_index::refresh() File ";
+        str_err = str_err + file_ + " can't be stat!";
+        d3l_sys_err(str_err.c_str());
+        close();
+        return -1;
+    }
+    bool same = (NULL != offsets_ && static_cast<uint64_t>(meta.size) == size_ && meta.mtime == mtime_);
+    if(same && map_.size() == size_)
+        return 0;
+    if(map_.open(file_.c_str(), D3L_MAP_SEQUENTIAL) < 0)
+    {
+        close();
+        return -2;
+    }
+    // Same size and mtime after a rewrite, as cp -p or rsync -t leave it.
+    bool kept = (NULL != offsets_ && map_.size() >= size_ && d3l_fop_line_sum(map_.data(), size_) == sum_);
+    if(same && kept)
+        return 0;
+
+    uint64_t from = 0;
+    if(kept && map_.size() > size_)
+        from = size_;
+    build(from);
+    mtime_ = meta.mtime;
+    if(!(flags_ & D3L_INDEX_NOSAVE))
+        save();
+    return 0;
+}
+
+//! Close the index and the file.
+/*!
+  \brief Close the index and unmap the file, views of it become invalid.
+ */
+void d3l_fop_line_index::close()
+{
+    map_.close();
+    pack_.close();
+    std::vector<uint64_t>().swap(grown_);
+    offsets_ = NULL;
+    offset_num_ = 0;
+    size_ = 0;
+    mtime_ = 0;
+    newlines_ = 0;
+    sum_ = 0;
+}
+
+//! Skip num lines from a line start of the mapped file.
+/*!
+  \brief Skip num lines from a line start of the mapped file.
+  \retval start of the line after them; NULL if fewer lines are left.
+ */
+static const char *d3l_fop_line_skip(const char *pos, const char *end, uint64_t num)
+{
+    d3l_simd_bytemask_fn kernel = d3l_simd_bytemask_kernel();
+    while(num > 0)
+    {
+        if(pos >= end)
+            return NULL;
+        size_t len = std::min<size_t>(64, end - pos);
+        uint64_t mask = kernel(reinterpret_cast<const unsigned char *>(pos), len, '\n');
+        uint64_t cnt = __builtin_popcountll(mask);
+        if(cnt < num)
+        {
+            num -= cnt;
+            pos += len;
+            continue;
+        }
+        for(; num > 1; num--)
+            mask &= mask - 1;
+        return pos + __builtin_ctzll(mask) + 1;
+    }
+    return pos;
+}
+
+//! Get start of line n.
+const char *d3l_fop_line_index::line_start(int64_t n) const
+{
+    return d3l_fop_line_skip(map_.data() + offsets_[n / stride_], map_.data() + size_, n % stride_);
+}
+
+//! Get lines [a, b) from 0, without the last '\n'.
+/*!
+  \brief Get lines [a, b) as one view into the mapped file, including the
+         '\n' between them but not the last one.
+  \param[in] a first line.
+  \param[in] b line after the last one.
+  \param[out] view lines view.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_fop_line_index::range(int64_t a, int64_t b, std::string_view &view) const
+{
+    int64_t num = line_count();
+    if(a < 0 || a > b || b > num)
+        return -1;
+    if(a == b)
+    {
+        view = std::string_view();
+        return 0;
+    }
+    const char *start = line_start(a);
+    const char *end = map_.data() + size_;
+    if(NULL == start)
+        return -2;
+    if(b < num && static_cast<uint64_t>(b - a) < stride_)
+        end = d3l_fop_line_skip(start, end, b - a);
+    else if(b < num)
+        end = line_start(b);
+    else if('\n' != end[-1])
+        end++;
+    // Both ends are line starts, the view stops before the last '\n'.
+    if(NULL == end || end <= start || end > map_.data() + size_ + 1)
+        return -2;
+    view = std::string_view(start, end - 1 - start);
+    return 0;
+}
+
+//! Parse a buffer.
+/*!
+  \brief Parse a buffer, it must outlive the parser and its records.
+  \param[in] data buffer.
+  \param[in] len buffer length.
+  \param[in] delim field delimiter.
+  \param[in] quote quote char, 0 to disable quoting.
+ */
+void d3l_rec_parser::reset(const char *data, size_t len, char delim, char quote)
+{
+    data_ = data;
+    end_ = data + len;
+    pos_ = data;
+    delim_ = delim;
+    quote_ = quote;
+}
+
+//! Map and parse a file.
+/*!
+  \brief Map a file using d3l_fop_map and parse it.
+  \param[in] sz_file file path.
+  \param[in] delim field delimiter.
+  \param[in] quote quote char, 0 to disable quoting.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_rec_parser::open(const char *sz_file, char delim, char quote)
+{
+    if(map_.open(sz_file, D3L_MAP_SEQUENTIAL|D3L_MAP_WILLNEED) < 0)
+        return -1;
+    reset(map_.data(), map_.size(), delim, quote);
+    return 0;
+}
+
+//! Read next record.
+/*!
+  \brief Read next record, quoted fields may contain delimiters, newlines and
+         doubled quotes.
+  \param[out] rec record fields.
+  \retval 1 Got a record; 0 End of buffer; <0 Unterminated or malformed quoted field.
+ */
+int d3l_rec_parser::next(d3l_rec_record &rec)
+{
+    fields_.clear();
+    escaped_.clear();
+    scratch_.clear();
+    rec.fields_ = NULL;
+    rec.num_ = 0;
+
+    // Skip empty lines.
+    while(pos_ != end_ && ('\n' == *pos_ || ('\r' == *pos_ && pos_ + 1 != end_ && '\n' == pos_[1])))
+        pos_ += ('\n' == *pos_) ? 1 : 2;
+    if(pos_ == end_)
+        return 0;
+
+    const char *p = pos_;
+    for(;;)
+    {
+        const char *begin = p;
+        const char *stop = NULL;
+        if(0 != quote_ && p != end_ && quote_ == *p)
+        {
+            begin = ++p;
+            bool escaped = false;
+            for(;;)
+            {
+                const char *q = static_cast<const char *>(memchr(p, quote_, end_ - p));
+                if(NULL == q)
+                    return -1;
+                if(q + 1 != end_ && quote_ == q[1])
+                {
+                    escaped = true;
+                    p = q + 2;
+                    continue;
+                }
+                stop = q;
+                p = q + 1;
+                break;
+            }
+            if(escaped)
+            {
+                // Keep the unescaped copy in scratch, views are set when the record is done.
+                escaped_.push_back(fields_.size());
+                escaped_.push_back(scratch_.size());
+                for(const char *c = begin; c < stop; c++)
+                {
+                    scratch_ += *c;
+                    if(quote_ == *c)
+                        c++;
+                }
+                escaped_.push_back(scratch_.size() - escaped_[escaped_.size() - 1]);
+            }
+            if(p != end_ && '\r' == *p && p + 1 != end_ && '\n' == p[1])
+                p++;
+            if(p != end_ && delim_ != *p && '\n' != *p)
+                return -1;
+        }
+        else
+        {
+            p = static_cast<const char *>(d3l_simd_memchr2(p, end_ - p, delim_, '\n'));
+            if(NULL == p)
+                p = end_;
+            stop = p;
+            if(stop != begin && '\r' == stop[-1] && (p == end_ || '\n' == *p))
+                stop--;
+        }
+        fields_.push_back(std::string_view(begin, stop - begin));
+        if(p == end_ || '\n' == *p)
+            break;
+        p++;
+    }
+    pos_ = (p == end_) ? p : p + 1;
+
+    for(size_t i = 0; i < escaped_.size(); i += 3)
+        fields_[escaped_[i]] = std::string_view(scratch_.data() + escaped_[i + 1], escaped_[i + 2]);
+    rec.fields_ = fields_.data();
+    rec.num_ = fields_.size();
+    return 1;
+}
+
+//! Split a buffer at record boundaries.
+/*!
+  \brief Split a buffer into chunks starting at record boundaries for parallel
+         parsing. Newlines inside quoted fields are skipped by tracking quote
+         parity with d3l_simd_memcount(), doubled quotes keep the parity.
+  \param[in] data buffer.
+  \param[in] len buffer length.
+  \param[in] num chunk number.
+  \param[out] bounds num + 1 offsets, chunk i is [bounds[i], bounds[i + 1]).
+  \param[in] quote quote char, 0 to disable quoting.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_rec_split(const char *data, size_t len, size_t num, std::vector<size_t> &bounds, char quote)
+{
+    if(0 == num)
+        return -1;
+    bounds.assign(num + 1, len);
+    bounds[0] = 0;
+    size_t pos = 0;
+    size_t quotes = 0;
+    for(size_t i = 1; i < num; i++)
+    {
+        size_t target = std::max(pos, len / num * i);
+        if(0 != quote)
+            quotes += d3l_simd_memcount(data + pos, target - pos, quote);
+        pos = target;
+        // Move to the first newline after target which is outside quotes.
+        while(pos < len)
+        {
+            const char *nl = static_cast<const char *>(memchr(data + pos, '\n', len - pos));
+            size_t end = (NULL == nl) ? len : nl - data + 1;
+            if(0 != quote)
+                quotes += d3l_simd_memcount(data + pos, end - pos, quote);
+            pos = end;
+            if(0 == quotes % 2)
+                break;
+        }
+        bounds[i] = pos;
+    }
+    return 0;
+}
+
+//! Cached iconv descriptor.
+struct d3l_charset_cd
+{
+    std::string from;
+    std::string to;
+    iconv_t cd;
+};
+
+//! Iconv descriptor pool of one thread, most recently used first.
+struct d3l_charset_pool
+{
+    std::vector<d3l_charset_cd> cds;
+    ~d3l_charset_pool()
+    {
+        for(size_t i = 0; i < cds.size(); i++)
+            iconv_close(cds[i].cd);
+    }
+};
+static thread_local d3l_charset_pool d3l_charset_local;
+
+//! Get an iconv descriptor from the pool of current thread.
+/*!
+  \brief Get a cached iconv descriptor in initial shift state, open it at first use.
+  \param[in] from_charset src code charset.
+  \param[in] to_charset dest code charset.
+  \retval !=(iconv_t)-1 Successed; ==(iconv_t)-1 Failed.
+ */
+static iconv_t d3l_charset_pool_get(const char *from_charset, const char *to_charset)
+{
+    std::vector<d3l_charset_cd> &cds = d3l_charset_local.cds;
+    for(size_t i = 0; i < cds.size(); i++)
+    {
+        if(cds[i].from != from_charset || cds[i].to != to_charset)
+            continue;
+        if(0 != i)
+            std::swap(cds[0], cds[i]);
+        iconv(cds[0].cd, NULL, NULL, NULL, NULL);
+        return cds[0].cd;
+    }
+
+    iconv_t cd = iconv_open(to_charset, from_charset);
+    if(reinterpret_cast<iconv_t>(-1) == cd)
+        return cd;
+    if(cds.size() >= D3L_CHARSET_POOL_SIZE)
+    {
+        iconv_close(cds.back().cd);
+        cds.pop_back();
+    }
+    d3l_charset_cd item;
+    item.from = from_charset;
+    item.to = to_charset;
+    item.cd = cd;
+    cds.insert(cds.begin(), item);
+    return cd;
+}
+
+//! Close cached iconv descriptors.
+/*!
+  \brief Close all iconv descriptors cached by current thread.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_charset_pool_clear(void)
+{
+    std::vector<d3l_charset_cd> &cds = d3l_charset_local.cds;
+    for(size_t i = 0; i < cds.size(); i++)
+        iconv_close(cds[i].cd);
+    cds.clear();
+    return 0;
+}
+
+//! Copy leading ASCII bytes, 8 bytes at a time.
+static size_t d3l_charset_ascii_copy_c(const unsigned char *in, size_t len, unsigned char *out)
+{
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, in + i, 8);
+        if(0 != (v & 0x8080808080808080ULL))
+            break;
+        memcpy(out + i, &v, 8);
+    }
+    for(; i < len && in[i] < 0x80; i++)
+        out[i] = in[i];
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//! Copy leading ASCII bytes, 16 bytes at a time.
+__attribute__((target("sse2")))
+static size_t d3l_charset_ascii_copy_sse2(const unsigned char *in, size_t len, unsigned char *out)
+{
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        if(0 != _mm_movemask_epi8(v))
+            break;
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), v);
+    }
+    return i + d3l_charset_ascii_copy_c(in + i, len - i, out + i);
+}
+
+//! Copy leading ASCII bytes, 32 bytes at a time.
+__attribute__((target("avx2")))
+static size_t d3l_charset_ascii_copy_avx2(const unsigned char *in, size_t len, unsigned char *out)
+{
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+        if(0 != _mm256_movemask_epi8(v))
+            break;
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), v);
+    }
+    return i + d3l_charset_ascii_copy_c(in + i, len - i, out + i);
+}
+#endif
+
+//! ASCII copy kernel.
+typedef size_t (*d3l_charset_ascii_fn)(const unsigned char *, size_t, unsigned char *);
+
+//! Get ASCII copy kernel of current cpu.
+static d3l_charset_ascii_fn d3l_charset_ascii_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(D3L_CPU_AVX2 == d3l_cpu_level())
+        return d3l_charset_ascii_copy_avx2;
+    if(D3L_CPU_SSE2 == d3l_cpu_level())
+        return d3l_charset_ascii_copy_sse2;
+#endif
+    return d3l_charset_ascii_copy_c;
+}
+
+//! Get length of leading ASCII bytes, 8 bytes at a time.
+static size_t d3l_charset_ascii_span_c(const unsigned char *in, size_t len)
+{
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, in + i, 8);
+        if(0 != (v & 0x8080808080808080ULL))
+            break;
+    }
+    while(i < len && in[i] < 0x80)
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//! Get length of leading ASCII bytes, 64 bytes at a time.
+__attribute__((target("sse2")))
+static size_t d3l_charset_ascii_span_sse2(const unsigned char *in, size_t len)
+{
+    size_t i = 0;
+    for(; i + 64 <= len; i += 64)
+    {
+        const __m128i *p = reinterpret_cast<const __m128i *>(in + i);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if(0 != _mm_movemask_epi8(v))
+            break;
+    }
+    for(; i + 16 <= len; i += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)));
+        if(0 != mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + d3l_charset_ascii_span_c(in + i, len - i);
+}
+
+//! Get length of leading ASCII bytes, 128 bytes at a time.
+__attribute__((target("avx2")))
+static size_t d3l_charset_ascii_span_avx2(const unsigned char *in, size_t len)
+{
+    size_t i = 0;
+    for(; i + 128 <= len; i += 128)
+    {
+        const __m256i *p = reinterpret_cast<const __m256i *>(in + i);
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+                _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+        if(0 != _mm256_movemask_epi8(v))
+            break;
+    }
+    for(; i + 32 <= len; i += 32)
+    {
+        unsigned int mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i)));
+        if(0 != mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + d3l_charset_ascii_span_c(in + i, len - i);
+}
+#endif
+
+//! ASCII span kernel.
+typedef size_t (*d3l_charset_span_fn)(const unsigned char *, size_t);
+
+//! Get ASCII span kernel of current cpu.
+static d3l_charset_span_fn d3l_charset_span_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(D3L_CPU_AVX2 == d3l_cpu_level())
+        return d3l_charset_ascii_span_avx2;
+    if(D3L_CPU_SSE2 == d3l_cpu_level())
+        return d3l_charset_ascii_span_sse2;
+#endif
+    return d3l_charset_ascii_span_c;
+}
+
+//! Validate UTF-8 one sequence at a time.
+/*!
+  \brief Validate UTF-8 by the well-formed byte sequences of Unicode, overlong forms,
+         surrogates and code points above U+10FFFF are rejected, ASCII runs are skipped by SIMD kernel.
+  \retval true Valid; false Invalid.
+ */
+static bool d3l_charset_utf8_valid_c(const unsigned char *in, size_t len)
+{
+    d3l_charset_span_fn span = d3l_charset_span_kernel();
+    size_t i = 0;
+    while(i < len)
+    {
+        unsigned int c = in[i];
+        if(c < 0x80)
+        {
+            i += span(in + i, len - i);
+            continue;
+        }
+        size_t need;
+        unsigned int lo = 0x80;
+        unsigned int hi = 0xBF;
+        if(c >= 0xC2 && c <= 0xDF)
+            need = 1;
+        else if(c >= 0xE0 && c <= 0xEF)
+        {
+            need = 2;
+            if(0xE0 == c)
+                lo = 0xA0;
+            else if(0xED == c)
+                hi = 0x9F;
+        }
+        else if(c >= 0xF0 && c <= 0xF4)
+        {
+            need = 3;
+            if(0xF0 == c)
+                lo = 0x90;
+            else if(0xF4 == c)
+                hi = 0x8F;
+        }
+        else
+            return false;
+        if(len - i <= need)
+            return false;
+        if(in[i + 1] < lo || in[i + 1] > hi)
+            return false;
+        for(size_t k = 2; k <= need; k++)
+        {
+            if(0x80 != (in[i + k] & 0xC0))
+                return false;
+        }
+        i += need + 1;
+    }
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//! Validate UTF-8 32 bytes at a time by nibble lookup tables.
+/*!
+  \brief Validate UTF-8 by classifying each byte pair with three 16 entries lookup tables
+         (lookup algorithm of Keiser and Lemire), same result as d3l_charset_utf8_valid_c().
+  \retval true Valid; false Invalid.
+ */
+__attribute__((target("avx2")))
+static bool d3l_charset_utf8_valid_avx2(const unsigned char *in, size_t len)
+{
+    // Error bits of a byte pair.
+    const char TOO_SHORT = 1 << 0;      // 11______ 0_______, 11______ 11______
+    const char TOO_LONG = 1 << 1;       // 0_______ 10______
+    const char OVERLONG_3 = 1 << 2;     // 11100000 100_____
+    const char TOO_LARGE = 1 << 3;      // 11110100 1001____, 11110100 101_____, 1111(0101-1111) 10______
+    const char SURROGATE = 1 << 4;      // 11101101 101_____
+    const char OVERLONG_2 = 1 << 5;     // 1100000_ 10______
+    const char TOO_LARGE_1000 = 1 << 6; // 1111(0101-1111) 1000____
+    const char OVERLONG_4 = 1 << 6;     // 11110000 1000____
+    const char TWO_CONTS = static_cast<char>(1 << 7); // 10______ 10______
+    const char CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+    const __m256i byte_1_high_table = _mm256_setr_epi8(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const char LARGE = CARRY | TOO_LARGE | TOO_LARGE_1000;
+    const __m256i byte_1_low_table = _mm256_setr_epi8(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+        CARRY | TOO_LARGE, LARGE, LARGE, LARGE,
+        LARGE, LARGE, LARGE, LARGE, LARGE, LARGE | SURROGATE, LARGE, LARGE,
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+        CARRY | TOO_LARGE, LARGE, LARGE, LARGE,
+        LARGE, LARGE, LARGE, LARGE, LARGE, LARGE | SURROGATE, LARGE, LARGE);
+    const char CONT_8 = TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4;
+    const char CONT_9 = TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE;
+    const char CONT_AB = TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE;
+    const __m256i byte_2_high_table = _mm256_setr_epi8(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        CONT_8, CONT_9, CONT_AB, CONT_AB, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        CONT_8, CONT_9, CONT_AB, CONT_AB, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    // Lead bytes still waiting continuation bytes at the end of a block.
+    const __m256i incomplete_max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    __m256i prev = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    unsigned char tail[32];
+    size_t i = 0;
+    for(;;)
+    {
+        if(i + 128 <= len)
+        {
+            // Skip ASCII runs 128 bytes at a time, the bytes before them must be complete.
+            const __m256i *p = reinterpret_cast<const __m256i *>(in + i);
+            __m256i w = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+                    _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+            if(0 == _mm256_movemask_epi8(w))
+            {
+                error = _mm256_or_si256(error, prev_incomplete);
+                prev_incomplete = _mm256_setzero_si256();
+                prev = _mm256_setzero_si256();
+                i += 128;
+                continue;
+            }
+        }
+        __m256i v;
+        bool last = (i + 32 > len);
+        if(last)
+        {
+            // Zero padding after the input ends any incomplete sequence with an error.
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, in + i, len - i);
+            v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tail));
+        }
+        else
+            v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+
+        if(0 == _mm256_movemask_epi8(v))
+            error = _mm256_or_si256(error, prev_incomplete);
+        else
+        {
+            __m256i shift = _mm256_permute2x128_si256(prev, v, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(v, shift, 15);
+            __m256i prev2 = _mm256_alignr_epi8(v, shift, 14);
+            __m256i prev3 = _mm256_alignr_epi8(v, shift, 13);
+            __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table,
+                    _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+            __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, nibble));
+            __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table,
+                    _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+            // Only 111_____ two bytes before or 1111____ three bytes before need a continuation byte.
+            __m256i must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)),
+                    _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80)));
+            must23 = _mm256_and_si256(must23, _mm256_set1_epi8(static_cast<char>(0x80)));
+            error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+        }
+        prev_incomplete = _mm256_subs_epu8(v, incomplete_max);
+        prev = v;
+        if(last)
+            break;
+        i += 32;
+        if(0 == (i & 255) && !_mm256_testz_si256(error, error))
+            return false;
+    }
+    return _mm256_testz_si256(error, error);
+}
+#endif
+
+//! UTF-8 validation kernel.
+typedef bool (*d3l_charset_utf8_fn)(const unsigned char *, size_t);
+
+//! Get UTF-8 validation kernel of current cpu.
+static d3l_charset_utf8_fn d3l_charset_utf8_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(D3L_CPU_AVX2 == d3l_cpu_level())
+        return d3l_charset_utf8_valid_avx2;
+#endif
+    return d3l_charset_utf8_valid_c;
+}
+
+//! Validate GBK one character at a time.
+/*!
+  \brief Validate GBK by d3l_gbk_table, accept the same input as d3l_charset_native_g2u(),
+         ASCII runs are skipped by SIMD kernel.
+  \retval true Valid; false Invalid.
+ */
+static bool d3l_charset_gbk_valid(const unsigned char *in, size_t len)
+{
+    d3l_charset_span_fn span = d3l_charset_span_kernel();
+    size_t i = 0;
+    while(i < len)
+    {
+        unsigned int c = in[i];
+        if(c < 0x80)
+        {
+            i += span(in + i, len - i);
+            continue;
+        }
+        if(0x80 == c)
+        {
+            i++;
+            continue;
+        }
+        if(0xFF == c || i + 1 == len)
+            return false;
+        unsigned int t = in[i + 1];
+        if(t < 0x40 || t > 0xFE || 0 == d3l_gbk_table[c - 0x81][t - 0x40])
+            return false;
+        i += 2;
+    }
+    return true;
+}
+
+//! UNICODE to GBK table, built from d3l_gbk_table at first use.
+struct d3l_gbk_enc_table
+{
+    unsigned char page[256];            //!< page index + 1 of each 256 code points, 0 means no mapping.
+    std::vector<unsigned short> codes;  //!< GBK code (lead << 8 | trail) of each used page.
+};
+
+//! Get UNICODE to GBK table.
+static const d3l_gbk_enc_table &d3l_gbk_enc()
+{
+    static const d3l_gbk_enc_table *table = []
+    {
+        d3l_gbk_enc_table *enc = new d3l_gbk_enc_table();
+        memset(enc->page, 0, sizeof(enc->page));
+        size_t page_num = 0;
+        for(int lead = 0; lead < D3L_GBK_LEAD_NUM; lead++)
+        {
+            for(int trail = 0; trail < D3L_GBK_TRAIL_NUM; trail++)
+            {
+                unsigned int u = d3l_gbk_table[lead][trail];
+                if(0 == u)
+                    continue;
+                if(0 == enc->page[u >> 8])
+                {
+                    enc->page[u >> 8] = static_cast<unsigned char>(++page_num);
+                    enc->codes.resize(page_num * 256, 0);
+                }
+                enc->codes[(enc->page[u >> 8] - 1) * 256 + (u & 0xFF)] =
+                    static_cast<unsigned short>(((lead + 0x81) << 8) | (trail + 0x40));
+            }
+        }
+        return enc;
+    }();
+    return *table;
+}
+
+//! Stop a native conversion with iconv() error semantics.
+#define D3L_CHARSET_FAIL(err) { errno = (err); rs = static_cast<size_t>(-1); break; }
+
+//! Code convert from GBK to UTF-8 using table.
+/*!
+  \brief Code convert from GBK to UTF-8 using d3l_gbk_table, same semantics and
+         output as glibc iconv(), long ASCII runs are copied by SIMD kernel.
+  \retval ==0 Successed; ==(size_t)-1 Failed with errno E2BIG, EILSEQ or EINVAL.
+ */
+static size_t d3l_charset_native_g2u(char **inbuf, size_t *inleft, char **outbuf, size_t *outleft)
+{
+    d3l_charset_ascii_fn ascii_copy = d3l_charset_ascii_kernel();
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(*inbuf);
+    const unsigned char *in_end = in + *inleft;
+    unsigned char *out = reinterpret_cast<unsigned char *>(*outbuf);
+    unsigned char *out_end = out + *outleft;
+    size_t rs = 0;
+    while(in < in_end)
+    {
+        if(in[0] < 0x80)
+        {
+            size_t n = ascii_copy(in, std::min<size_t>(in_end - in, out_end - out), out);
+            in += n;
+            out += n;
+            if(in == in_end)
+                break;
+        }
+
+        unsigned int c = in[0];
+        unsigned int u = 0;
+        size_t used = 2;
+        if(c < 0x80)
+            D3L_CHARSET_FAIL(E2BIG)
+        if(0x80 == c)
+        {
+            u = 0x20AC;
+            used = 1;
+        }
+        else if(0xFF == c)
+            D3L_CHARSET_FAIL(EILSEQ)
+        else
+        {
+            if(in + 1 == in_end)
+                D3L_CHARSET_FAIL(EINVAL)
+            unsigned int t = in[1];
+            if(t < 0x40 || t > 0xFE || 0 == (u = d3l_gbk_table[c - 0x81][t - 0x40]))
+                D3L_CHARSET_FAIL(EILSEQ)
+        }
+
+        size_t need = u < 0x800 ? 2 : 3;
+        if(static_cast<size_t>(out_end - out) < need)
+            D3L_CHARSET_FAIL(E2BIG)
+        if(2 == need)
+        {
+            out[0] = 0xC0 | (u >> 6);
+            out[1] = 0x80 | (u & 0x3F);
+        }
+        else
+        {
+            out[0] = 0xE0 | (u >> 12);
+            out[1] = 0x80 | ((u >> 6) & 0x3F);
+            out[2] = 0x80 | (u & 0x3F);
+        }
+        out += need;
+        in += used;
+    }
+    *inleft = in_end - in;
+    *inbuf = reinterpret_cast<char *>(const_cast<unsigned char *>(in));
+    *outleft = out_end - out;
+    *outbuf = reinterpret_cast<char *>(out);
+    return rs;
+}
+
+//! Code convert from UTF-8 to GBK using table.
+/*!
+  \brief Code convert from UTF-8 to GBK using d3l_gbk_table, same semantics and
+         output as glibc iconv(), long ASCII runs are copied by SIMD kernel.
+  \retval ==0 Successed; ==(size_t)-1 Failed with errno E2BIG, EILSEQ or EINVAL.
+ */
+static size_t d3l_charset_native_u2g(char **inbuf, size_t *inleft, char **outbuf, size_t *outleft)
+{
+    d3l_charset_ascii_fn ascii_copy = d3l_charset_ascii_kernel();
+    const d3l_gbk_enc_table &enc = d3l_gbk_enc();
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(*inbuf);
+    const unsigned char *in_end = in + *inleft;
+    unsigned char *out = reinterpret_cast<unsigned char *>(*outbuf);
+    unsigned char *out_end = out + *outleft;
+    size_t rs = 0;
+    while(in < in_end)
+    {
+        if(in[0] < 0x80)
+        {
+            size_t n = ascii_copy(in, std::min<size_t>(in_end - in, out_end - out), out);
+            in += n;
+            out += n;
+            if(in == in_end)
+                break;
+        }
+
+        unsigned int c = in[0];
+        if(c < 0x80)
+            D3L_CHARSET_FAIL(E2BIG)
+        if(c < 0xC2 || c > 0xFD)
+            D3L_CHARSET_FAIL(EILSEQ)
+
+        // Like iconv, 5 and 6 bytes forms are only rejected once complete.
+        size_t used = c < 0xE0 ? 2 : (c < 0xF0 ? 3 : (c < 0xF8 ? 4 : (c < 0xFC ? 5 : 6)));
+        size_t avail = in_end - in;
+        size_t i = 1;
+        while(i < used && i < avail && 0x80 == (in[i] & 0xC0))
+            i++;
+        if(i < used)
+        {
+            if(i == avail)
+                D3L_CHARSET_FAIL(EINVAL)
+            D3L_CHARSET_FAIL(EILSEQ)
+        }
+        if(used > 4)
+            D3L_CHARSET_FAIL(EILSEQ)
+        unsigned int u = c & (0x7F >> used);
+        for(i = 1; i < used; i++)
+            u = (u << 6) | (in[i] & 0x3F);
+        if((2 == used && u < 0x80) || (3 == used && (u < 0x800 || (u >= 0xD800 && u < 0xE000))) ||
+           (4 == used && (u < 0x10000 || u > 0x10FFFF)))
+            D3L_CHARSET_FAIL(EILSEQ)
+        if(out == out_end)
+            D3L_CHARSET_FAIL(E2BIG)
+
+        if(u >= 0xE0000 && u <= 0xE007F)
+        {
+            // Tag characters are dropped by iconv.
+            in += used;
+            continue;
+        }
+        if(0x20AC == u)
+        {
+            *out++ = 0x80;
+            in += used;
+            continue;
+        }
+        unsigned int code = 0;
+        if(u <= 0xFFFF && 0 != enc.page[u >> 8])
+            code = enc.codes[(enc.page[u >> 8] - 1) * 256 + (u & 0xFF)];
+        if(0 == code)
+            D3L_CHARSET_FAIL(EILSEQ)
+        if(out_end - out < 2)
+            D3L_CHARSET_FAIL(E2BIG)
+        out[0] = code >> 8;
+        out[1] = code & 0xFF;
+        out += 2;
+        in += used;
+    }
+    *inleft = in_end - in;
+    *inbuf = reinterpret_cast<char *>(const_cast<unsigned char *>(in));
+    *outleft = out_end - out;
+    *outbuf = reinterpret_cast<char *>(out);
+    return rs;
+}
+
+#undef D3L_CHARSET_FAIL
+
+//! Get native converter kind of a charset pair.
+static int d3l_charset_native_kind(const char *from_charset, const char *to_charset)
+{
+#ifdef D3L_CHARSET_NATIVE
+    bool from_gbk = (0 == strcasecmp(from_charset, "GBK"));
+    bool to_gbk = (0 == strcasecmp(to_charset, "GBK"));
+    bool from_utf8 = (0 == strcasecmp(from_charset, "UTF-8") || 0 == strcasecmp(from_charset, "UTF8"));
+    bool to_utf8 = (0 == strcasecmp(to_charset, "UTF-8") || 0 == strcasecmp(to_charset, "UTF8"));
+    if(from_gbk && to_utf8)
+        return D3L_CHARSET_G2U;
+    if(from_utf8 && to_gbk)
+        return D3L_CHARSET_U2G;
+#else
+    (void)from_charset;
+    (void)to_charset;
+#endif
+    return D3L_CHARSET_ICONV;
+}
+
+//! Code converter, native table or cached iconv descriptor.
+struct d3l_charset_conv
+{
+    int kind;
+    iconv_t cd;
+};
+
+//! Open a code converter.
+/*!
+  \brief Open a code converter, native for GBK <-> UTF-8 and pooled iconv for others.
+  \param[out] conv converter.
+  \param[in] from_charset src code charset.
+  \param[in] to_charset dest code charset.
+  \retval ==0 Successed; <0 Failed.
+ */
+static int d3l_charset_conv_open(d3l_charset_conv *conv, const char *from_charset, const char *to_charset)
+{
+    conv->kind = d3l_charset_native_kind(from_charset, to_charset);
+    conv->cd = reinterpret_cast<iconv_t>(-1);
+    if(D3L_CHARSET_ICONV != conv->kind)
+        return 0;
+    conv->cd = d3l_charset_pool_get(from_charset, to_charset);
+    return reinterpret_cast<iconv_t>(-1) == conv->cd ? -1 : 0;
+}
+
+//! Run a code converter.
+/*!
+  \brief Run a code converter with iconv() semantics, NULL inbuf writes the shift reset sequence.
+  \retval !=(size_t)-1 Successed; ==(size_t)-1 Failed with errno set.
+ */
+static size_t d3l_charset_conv_run(d3l_charset_conv *conv, char **inbuf, size_t *inleft,
+        char **outbuf, size_t *outleft)
+{
+    if(D3L_CHARSET_ICONV == conv->kind)
+        return iconv(conv->cd, inbuf, inleft, outbuf, outleft);
+    if(NULL == inbuf || NULL == *inbuf)
+        return 0;
+    if(D3L_CHARSET_G2U == conv->kind)
+        return d3l_charset_native_g2u(inbuf, inleft, outbuf, outleft);
+    return d3l_charset_native_u2g(inbuf, inleft, outbuf, outleft);
+}
+
+//! Code convert a string object.
+/*!
+  \brief Code convert a string object, output grows as needed.
+  \param[in] from_charset src code charset.
+  \param[in] to_charset dest code charset.
+  \param[in] str_in src string object.
+  \param[out] str_out dest string object, converted prefix on failure.
+  \retval ==0 Successed; <0 Failed.
+ */
+static int d3l_charset_convert_string(const char *from_charset, const char *to_charset,
+        const std::string &str_in, std::string &str_out)
+{
+    d3l_charset_conv conv;
+    if(d3l_charset_conv_open(&conv, from_charset, to_charset) < 0)
+        return -1;
+
+    std::string str_tmp;
+    std::string &str_dest = (&str_in == &str_out) ? str_tmp : str_out;
+    str_dest.resize(str_in.size() + str_in.size() / 2 + 16);
+    char *inbuf = const_cast<char *>(str_in.data());
+    size_t in_left = str_in.size();
+    size_t used = 0;
+    size_t rs = 0;
+    for(;;)
+    {
+        char *outbuf = &str_dest[used];
+        size_t out_left = str_dest.size() - used;
+        rs = d3l_charset_conv_run(&conv, &inbuf, &in_left, &outbuf, &out_left);
+        if(static_cast<size_t>(-1) != rs)
+            rs = d3l_charset_conv_run(&conv, NULL, NULL, &outbuf, &out_left);
+        used = str_dest.size() - out_left;
+        if(static_cast<size_t>(-1) != rs || E2BIG != errno)
+            break;
+        str_dest.resize(str_dest.size() * 2);
+    }
+    str_dest.resize(used);
+    if(&str_dest != &str_out)
+        str_out.swap(str_dest);
+    return static_cast<size_t>(-1) == rs ? -1 : 0;
+}
+
+//! Conversion memo slot, key bytes followed by value bytes.
+struct d3l_charset_memo_slot
+{
+    uint64_t hash;                      //!< tag of the key, 0 means empty.
+    unsigned char kind;                 //!< D3L_CHARSET_G2U or D3L_CHARSET_U2G.
+    unsigned char ref;                  //!< CLOCK reference bit.
+    unsigned char key_len;
+    unsigned char val_len;
+    char data[D3L_MEMO_SLOT_BYTES];
+};
+
+static_assert(D3L_CHARSET_MEMO_LEN < D3L_MEMO_SLOT_BYTES && D3L_CHARSET_MEMO_LEN < 256,
+        "D3L_CHARSET_MEMO_LEN must fit a memo slot");
+
+//! Conversion memo set, entries are replaced by CLOCK within the set.
+struct alignas(64) d3l_charset_memo_set
+{
+    d3l_charset_memo_slot slots[D3L_MEMO_WAYS];
+    unsigned int hand;
+};
+
+//! Lock shard of the conversion memo, owns sets whose index has the same low bits.
+struct alignas(64) d3l_charset_memo_shard
+{
+    std::mutex mutex;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+};
+
+//! Conversion memo of short GBK <-> UTF-8 string objects.
+/*!
+  \brief A set-associative table of fixed size slots, so lookups and inserts never
+         allocate. Close takes every shard lock before the sets are freed.
+ */
+struct d3l_charset_memo
+{
+    std::mutex mutex;                   //!< serializes open and close.
+    std::atomic<bool> running;
+    d3l_charset_memo_set *sets;
+    size_t set_num;
+    d3l_charset_memo_shard shards[D3L_MEMO_SHARDS];
+
+    d3l_charset_memo() : running(false), sets(NULL), set_num(0) {}
+};
+
+//! Get the conversion memo.
+static d3l_charset_memo *d3l_charset_memo_inst()
+{
+    // Leaked on purpose, it may be used by threads outliving static destruction.
+    static d3l_charset_memo *memo = new d3l_charset_memo();
+    return memo;
+}
+
+//! Free sets of the conversion memo, all shard locks are held by caller.
+static void d3l_charset_memo_free(d3l_charset_memo *memo)
+{
+    if(NULL != memo->sets)
+        d3l_mem_aligned_free(memo->sets, memo->set_num * sizeof(d3l_charset_memo_set), 0);
+    memo->sets = NULL;
+    memo->set_num = 0;
+    for(int i = 0; i < D3L_MEMO_SHARDS; i++)
+        memo->shards[i].hits = memo->shards[i].misses = memo->shards[i].evictions = memo->shards[i].entries = 0;
+}
+
+//! Find a conversion in the memo.
+/*!
+  \brief Find a conversion in the memo and copy its result to str_out, which doesn't
+         allocate when str_out has capacity. A miss is counted for the caller to insert.
+  \retval true Found; false Not found or memo stopped.
+ */
+static bool d3l_charset_memo_get(d3l_charset_memo *memo, int kind, uint64_t hash,
+        const char *key, size_t key_len, std::string &str_out)
+{
+    std::lock_guard<std::mutex> lock(memo->shards[hash % D3L_MEMO_SHARDS].mutex);
+    if(!memo->running.load(std::memory_order_relaxed))
+        return false;
+    d3l_charset_memo_shard &shard = memo->shards[hash % D3L_MEMO_SHARDS];
+    d3l_charset_memo_set &set = memo->sets[hash & (memo->set_num - 1)];
+    for(int i = 0; i < D3L_MEMO_WAYS; i++)
+    {
+        d3l_charset_memo_slot &slot = set.slots[i];
+        if(slot.hash != hash || slot.kind != kind || slot.key_len != key_len ||
+                0 != memcmp(slot.data, key, key_len))
+            continue;
+        slot.ref = 1;
+        shard.hits++;
+        str_out.assign(slot.data + key_len, slot.val_len);
+        return true;
+    }
+    shard.misses++;
+    return false;
+}
+
+//! Insert a conversion into the memo.
+/*!
+  \brief Insert a conversion into an empty way of its set, or replace the first way
+         not referenced since the CLOCK hand last passed. New entries start
+         unreferenced, so values seen once leave before repeated ones.
+ */
+static void d3l_charset_memo_put(d3l_charset_memo *memo, int kind, uint64_t hash,
+        const char *key, size_t key_len, const std::string &str_val)
+{
+    if(key_len + str_val.size() > D3L_MEMO_SLOT_BYTES)
+        return;
+    std::lock_guard<std::mutex> lock(memo->shards[hash % D3L_MEMO_SHARDS].mutex);
+    if(!memo->running.load(std::memory_order_relaxed))
+        return;
+    d3l_charset_memo_shard &shard = memo->shards[hash % D3L_MEMO_SHARDS];
+    d3l_charset_memo_set &set = memo->sets[hash & (memo->set_num - 1)];
+    d3l_charset_memo_slot *victim = NULL;
+    for(int i = 0; i < D3L_MEMO_WAYS; i++)
+    {
+        d3l_charset_memo_slot &slot = set.slots[i];
+        // Another thread converted the same key meanwhile.
+        if(slot.hash == hash && slot.kind == kind && slot.key_len == key_len &&
+                0 == memcmp(slot.data, key, key_len))
+            return;
+        if(NULL == victim && 0 == slot.hash)
+            victim = &slot;
+    }
+    if(NULL == victim)
+    {
+        while(0 != set.slots[set.hand].ref)
+        {
+            set.slots[set.hand].ref = 0;
+            set.hand = (set.hand + 1) % D3L_MEMO_WAYS;
+        }
+        victim = &set.slots[set.hand];
+        set.hand = (set.hand + 1) % D3L_MEMO_WAYS;
+        shard.evictions++;
+    }
+    else
+        shard.entries++;
+    victim->hash = hash;
+    victim->kind = static_cast<unsigned char>(kind);
+    victim->ref = 0;
+    victim->key_len = static_cast<unsigned char>(key_len);
+    victim->val_len = static_cast<unsigned char>(str_val.size());
+    memcpy(victim->data, key, key_len);
+    memcpy(victim->data + key_len, str_val.data(), str_val.size());
+}
+
+//! Code convert a string object between GBK and UTF-8 through the conversion memo.
+/*!
+  \brief Code convert a string object between GBK and UTF-8, short inputs are served
+         from the conversion memo when it runs, failed conversions aren't kept.
+  \param[in] kind D3L_CHARSET_G2U or D3L_CHARSET_U2G.
+  \param[in] str_in src string object.
+  \param[out] str_out dest string object.
+  \retval ==0 Successed; <0 Failed.
+ */
+static int d3l_charset_convert_memo(int kind, const std::string &str_in, std::string &str_out)
+{
+    const char *from_charset = (D3L_CHARSET_G2U == kind) ? D3L_GB_CODE : "utf-8";
+    const char *to_charset = (D3L_CHARSET_G2U == kind) ? "utf-8" : D3L_GB_CODE;
+    d3l_charset_memo *memo = d3l_charset_memo_inst();
+    size_t key_len = str_in.size();
+    if(key_len > D3L_CHARSET_MEMO_LEN || !memo->running.load(std::memory_order_acquire))
+        return d3l_charset_convert_string(from_charset, to_charset, str_in, str_out);
+
+    // Keep the key, str_in may be str_out.
+    char key[D3L_CHARSET_MEMO_LEN];
+    memcpy(key, str_in.data(), key_len);
+    // Low bits pick the set and its shard, the top bit marks the slot in use.
+    uint64_t hash = std::hash<std::string_view>()(std::string_view(key, key_len)) | (1ULL << 63);
+    if(d3l_charset_memo_get(memo, kind, hash, key, key_len, str_out))
+        return 0;
+    if(d3l_charset_convert_string(from_charset, to_charset, str_in, str_out) < 0)
+        return -1;
+    d3l_charset_memo_put(memo, kind, hash, key, key_len, str_out);
+    return 0;
+}
+
+//! Start the conversion memo of short string objects.
+/*!
+  \brief Start the conversion memo used by the string object forms of d3l_charset_u2g()
+         and d3l_charset_g2u(). Inputs up to D3L_CHARSET_MEMO_LEN bytes are kept with
+         their results in fixed size slots, so repeated values skip the conversion and
+         a hit copies the result without allocation when str_out has capacity.
+         Reopen drops all entries and statistics.
+  \param[in] entries max entries, rounded up to a power of 2 sets of 8 ways and at least
+             512 entries, 128 bytes each.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_charset_memo_open(size_t entries)
+{
+    d3l_charset_memo *memo = d3l_charset_memo_inst();
+    std::lock_guard<std::mutex> lock(memo->mutex);
+    // A set is guarded by one shard when there are at least as many sets as shards.
+    size_t set_num = D3L_MEMO_SHARDS;
+    while(set_num * D3L_MEMO_WAYS < entries)
+        set_num <<= 1;
+    size_t size = set_num * sizeof(d3l_charset_memo_set);
+    d3l_charset_memo_set *sets = static_cast<d3l_charset_memo_set *>(d3l_mem_aligned(size, 64, 0));
+    if(NULL == sets)
+    {
+        d3l_sys_err("ERROR d3l::d3l_charset_memo_open(size_t entries) Memory can't be allocated!");
+        return -1;
+    }
+    memset(static_cast<void *>(sets), 0, size);
+
+    for(int i = 0; i < D3L_MEMO_SHARDS; i++)
+        memo->shards[i].mutex.lock();
+    d3l_charset_memo_free(memo);
+    memo->sets = sets;
+    memo->set_num = set_num;
+    memo->running.store(true, std::memory_order_release);
+    for(int i = D3L_MEMO_SHARDS - 1; i >= 0; i--)
+        memo->shards[i].mutex.unlock();
+    return 0;
+}
+
+//! Stop the conversion memo.
+/*!
+  \brief Stop the conversion memo and free its entries.
+ */
+void d3l_charset_memo_close(void)
+{
+    d3l_charset_memo *memo = d3l_charset_memo_inst();
+    std::lock_guard<std::mutex> lock(memo->mutex);
+    if(!memo->running.load())
+        return;
+    for(int i = 0; i < D3L_MEMO_SHARDS; i++)
+        memo->shards[i].mutex.lock();
+    memo->running.store(false);
+    d3l_charset_memo_free(memo);
+    for(int i = D3L_MEMO_SHARDS - 1; i >= 0; i--)
+        memo->shards[i].mutex.unlock();
+}
+
+//! Get statistics of the conversion memo.
+/*!
+  \brief Get statistics of the conversion memo since it was opened, hits / (hits + misses)
+         is the hit ratio and evictions growing with misses means the memo is too small.
+  \param[out] stat memo statistics.
+  \retval ==0 Successed; <0 Memo not running.
+ */
+int d3l_charset_memo_stats(struct d3l_charset_memo_stat *stat)
+{
+    d3l_charset_memo *memo = d3l_charset_memo_inst();
+    std::lock_guard<std::mutex> lock(memo->mutex);
+    memset(stat, 0, sizeof(*stat));
+    if(!memo->running.load())
+        return -1;
+    for(int i = 0; i < D3L_MEMO_SHARDS; i++)
+    {
+        std::lock_guard<std::mutex> shard_lock(memo->shards[i].mutex);
+        stat->hits += memo->shards[i].hits;
+        stat->misses += memo->shards[i].misses;
+        stat->evictions += memo->shards[i].evictions;
+        stat->entries += memo->shards[i].entries;
+    }
+    stat->capacity = memo->set_num * D3L_MEMO_WAYS;
+    return 0;
+}
+
+//! Code convert from one to another.
+/*!
+  \brief Code convert from one to another, GBK <-> UTF-8 using native table and
+         others using iconv descriptors cached per thread by (from_charset, to_charset).
+         Output is terminated by '\\0' when there is space left.
+  \param[in] from_charset src code charset.
+  \param[in] to_charset dest code charset.
+  \param[in] inbuf src string.
+  \param[in] inlen src string length.
+  \param[out] outbuf dest string.
+  \param[in] outlen dest string length.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_charset_code_convert(char *from_charset, char *to_charset, char *inbuf, int inlen, char *outbuf, int outlen)
+{
+    d3l_charset_conv conv;
+    if (d3l_charset_conv_open(&conv, from_charset, to_charset) < 0)
+    {
+        std::string str_err = "ERROR d3l::int d3l_charset_code_convert(char *from_charset,char *to_charset,char *inbuf,int inlen,char *outbuf,int outlen) \n iconv_open(to_charset, from_charset)";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+
+    size_t in_left = inlen;
+    size_t out_left = outlen;
+    size_t rs = d3l_charset_conv_run(&conv, &inbuf, &in_left, &outbuf, &out_left);
+    if (static_cast<size_t>(-1) != rs)
+        rs = d3l_charset_conv_run(&conv, NULL, NULL, &outbuf, &out_left);
+    if (out_left > 0)
+        *outbuf = '\0';
+    if (static_cast<size_t>(-1) == rs)
+    {
+        std::string str_err = "ERROR d3l::int d3l_charset_code_convert(char *from_charset,char *to_charset,char *inbuf,int inlen,char *outbuf,int outlen) \n iconv(cd, pin, &inlen, pout, &outlen)";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//! Code convert string from UNICODE to GB2312.
+/*!
+  \brief Code convert string from UNICODE to GB2312 using iconv, pure ASCII is copied as is.
+  \param[in] inbuf src string.
+  \param[in] inlen src string length.
+  \param[out] outbuf dest string.
+  \param[in] outlen dest string length.
+  \retval ==0 Successed; <0 Failed.
+ */
+// UNICODE code to GB2312 code
+// Example: char *in_utf8 = "utf8字符串";
+//          rec = u2g(in_utf8,strlen(in_utf8),out,OUTLEN);
+//          printf("unicode-->gb2312 out=%s\n",out);
+int d3l_charset_u2g(char *inbuf,size_t inlen,char *outbuf,size_t outlen)
+{
+    // ASCII is the same in both charsets.
+    if(inlen <= outlen && d3l_charset_is_ascii(inbuf, inlen))
+    {
+        memmove(outbuf, inbuf, inlen);
+        if(inlen < outlen)
+            outbuf[inlen] = '\0';
+        return 0;
+    }
+    //return d3l_charset_code_convert("utf-8","gb2312",inbuf,inlen,outbuf,outlen);
+    return d3l_charset_code_convert(const_cast<char *>("utf-8"),const_cast<char *>(D3L_GB_CODE),inbuf,inlen,outbuf,outlen);
+}
+
+//! Code convert string from GB2312 to UNICODE.
+/*!
+  \brief Code convert string from GB2312 to UNICODE using iconv, pure ASCII is copied as is.
+  \param[in] inbuf src string.
+  \param[in] inlen src string.
+  \param[out] outbuf dest string.
+  \param[in] outlen dest string length.
+  \retval ==0 Successed; <0 Failed.
+ */
+// GB2312 code to UNICODE code
+// Example: char *in_gb2312 = "\xbe\xb2\xcc\xac\xc4\xa3\xca\xbd";
+//          rec = g2u(in_gb2312,strlen(in_gb2312),out,OUTLEN);
+//          printf("gb2312-->unicode out=%s \n",out);
+int d3l_charset_g2u(char *inbuf,size_t inlen,char *outbuf,size_t outlen)
+{
+    // ASCII is the same in both charsets.
+    if(inlen <= outlen && d3l_charset_is_ascii(inbuf, inlen))
+    {
+        memmove(outbuf, inbuf, inlen);
+        if(inlen < outlen)
+            outbuf[inlen] = '\0';
+        return 0;
+    }
+    //return d3l_charset_code_convert("gb2312","utf-8",inbuf,inlen,outbuf,outlen);
+    return d3l_charset_code_convert(const_cast<char *>(D3L_GB_CODE),const_cast<char *>("utf-8"),inbuf,inlen,outbuf,outlen);
+}
+
+//! Check if a string object needs no GBK <-> UTF-8 conversion.
+/*!
+  \brief Check if a string object is pure ASCII, or with D3L_CHARSET_KEEP_VALID already
+         valid in the dest charset. Input valid in UTF-8 is never kept as GBK.
+  \param[in] str_in src string object.
+  \param[in] to_utf8 dest charset is UTF-8.
+  \param[in] flags D3L_CHARSET_KEEP_VALID or 0.
+  \retval true No conversion needed; false Conversion needed.
+ */
+static bool d3l_charset_keep(const std::string &str_in, bool to_utf8, int flags)
+{
+    if(0 == (flags & D3L_CHARSET_KEEP_VALID))
+        return 1 == d3l_charset_is_ascii(str_in.data(), str_in.size());
+    if(to_utf8)
+        return 1 == d3l_charset_is_utf8(str_in.data(), str_in.size());
+    int kind = d3l_charset_detect(str_in.data(), str_in.size());
+    return D3L_CHARSET_ASCII == kind || D3L_CHARSET_GBK == kind;
+}
+
+//! Code convert string object from UNICODE to GB2312.
+/*!
+  \brief Code convert string object from UNICODE to GB2312, pure ASCII is copied as is,
+         short inputs go through the conversion memo when it runs.
+  \param[in] str_in src string object.
+  \param[out] str_out dest string object.
+  \param[in] flags D3L_CHARSET_KEEP_VALID copies input which is already valid GBK.
+  \retval ==0 Successed; *<0 Failed.*
+ */
+int d3l_charset_u2g(const std::string &str_in, std::string &str_out, int flags)
+{
+    if(d3l_charset_keep(str_in, false, flags))
+    {
+        if(&str_in != &str_out)
+            str_out = str_in;
+        return 0;
+    }
+    if(d3l_charset_convert_memo(D3L_CHARSET_U2G, str_in, str_out) < 0)
+    {
+        std::string str_err = "ERROR d3l::int d3l_charset_u2g(const std::string &str_in, std::string &str_out) Convert failed!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//! Code convert string object from UNICODE to GB2312, move input when no work is needed.
+/*!
+  \brief Code convert string object from UNICODE to GB2312, input which needs no
+         conversion is moved to dest string object without copy.
+  \param[in] str_in src string object.
+  \param[out] str_out dest string object.
+  \param[in] flags D3L_CHARSET_KEEP_VALID keeps input which is already valid GBK.
+  \retval ==0 Successed; *<0 Failed.*
+ */
+int d3l_charset_u2g(std::string &&str_in, std::string &str_out, int flags)
+{
+    if(d3l_charset_keep(str_in, false, flags))
+    {
+        if(&str_in != &str_out)
+            str_out = std::move(str_in);
+        return 0;
+    }
+    return d3l_charset_u2g(static_cast<const std::string &>(str_in), str_out, 0);
+}
+
+//! Code convert string object from GB2312 to UNICODE.
+/*!
+  \brief Code convert string object from GB2312 to UNICODE, pure ASCII is copied as is,
+         short inputs go through the conversion memo when it runs.
+  \param[in] str_in src string object.
+  \param[out] str_out dest string object.
+  \param[in] flags D3L_CHARSET_KEEP_VALID copies input which is already valid UTF-8.
+  \retval ==0 Successed; *<0 Failed.*
+ */
+int d3l_charset_g2u(const std::string &str_in, std::string &str_out, int flags)
+{
+    if(d3l_charset_keep(str_in, true, flags))
+    {
+        if(&str_in != &str_out)
+            str_out = str_in;
+        return 0;
+    }
+    if(d3l_charset_convert_memo(D3L_CHARSET_G2U, str_in, str_out) < 0)
+    {
+        std::string str_err = "ERROR d3l::int d3l_charset_g2u(const std::string &str_in, std::string &str_out) Convert failed!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//! Code convert string object from GB2312 to UNICODE, move input when no work is needed.
+/*!
+  \brief Code convert string object from GB2312 to UNICODE, input which needs no
+         conversion is moved to dest string object without copy.
+  \param[in] str_in src string object.
+  \param[out] str_out dest string object.
+  \param[in] flags D3L_CHARSET_KEEP_VALID keeps input which is already valid UTF-8.
+  \retval ==0 Successed; *<0 Failed.*
+ */
+int d3l_charset_g2u(std::string &&str_in, std::string &str_out, int flags)
+{
+    if(d3l_charset_keep(str_in, true, flags))
+    {
+        if(&str_in != &str_out)
+            str_out = std::move(str_in);
+        return 0;
+    }
+    return d3l_charset_g2u(static_cast<const std::string &>(str_in), str_out, 0);
+}
+
+//! Data block of the streaming conversion.
+struct d3l_charset_block
+{
+    char *data;     //!< block data, D3L_CHARSET_CARRY bytes of headroom before it.
+    ssize_t len;    //!< data length, 0 means end of input, <0 means read error.
+};
+
+//! Block queue between streaming conversion stages, NULL block stops the writer.
+struct d3l_charset_queue
+{
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<d3l_charset_block *> blocks;
+
+    void push(d3l_charset_block *block)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            blocks.push_back(block);
+        }
+        cv.notify_one();
+    }
+
+    d3l_charset_block *pop()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this]{ return !blocks.empty(); });
+        d3l_charset_block *block = blocks.front();
+        blocks.pop_front();
+        return block;
+    }
+};
+
+//! Streaming conversion state.
+struct d3l_charset_stream
+{
+    int fd_in;
+    int fd_out;
+    bool pipeline;
+    char *memory;
+    size_t memory_size;
+    d3l_charset_block in_blocks[D3L_CHARSET_DEPTH];
+    d3l_charset_block out_blocks[D3L_CHARSET_DEPTH];
+    d3l_charset_queue in_free, in_full, out_free, out_full;
+    std::atomic<bool> stop;
+    int err_write;
+
+    d3l_charset_stream() : memory(NULL), memory_size(0) {}
+    ~d3l_charset_stream() { d3l_mem_aligned_free(memory, memory_size, 0); }
+};
+
+//! Fill a block from fd, read until the block is full or end of file.
+static void d3l_charset_read_block(int fd, d3l_charset_block *block)
+{
+    block->len = 0;
+    while(block->len < D3L_CHARSET_CHUNK_SIZE)
+    {
+        ssize_t rs = read(fd, block->data + block->len, D3L_CHARSET_CHUNK_SIZE - block->len);
+        if(rs < 0 && EINTR == errno)
+            continue;
+        if(rs < 0)
+        {
+            block->len = -errno;
+            return;
+        }
+        if(0 == rs)
+            return;
+        block->len += rs;
+    }
+}
+
+//! Write a whole block to fd.
+static int d3l_charset_write_block(int fd, const d3l_charset_block *block)
+{
+    const char *buff = block->data;
+    size_t len = block->len;
+    while(len > 0)
+    {
+        ssize_t rs = write(fd, buff, len);
+        if(rs < 0 && EINTR == errno)
+            continue;
+        if(rs < 0)
+            return -1;
+        buff += rs;
+        len -= rs;
+    }
+    return 0;
+}
+
+//! Reader stage of the pipeline.
+static void d3l_charset_reader(d3l_charset_stream *stream)
+{
+    for(;;)
+    {
+        d3l_charset_block *block = stream->in_free.pop();
+        if(stream->stop.load())
+            block->len = 0;
+        else
+            d3l_charset_read_block(stream->fd_in, block);
+        stream->in_full.push(block);
+        if(block->len <= 0)
+            return;
+    }
+}
+
+//! Writer stage of the pipeline.
+static void d3l_charset_writer(d3l_charset_stream *stream)
+{
+    for(;;)
+    {
+        d3l_charset_block *block = stream->out_full.pop();
+        if(NULL == block)
+            return;
+        if(0 == stream->err_write && d3l_charset_write_block(stream->fd_out, block) < 0)
+            stream->err_write = errno;
+        stream->out_free.push(block);
+    }
+}
+
+//! Get next input block.
+static d3l_charset_block *d3l_charset_next_in(d3l_charset_stream *stream)
+{
+    if(stream->pipeline)
+        return stream->in_full.pop();
+    d3l_charset_read_block(stream->fd_in, &stream->in_blocks[0]);
+    return &stream->in_blocks[0];
+}
+
+//! Hand an output block to the writer and get an empty one.
+static d3l_charset_block *d3l_charset_next_out(d3l_charset_stream *stream, d3l_charset_block *block)
+{
+    if(stream->pipeline)
+    {
+        if(NULL != block)
+            stream->out_full.push(block);
+        block = stream->out_free.pop();
+    }
+    else
+    {
+        if(NULL == block)
+            block = &stream->out_blocks[0];
+        else if(0 == stream->err_write && d3l_charset_write_block(stream->fd_out, block) < 0)
+            stream->err_write = errno;
+    }
+    block->len = 0;
+    return block;
+}
+
+//! Code convert from a file descriptor to another.
+/*!
+  \brief Code convert from a file descriptor to another in D3L_CHARSET_CHUNK_SIZE
+         chunks, multibyte sequences split by chunks are carried to the next
+         chunk, so memory use does not depend on the input size.
+  \param[in] from_charset src code charset.
+  \param[in] to_charset dest code charset.
+  \param[in] fd_in input file descriptor, read until end of file.
+  \param[in] fd_out output file descriptor.
+  \param[in] flags D3L_CHARSET_PIPELINE to read, convert and write in separate threads.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_charset_convert_fd(const char *from_charset, const char *to_charset, int fd_in, int fd_out, int flags)
+{
+    d3l_charset_conv conv;
+    if(d3l_charset_conv_open(&conv, from_charset, to_charset) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_charset_convert_fd(const char *, const char *, int, int, int) Can't convert from ";
+        str_err = str_err + from_charset + " to " + to_charset + "!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+
+    d3l_charset_stream stream;
+    stream.fd_in = fd_in;
+    stream.fd_out = fd_out;
+    stream.pipeline = (0 != (flags & D3L_CHARSET_PIPELINE));
+    stream.stop.store(false);
+    stream.err_write = 0;
+    size_t depth = stream.pipeline ? D3L_CHARSET_DEPTH : 1;
+    size_t block_size = D3L_CHARSET_CARRY + D3L_CHARSET_CHUNK_SIZE;
+    stream.memory_size = depth * block_size * 2;
+    stream.memory = static_cast<char *>(d3l_mem_aligned(stream.memory_size, D3L_MEM_PAGE_SIZE, 0));
+    if(NULL == stream.memory)
+    {
+        d3l_sys_err("ERROR d3l::d3l_charset_convert_fd(const char *, const char *, int, int, int) Can't allocate buffers!");
+        return -1;
+    }
+    for(size_t i = 0; i < depth; i++)
+    {
+        stream.in_blocks[i].data = &stream.memory[i * block_size] + D3L_CHARSET_CARRY;
+        stream.out_blocks[i].data = &stream.memory[(depth + i) * block_size];
+        stream.in_free.push(&stream.in_blocks[i]);
+        stream.out_free.push(&stream.out_blocks[i]);
+    }
+    posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::thread reader, writer;
+    if(stream.pipeline)
+    {
+        reader = std::thread(d3l_charset_reader, &stream);
+        writer = std::thread(d3l_charset_writer, &stream);
+    }
+
+    std::string str_err;
+    char carry[D3L_CHARSET_CARRY];
+    size_t carry_len = 0;
+    long long offset = 0;
+    d3l_charset_block *out = d3l_charset_next_out(&stream, NULL);
+    d3l_charset_block *in = NULL;
+    for(;;)
+    {
+        in = d3l_charset_next_in(&stream);
+        if(in->len < 0)
+        {
+            str_err = "read error";
+            errno = -in->len;
+            break;
+        }
+        bool eof = (0 == in->len);
+        memcpy(in->data - carry_len, carry, carry_len);
+        char *inbuf = in->data - carry_len;
+        size_t in_left = carry_len + in->len;
+        carry_len = 0;
+
+        for(;;)
+        {
+            char *outbuf = out->data + out->len;
+            size_t out_left = D3L_CHARSET_CHUNK_SIZE - out->len;
+            char *in_begin = inbuf;
+            size_t rs = (eof && 0 == in_left) ?
+                d3l_charset_conv_run(&conv, NULL, NULL, &outbuf, &out_left) :
+                d3l_charset_conv_run(&conv, &inbuf, &in_left, &outbuf, &out_left);
+            offset += inbuf - in_begin;
+            out->len = D3L_CHARSET_CHUNK_SIZE - out_left;
+            if(static_cast<size_t>(-1) != rs)
+            {
+                if(eof && 0 != in_left)
+                    continue;
+                break;
+            }
+            if(E2BIG == errno)
+            {
+                out = d3l_charset_next_out(&stream, out);
+                continue;
+            }
+            if(EINVAL == errno && !eof && in_left < D3L_CHARSET_CARRY)
+            {
+                memcpy(carry, inbuf, in_left);
+                carry_len = in_left;
+                break;
+            }
+            str_err = EINVAL == errno ? "incomplete multibyte sequence" : "invalid multibyte sequence";
+            break;
+        }
+        if(eof || !str_err.empty())
+            break;
+        if(stream.pipeline)
+        {
+            stream.in_free.push(in);
+            in = NULL;
+        }
+    }
+
+    if(str_err.empty() && out->len > 0)
+        out = d3l_charset_next_out(&stream, out);
+    if(stream.pipeline)
+    {
+        // Let the reader finish, it ends with a block of len <= 0.
+        stream.stop.store(true);
+        while(NULL == in || in->len > 0)
+        {
+            if(NULL != in)
+                stream.in_free.push(in);
+            in = stream.in_full.pop();
+        }
+        stream.out_full.push(NULL);
+        reader.join();
+        writer.join();
+    }
+    if(str_err.empty() && 0 != stream.err_write)
+    {
+        str_err = "write error";
+        errno = stream.err_write;
+    }
+    if(!str_err.empty())
+    {
+        char sz_offset[32];
+        snprintf(sz_offset, sizeof(sz_offset), "%lld", offset);
+        str_err = "ERROR d3l::d3l_charset_convert_fd(const char *, const char *, int, int, int) " +
+            str_err + " at byte " + sz_offset + ": " + strerror(errno);
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//! Code convert a file to another.
+/*!
+  \brief Code convert a file to another using d3l_charset_convert_fd(), the
+         output file is removed on failure.
+  \param[in] from_charset src code charset.
+  \param[in] to_charset dest code charset.
+  \param[in] sz_in input file path.
+  \param[in] sz_out output file path.
+  \param[in] flags D3L_CHARSET_PIPELINE to read, convert and write in separate threads.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_charset_convert_file(const char *from_charset, const char *to_charset,
+        const char *sz_in, const char *sz_out, int flags)
+{
+    int fd_in = open(sz_in, O_RDONLY|O_CLOEXEC);
+    if(fd_in < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_charset_convert_file(const char *, const char *, const char *, const char *, int) File ";
+        str_err = str_err + sz_in + " can't be opened!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    int fd_out = open(sz_out, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(fd_out < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_charset_convert_file(const char *, const char *, const char *, const char *, int) File ";
+        str_err = str_err + sz_out + " can't be created!";
+        d3l_sys_err(str_err.c_str());
+        close(fd_in);
+        return -1;
+    }
+
+    int rs = d3l_charset_convert_fd(from_charset, to_charset, fd_in, fd_out, flags);
+    close(fd_in);
+    if(close(fd_out) < 0)
+        rs = -1;
+    if(rs < 0)
+        unlink(sz_out);
+    return rs;
+}
+
+//! Print char content using 16bit format.
+/*!
+  \brief Print char content using 16bit format, using cout.
+  \param[in] ch src string.
+  \retval ==0 Successed; *<0 Failed.*
+ */
+int d3l_charset_printc(const char *sz_c)
+{
+    char *ch = const_cast<char *>(sz_c);
+    std::cout << "Hex Char Code:" << std::endl;
+    do
+        std::cout << std::hex << static_cast<unsigned int>(*ch++) << " ";
+    while(*ch != '\0');
+    std::cout << std::endl;
+    return 0;
+}
+
+//! Check if a string is pure ASCII.
+/*!
+  \brief Check if a string is pure ASCII using SIMD kernel.
+  \param[in] sz_in src string.
+  \param[in] len src string length.
+  \retval ==1 Pure ASCII; ==0 Not pure ASCII.
+ */
+int d3l_charset_is_ascii(const char *sz_in, size_t len)
+{
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(sz_in);
+    return d3l_charset_span_kernel()(in, len) == len ? 1 : 0;
+}
+
+//! Check if a string is valid UTF-8.
+/*!
+  \brief Check if a string is valid UTF-8 using SIMD kernel, overlong forms, surrogates
+         and code points above U+10FFFF are invalid.
+  \param[in] sz_in src string.
+  \param[in] len src string length.
+  \retval ==1 Valid; ==0 Invalid.
+ */
+int d3l_charset_is_utf8(const char *sz_in, size_t len)
+{
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(sz_in);
+    return d3l_charset_utf8_kernel()(in, len) ? 1 : 0;
+}
+
+//! Check if a string is valid GBK.
+/*!
+  \brief Check if a string is valid GBK, that is every double byte character has a
+         mapping in d3l_gbk_table, ASCII runs are skipped by SIMD kernel.
+  \param[in] sz_in src string.
+  \param[in] len src string length.
+  \retval ==1 Valid; ==0 Invalid.
+ */
+int d3l_charset_is_gbk(const char *sz_in, size_t len)
+{
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(sz_in);
+    return d3l_charset_gbk_valid(in, len) ? 1 : 0;
+}
+
+//! Classify a string as ASCII, UTF-8 or GBK.
+/*!
+  \brief Classify a string by validation, valid UTF-8 wins when a string is valid in
+         both UTF-8 and GBK, which is rare except for short strings.
+  \param[in] sz_in src string.
+  \param[in] len src string length.
+  \retval D3L_CHARSET_ASCII, D3L_CHARSET_UTF8, D3L_CHARSET_GBK or D3L_CHARSET_UNKNOWN.
+ */
+int d3l_charset_detect(const char *sz_in, size_t len)
+{
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(sz_in);
+    size_t n = d3l_charset_span_kernel()(in, len);
+    if(n == len)
+        return D3L_CHARSET_ASCII;
+    // ASCII prefix is valid in both, validate from the first non-ASCII byte.
+    if(d3l_charset_utf8_kernel()(in + n, len - n))
+        return D3L_CHARSET_UTF8;
+    if(d3l_charset_gbk_valid(in + n, len - n))
+        return D3L_CHARSET_GBK;
+    return D3L_CHARSET_UNKNOWN;
+}
+
+//! Open dirent.
+/*!
+  \brief Open dirent using opendir().
+  \param[out] dpp DIR point point.
+  \param[in] sz_dir dir path.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_dop_open(DIR **dpp, const char *sz_dir)
+{
+    struct stat statbuf;
+    //! Check dirent status.
+    if (lstat(sz_dir, &statbuf) < 0)
+    {
+        std::string str_err = sz_dir;
+        str_err = "ERROR: Dir " + str_err + " stat error!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    if (S_ISDIR(statbuf.st_mode) == 0)
+    {
+        std::string str_err = sz_dir;
+        str_err = "ERROR: " + str_err + " is not a directory!";
+        d3l_sys_err(str_err.c_str());
+        return -2;
+    }
+    if(NULL == (*dpp = opendir(sz_dir)))
+    {
+        std::string str_err = sz_dir;
+        str_err = "ERROR: Can't open dir " + str_err + " !";
+        d3l_sys_err(str_err.c_str());
+        return -3;
+    }
+    return 0;
+}
+
+//! Close dirent.
+/*!
+  \brief Close dirent using closedir().
+  \param[out] dpp DIR point point.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_dop_close(DIR **dpp)
+{
+    if(closedir(*dpp) < 0)
+    {
+        std::string str_err = "ERROR: Can't close dirent!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//! Directory entry returned by getdents64.
+struct d3l_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+//! Directory waiting to be read by the walker.
+struct d3l_walk_dir
+{
+    std::string path;
+    int depth;
+};
+
+//! Work queue of one walker thread, others steal from its front.
+struct alignas(64) d3l_walk_queue
+{
+    std::mutex mutex;
+    std::deque<d3l_walk_dir> dirs;
+};
+
+//! Shared state of a directory walk.
+struct d3l_walk
+{
+    const struct d3l_dop_filter *filter;
+    d3l_dop_visitor visitor;
+    void *arg;
+    std::vector<d3l_walk_queue> queues;
+    std::atomic<int64_t> pending;   // Queued and in-progress directories.
+    std::atomic<int64_t> queued;
+    std::atomic<int64_t> matched;
+    std::atomic<bool> stop;
+    std::atomic<int> idle;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+//! Convert a d_type or st_mode to walker type.
+static int d3l_walk_type(unsigned char d_type)
+{
+    switch(d_type)
+    {
+        case DT_REG:
+            return D3L_WALK_FILE;
+        case DT_DIR:
+            return D3L_WALK_DIR;
+        case DT_LNK:
+            return D3L_WALK_LINK;
+        default:
+            return D3L_WALK_OTHER;
+    }
+}
+
+//! Queue a directory on the queue of thread id.
+static void d3l_walk_push(d3l_walk *walk, size_t id, d3l_walk_dir &dir)
+{
+    walk->pending++;
+    {
+        std::lock_guard<std::mutex> lock(walk->queues[id].mutex);
+        walk->queues[id].dirs.push_back(std::move(dir));
+    }
+    walk->queued++;
+    if(walk->idle.load(std::memory_order_relaxed) > 0)
+        walk->cond.notify_one();
+}
+
+//! Take a directory from the own queue, or steal one from another thread.
+static bool d3l_walk_pop(d3l_walk *walk, size_t id, d3l_walk_dir &dir)
+{
+    size_t num = walk->queues.size();
+    for(size_t i = 0; i < num; i++)
+    {
+        d3l_walk_queue &queue = walk->queues[(id + i) % num];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.dirs.empty())
+            continue;
+        // Own queue is used depth first, stolen work is taken from the top of the tree.
+        if(0 == i)
+        {
+            dir = std::move(queue.dirs.back());
+            queue.dirs.pop_back();
+        }
+        else
+        {
+            dir = std::move(queue.dirs.front());
+            queue.dirs.pop_front();
+        }
+        walk->queued--;
+        return true;
+    }
+    return false;
+}
+
+//! Check an entry against the walk filter.
+static bool d3l_walk_match(const struct d3l_dop_filter *filter, struct d3l_dop_entry *entry,
+        int dir_fd, size_t name_len)
+{
+    if(NULL == filter)
+        return true;
+    if(0 != filter->types && 0 == (filter->types & entry->type))
+        return false;
+    if(NULL != filter->suffix)
+    {
+        size_t suffix_len = strlen(filter->suffix);
+        if(name_len < suffix_len || 0 != memcmp(entry->name + name_len - suffix_len, filter->suffix, suffix_len))
+            return false;
+    }
+    if(NULL != filter->glob && 0 != fnmatch(filter->glob, entry->name, 0))
+        return false;
+    if(filter->min_size > 0 || filter->max_size > 0)
+    {
+        // Only sizes need a stat call, names and types come from getdents64.
+        struct stat statbuf;
+        if(D3L_WALK_FILE != entry->type || fstatat(dir_fd, entry->name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+            return false;
+        entry->size = statbuf.st_size;
+        if(entry->size < filter->min_size || (filter->max_size > 0 && entry->size > filter->max_size))
+            return false;
+    }
+    return true;
+}
+
+//! Read one directory in getdents64 batches, visit its entries and queue subdirectories.
+static void d3l_walk_read(d3l_walk *walk, size_t id, d3l_walk_dir &dir, std::vector<char> &buff)
+{
+    int fd = open(dir.path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0)
+        return;
+
+    const struct d3l_dop_filter *filter = walk->filter;
+    int max_depth = (NULL == filter) ? 0 : filter->max_depth;
+    bool descend = (0 == max_depth || dir.depth + 1 < max_depth);
+    std::string path = dir.path;
+    if('/' != path[path.size() - 1])
+        path += '/';
+    size_t prefix_len = path.size();
+
+    long len;
+    while(!walk->stop.load(std::memory_order_relaxed) &&
+          (len = syscall(SYS_getdents64, fd, &buff[0], buff.size())) > 0)
+    {
+        for(long pos = 0; pos < len; )
+        {
+            struct d3l_dirent64 *ent = reinterpret_cast<struct d3l_dirent64 *>(&buff[pos]);
+            pos += ent->d_reclen;
+            const char *name = ent->d_name;
+            if('.' == name[0] && ('\0' == name[1] || ('.' == name[1] && '\0' == name[2])))
+                continue;
+
+            unsigned char d_type = ent->d_type;
+            if(DT_UNKNOWN == d_type)
+            {
+                // Some file systems don't fill d_type.
+                struct stat statbuf;
+                if(fstatat(fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+                    continue;
+                d_type = IFTODT(statbuf.st_mode);
+            }
+
+            size_t name_len = strlen(name);
+            path.resize(prefix_len);
+            path.append(name, name_len);
+            struct d3l_dop_entry entry;
+            entry.path = path.c_str();
+            entry.name = entry.path + prefix_len;
+            entry.type = d3l_walk_type(d_type);
+            entry.depth = dir.depth + 1;
+            entry.size = -1;
+
+            if(d3l_walk_match(filter, &entry, fd, name_len))
+            {
+                walk->matched++;
+                if(NULL != walk->visitor && walk->visitor(&entry, walk->arg) < 0)
+                {
+                    walk->stop = true;
+                    break;
                 }
             }
-            else
+            if(D3L_WALK_DIR == entry.type && descend)
             {
-                std::string str_err = "ERROR: d3l:: int d3l_dop_create(const char *) ";
-                str_err += dirname;
-                str_err += "is already exist.";
-                d3l_sys_err(str_err.c_str());
+                d3l_walk_dir sub = {path, dir.depth + 1};
+                d3l_walk_push(walk, id, sub);
+            }
+        }
+    }
+    close(fd);
+}
+
+//! Walker thread: read directories until the tree is done.
+static void d3l_walk_run(d3l_walk *walk, size_t id)
+{
+    std::vector<char> buff(D3L_WALK_BUFFER_SIZE);
+    d3l_walk_dir dir;
+    for(;;)
+    {
+        if(d3l_walk_pop(walk, id, dir))
+        {
+            d3l_walk_read(walk, id, dir, buff);
+            if(0 == --walk->pending)
+            {
+                std::lock_guard<std::mutex> lock(walk->mutex);
+                walk->cond.notify_all();
             }
+            continue;
+        }
+        if(0 == walk->pending.load())
+            break;
+        std::unique_lock<std::mutex> lock(walk->mutex);
+        walk->idle++;
+        walk->cond.wait_for(lock, std::chrono::milliseconds(1), [walk]
+        {
+            return walk->queued.load() > 0 || 0 == walk->pending.load();
+        });
+        walk->idle--;
+    }
+}
+
+//! Walk dirent recursively.
+/*!
+  \brief Walk dirent recursively using getdents64() in large batches. Entry types
+         come from d_type so stat is only called for size filters and file systems
+         without d_type. Subdirectories are spread over a work-stealing thread pool,
+         symbolic links are not followed and unreadable subdirectories are skipped.
+  \param[in] sz_dir dir path.
+  \param[in] filter entry filter, NULL for all entries. Directories are walked
+             even if they don't match it.
+  \param[in] visitor callback of each matched entry, NULL to count only. It's
+             called concurrently from walker threads, returning <0 stops the walk.
+  \param[in] arg argument passed to visitor.
+  \param[in] threads thread number, 0 means hardware concurrency.
+  \retval >=0 Matched entry num; <0 Failed.
+ */
+int64_t d3l_dop_walk(const char *sz_dir, const struct d3l_dop_filter *filter,
+        d3l_dop_visitor visitor, void *arg, int threads)
+{
+    struct stat statbuf;
+    if(stat(sz_dir, &statbuf) < 0 || !S_ISDIR(statbuf.st_mode) || access(sz_dir, R_OK|X_OK) < 0)
+    {
+        std::string str_err = "ERROR d3l::d3l_dop_walk(const char*,...) Dir ";
+        str_err = str_err + sz_dir + " can't be read!";
+        d3l_sys_err(str_err.c_str());
+        return -1;
+    }
+
+    if(threads <= 0)
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    d3l_walk walk;
+    walk.filter = filter;
+    walk.visitor = visitor;
+    walk.arg = arg;
+    walk.queues = std::vector<d3l_walk_queue>(threads);
+    walk.pending = 0;
+    walk.queued = 0;
+    walk.matched = 0;
+    walk.stop = false;
+    walk.idle = 0;
+
+    d3l_walk_dir root = {sz_dir, 0};
+    d3l_walk_push(&walk, 0, root);
+    std::vector<std::thread> pool;
+    for(int i = 1; i < threads; i++)
+        pool.push_back(std::thread(d3l_walk_run, &walk, i));
+    d3l_walk_run(&walk, 0);
+    for(size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+    return walk.matched.load();
+}
+
+//! Get file number of dirent.
+/*!
+  \brief Get file number of dirent using d3l_dop_walk().
+  \param[in] sz_dir dir path.
+  \retval >=0 File num; <0 Failed.
+ */
+int d3l_dop_filenum(const char *sz_dir)
+{
+    struct d3l_dop_filter filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.max_depth = 1;
+    return d3l_dop_walk(sz_dir, &filter, NULL, NULL, 1);
+}
+
+//! Get file number of dirent recursively.
+/*!
+  \brief Get entry number of dirent and all its subdirectories using d3l_dop_walk().
+  \param[in] sz_dir dir path.
+  \param[in] types mask of D3L_WALK_* types to count, 0 for all.
+  \retval >=0 File num; <0 Failed.
+ */
+int64_t d3l_dop_filenum_r(const char *sz_dir, int types)
+{
+    struct d3l_dop_filter filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.types = types;
+    return d3l_dop_walk(sz_dir, &filter, NULL, NULL, 0);
+}
+
+//! Check an existing path left by mkdirat() with EEXIST is a dir, following symlinks like mkdir -p.
+static int d3l_dop_exist_dir(int dir_fd, const char *name)
+{
+    struct stat statbuf;
+    if(fstatat(dir_fd, name, &statbuf, 0) < 0)
+        return -errno;
+    return S_ISDIR(statbuf.st_mode) ? 0 : -ENOTDIR;
+}
+
+//! Create a directory and its missing parents.
+/*!
+  \brief Try mkdirat() on the full path first and only walk backwards on ENOENT,
+         then create the missing components relative to their parent fds.
+         EEXIST is success when the path is a dir, so concurrent creators of the
+         same tree don't fail, and -ENOTDIR when it is not.
+  \param[in] path dir path without trailing '/'.
+  \param[in] mode dir mode.
+  \retval ==0 Successed; <0 -errno.
+ */
+static int d3l_dop_mkdir_p(std::string &path, mode_t mode)
+{
+    if(0 == mkdirat(AT_FDCWD, path.c_str(), mode))
+        return 0;
+    if(EEXIST == errno)
+        return d3l_dop_exist_dir(AT_FDCWD, path.c_str());
+    if(ENOENT != errno)
+        return -errno;
+
+    // Find the longest prefix which exists or can be created.
+    size_t start = path.size();
+    for(;;)
+    {
+        size_t sep = path.rfind('/', start - 1);
+        if(std::string::npos == sep)
+        {
+            start = 0;
+            break;
+        }
+        size_t end = sep;
+        while(end > 0 && '/' == path[end - 1])
+            end--;
+        start = sep + 1;
+        if(0 == end)
+            break;
+        path[end] = '\0';
+        int rs = mkdirat(AT_FDCWD, path.c_str(), mode);
+        int err = errno;
+        path[end] = '/';
+        if(0 == rs || EEXIST == err)
+            break;
+        if(ENOENT != err)
+            return -err;
+        start = end;
+    }
+
+    // Create the remaining components one by one from the parent fd.
+    int parent_fd = AT_FDCWD;
+    if(start > 0)
+    {
+        char ch = path[start];
+        path[start] = '\0';
+        parent_fd = open(path.c_str(), O_PATH|O_DIRECTORY|O_CLOEXEC);
+        path[start] = ch;
+        if(parent_fd < 0)
+            return -errno;
+    }
+    int rs = 0;
+    while(start < path.size())
+    {
+        size_t end = path.find('/', start);
+        if(std::string::npos == end)
+            end = path.size();
+        path[end] = '\0';
+        const char *name = path.c_str() + start;
+        if(mkdirat(parent_fd, name, mode) < 0)
+        {
+            if(EEXIST != errno)
+                rs = -errno;
+            else if(end == path.size())
+                rs = d3l_dop_exist_dir(parent_fd, name);
+        }
+        if(rs >= 0 && end < path.size())
+        {
+            int fd = openat(parent_fd, name, O_PATH|O_DIRECTORY|O_CLOEXEC);
+            if(fd < 0)
+                rs = -errno;
+            if(AT_FDCWD != parent_fd)
+                close(parent_fd);
+            parent_fd = fd;
         }
-        pos++;
+        if(end < path.size())
+            path[end] = '/';
+        if(rs < 0)
+            break;
+        for(start = end; start < path.size() && '/' == path[start]; start++);
+    }
+    if(parent_fd >= 0)
+        close(parent_fd);
+    return rs;
+}
+
+//! Strip trailing '/' of a dir path.
+static std::string d3l_dop_trim(const char *sz_dir)
+{
+    std::string path = sz_dir;
+    while(path.size() > 1 && '/' == path[path.size() - 1])
+        path.erase(path.size() - 1);
+    return path;
+}
+
+//! Log a failed dirent creation.
+static void d3l_dop_create_err(const std::string &path, int err)
+{
+    std::string str_err = "ERROR d3l::d3l_dop_create(const char*) Dir ";
+    str_err = str_err + path + " can't be created: " + strerror(-err) + "!";
+    d3l_sys_err(str_err.c_str());
+}
+
+//! Create dirent by path.
+/*!
+  \brief Create dirent and its missing parents like mkdir -p, existing dirs are
+         not an error.
+  \param[in] sz_dir dir path.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_dop_create(const char *sz_dir)
+{
+    std::string path = d3l_dop_trim(sz_dir);
+    int rs = d3l_dop_mkdir_p(path, RWXRXRX);
+    if(rs < 0)
+    {
+        d3l_dop_create_err(path, rs);
+        return -1;
     }
-    d3l_mem_free(dirname);
     return 0;
 }
 
+//! Order paths so that every dir is followed by its subdirs.
+static bool d3l_dop_path_less(const std::string &lhs, const std::string &rhs)
+{
+    size_t len = std::min(lhs.size(), rhs.size());
+    for(size_t i = 0; i < len; i++)
+    {
+        if(lhs[i] == rhs[i])
+            continue;
+        if('/' == lhs[i] || '/' == rhs[i])
+            return '/' == lhs[i];
+        return static_cast<unsigned char>(lhs[i]) < static_cast<unsigned char>(rhs[i]);
+    }
+    return lhs.size() < rhs.size();
+}
+
+//! Create a sorted range of leaf dirs, reusing the parent fd of siblings.
+static int d3l_dop_create_range(std::vector<std::string> &dirs, size_t begin, size_t end)
+{
+    int failed = 0;
+    int parent_fd = -1;
+    size_t parent_len = 0;
+    for(size_t i = begin; i < end; i++)
+    {
+        std::string &path = dirs[i];
+        size_t sep = path.rfind('/');
+        if(parent_fd >= 0 && std::string::npos != sep && sep == parent_len &&
+           0 == path.compare(0, sep, dirs[i - 1], 0, sep))
+        {
+            const char *name = path.c_str() + sep + 1;
+            if(0 == mkdirat(parent_fd, name, RWXRXRX))
+                continue;
+            if(EEXIST == errno)
+            {
+                int rs = d3l_dop_exist_dir(parent_fd, name);
+                if(rs < 0)
+                {
+                    d3l_dop_create_err(path, rs);
+                    failed++;
+                }
+                continue;
+            }
+        }
+        if(parent_fd >= 0)
+            close(parent_fd);
+        parent_fd = -1;
+
+        int rs = d3l_dop_mkdir_p(path, RWXRXRX);
+        if(rs < 0)
+        {
+            d3l_dop_create_err(path, rs);
+            failed++;
+            continue;
+        }
+        if(std::string::npos != sep && sep > 0)
+        {
+            path[sep] = '\0';
+            parent_fd = open(path.c_str(), O_PATH|O_DIRECTORY|O_CLOEXEC);
+            path[sep] = '/';
+            parent_len = sep;
+        }
+    }
+    if(parent_fd >= 0)
+        close(parent_fd);
+    return failed;
+}
+
+//! Create dirents in bulk.
+/*!
+  \brief Create a set of dirents like mkdir -p. Paths are sorted and dirs which
+         are parents of other paths are dropped, then contiguous ranges are
+         created in parallel so siblings share their parent fd.
+  \param[in] dirs dir paths.
+  \param[in] num dir number.
+  \param[in] threads thread number, 0 means hardware concurrency.
+  \retval ==0 Successed; <0 Failed dir number.
+ */
+int d3l_dop_create_bulk(const char **dirs, size_t num, int threads)
+{
+    std::vector<std::string> paths;
+    paths.reserve(num);
+    for(size_t i = 0; i < num; i++)
+        paths.push_back(d3l_dop_trim(dirs[i]));
+    std::sort(paths.begin(), paths.end(), d3l_dop_path_less);
+
+    // Keep the leaves only, their parents are created on the way.
+    size_t leaves = 0;
+    for(size_t i = 0; i < paths.size(); i++)
+    {
+        const std::string &path = paths[i];
+        if(i + 1 < paths.size())
+        {
+            const std::string &next = paths[i + 1];
+            if(next.size() >= path.size() && 0 == next.compare(0, path.size(), path) &&
+               (next.size() == path.size() || '/' == next[path.size()] || '/' == path[path.size() - 1]))
+                continue;
+        }
+        paths[leaves++].swap(paths[i]);
+    }
+    paths.resize(leaves);
+
+    if(threads <= 0)
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    size_t chunk = std::max<size_t>((leaves + threads - 1) / threads, 1024);
+    std::atomic<int> failed(0);
+    std::vector<std::thread> pool;
+    for(size_t begin = chunk; begin < leaves; begin += chunk)
+    {
+        pool.push_back(std::thread([&paths, &failed, begin, chunk, leaves]
+        {
+            failed += d3l_dop_create_range(paths, begin, std::min(begin + chunk, leaves));
+        }));
+    }
+    failed += d3l_dop_create_range(paths, 0, std::min(chunk, leaves));
+    for(size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+    return -failed.load();
+}
+
+//! Find sub string from position using d3l_simd_memmem().
+static size_t d3l_str_find(const std::string &str, const std::string &sub_str, size_t pos)
+{
+    if(pos > str.size())
+        return std::string::npos;
+    const char *hit = static_cast<const char *>(d3l_simd_memmem(str.data() + pos, str.size() - pos,
+                sub_str.data(), sub_str.size()));
+    return (NULL == hit) ? std::string::npos : hit - str.data();
+}
+
+//! Get KMP state after chars, only the last len - 1 chars can be a partial match.
+static size_t d3l_str_kmp_state(const char *str, size_t w, const std::string &sub_str,
+        const std::vector<unsigned int> &fail)
+{
+    size_t m = sub_str.size();
+    size_t k = 0;
+    for(size_t i = (w >= m) ? w - m + 1 : 0; i < w; i++)
+    {
+        while(k > 0 && sub_str[k] != str[i])
+            k = fail[k - 1];
+        if(sub_str[k] == str[i])
+            k++;
+    }
+    return k;
+}
+
 //! Erase sub string from string object.
 /*!
-  \brief Erase sub string from string object using string.erase();
+  \brief Erase sub string from string object until none is left, in one pass.
+         Kept chars are compacted in place. While no partial match is pending
+         the next match is found by d3l_simd_memmem() and the text before it is
+         moved in bulk, otherwise chars are fed to a KMP automaton so a match
+         joined by an erase is found without searching from the beginning.
   \param[out] str string object to erase.
-  \param[in] sub_str sub string.
+  \param[in] sub_str sub string, an empty one erases nothing.
   \retval ==0 Successed; <0 Failed.
  */
 int d3l_str_erase(std::string &str, const std::string &sub_str)
 {
-    std::string::size_type idx = 0;
-    while(std::string::npos != (idx = str.find(sub_str, 0)))
+    size_t m = sub_str.size();
+    size_t n = str.size();
+    if(0 == m)
+        return 0;
+    size_t idx = d3l_str_find(str, sub_str, 0);
+    if(std::string::npos == idx)
+        return 0;
+
+    std::vector<unsigned int> fail(m, 0);
+    for(size_t i = 1, k = 0; i < m; i++)
     {
-        str.erase(idx,sub_str.size());
+        while(k > 0 && sub_str[i] != sub_str[k])
+            k = fail[k - 1];
+        if(sub_str[i] == sub_str[k])
+            k++;
+        fail[i] = k;
+    }
+
+    char *out = &str[0];
+    size_t w = idx;
+    size_t r = idx + m;
+    size_t k = d3l_str_kmp_state(out, w, sub_str, fail);
+    while(r < n)
+    {
+        if(0 == k)
+        {
+            const char *hit = static_cast<const char *>(d3l_simd_memmem(out + r, n - r, sub_str.data(), m));
+            size_t next = (NULL == hit) ? n : hit - out;
+            memmove(out + w, out + r, next - r);
+            w += next - r;
+            if(NULL == hit)
+                break;
+            r = next + m;
+            k = d3l_str_kmp_state(out, w, sub_str, fail);
+            continue;
+        }
+        char ch = out[r++];
+        while(k > 0 && sub_str[k] != ch)
+            k = fail[k - 1];
+        if(sub_str[k] == ch)
+            k++;
+        out[w++] = ch;
+        if(k == m)
+        {
+            w -= m;
+            k = d3l_str_kmp_state(out, w, sub_str, fail);
+        }
     }
+    str.resize(w);
     return 0;
 }
 
 //! Replace sub string from string object.
 /*!
-  \brief Replace sub string from string object using string.replace();
+  \brief Replace sub string from string object in one pass, matches don't
+         overlap and replaced text is not searched again. The string is
+         rewritten in place when str_dest is not longer than str_src, otherwise
+         the result is built once with its size computed in advance.
   \param[out] str string object to replace.
-  \param[in] str_src src sub string.
+  \param[in] str_src src sub string, an empty one replaces nothing.
   \param[in] str_dest dest sub string.
   \retval ==0 Successed; <0 Failed.
  */
 int d3l_str_replace(std::string &str, const std::string &str_src, const std::string &str_dest)
 {
-    std::string::size_type idx = 0;
-    while(std::string::npos != (idx = str.find(str_src, idx)))
+    size_t src_len = str_src.size();
+    size_t dest_len = str_dest.size();
+    if(0 == src_len)
+        return 0;
+    size_t idx = d3l_str_find(str, str_src, 0);
+    if(std::string::npos == idx)
+        return 0;
+
+    if(dest_len <= src_len)
+    {
+        size_t w = idx;
+        size_t r = idx;
+        do
+        {
+            if(w != r)
+                memmove(&str[w], &str[r], idx - r);
+            w += idx - r;
+            memcpy(&str[w], str_dest.data(), dest_len);
+            w += dest_len;
+            r = idx + src_len;
+        }
+        while(std::string::npos != (idx = d3l_str_find(str, str_src, r)));
+        if(w != r)
+            memmove(&str[w], &str[r], str.size() - r);
+        str.resize(w + str.size() - r);
+        return 0;
+    }
+
+    std::vector<size_t> matches;
+    for(; std::string::npos != idx; idx = d3l_str_find(str, str_src, idx + src_len))
+        matches.push_back(idx);
+    std::string out_str;
+    out_str.reserve(str.size() + matches.size() * (dest_len - src_len));
+    size_t r = 0;
+    for(size_t i = 0; i < matches.size(); i++)
+    {
+        out_str.append(str, r, matches[i] - r);
+        out_str += str_dest;
+        r = matches[i] + src_len;
+    }
+    out_str.append(str, r, std::string::npos);
+    str.swap(out_str);
+    return 0;
+}
+
+//! Add a pattern and its replacement.
+/*!
+  \brief Add a pattern and its replacement, the automaton must be compiled
+         again before use.
+  \param[in] pattern pattern, must not be empty.
+  \param[in] replacement replacement.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_str_replacer::add(const std::string &pattern, const std::string &replacement)
+{
+    if(pattern.empty())
+        return -1;
+    patterns_.push_back(pattern);
+    replacements_.push_back(replacement);
+    compiled_ = false;
+    return 0;
+}
+
+//! Compile the automaton.
+/*!
+  \brief Build the trie of all patterns and resolve failure links into full
+         256-way transitions, each state keeps the longest pattern ending there.
+  \retval ==0 Successed; <0 Failed.
+ */
+int d3l_str_replacer::compile()
+{
+    next_.assign(256, -1);
+    depth_.assign(1, 0);
+    out_.assign(1, -1);
+    shrink_ = true;
+    for(size_t i = 0; i < patterns_.size(); i++)
+    {
+        const std::string &pattern = patterns_[i];
+        int state = 0;
+        for(size_t j = 0; j < pattern.size(); j++)
+        {
+            int &to = next_[state * 256 + static_cast<unsigned char>(pattern[j])];
+            if(to < 0)
+            {
+                to = static_cast<int>(depth_.size());
+                depth_.push_back(static_cast<int>(j + 1));
+                out_.push_back(-1);
+                next_.resize(next_.size() + 256, -1);
+            }
+            state = next_[state * 256 + static_cast<unsigned char>(pattern[j])];
+        }
+        out_[state] = static_cast<int>(i);
+        shrink_ = shrink_ && replacements_[i].size() <= pattern.size();
+    }
+
+    // Breadth first, so failure targets are complete before they are used.
+    std::vector<int> fail(depth_.size(), 0);
+    std::vector<int> queue;
+    for(int c = 0; c < 256; c++)
+    {
+        int &to = next_[c];
+        if(to < 0)
+            to = 0;
+        else
+            queue.push_back(to);
+    }
+    for(size_t head = 0; head < queue.size(); head++)
+    {
+        int state = queue[head];
+        if(out_[state] < 0)
+            out_[state] = out_[fail[state]];
+        for(int c = 0; c < 256; c++)
+        {
+            int &to = next_[state * 256 + c];
+            if(to < 0)
+                to = next_[fail[state] * 256 + c];
+            else
+            {
+                fail[to] = next_[fail[state] * 256 + c];
+                queue.push_back(to);
+            }
+        }
+    }
+    compiled_ = true;
+    return 0;
+}
+
+//! Find leftmost longest matches and emit (start, end, pattern) of each one.
+template <class F>
+void d3l_str_replacer::scan(const char *sz_str, size_t len, F emit) const
+{
+    const unsigned char *str = reinterpret_cast<const unsigned char *>(sz_str);
+    size_t pos = 0;
+    int state = 0;
+    long best = -1;
+    size_t best_start = 0;
+    size_t best_end = 0;
+    for(;;)
+    {
+        if(pos < len)
+        {
+            state = next_[state * 256 + str[pos]];
+            pos++;
+            int id = out_[state];
+            if(id >= 0)
+            {
+                size_t start = pos - patterns_[id].size();
+                if(best < 0 || start < best_start || (start == best_start && pos > best_end))
+                {
+                    best = id;
+                    best_start = start;
+                    best_end = pos;
+                }
+            }
+            // Commit when no later match can start at or before the best one.
+            if(best < 0 || pos - depth_[state] <= best_start)
+                continue;
+        }
+        if(best < 0)
+            break;
+        emit(best_start, best_end, static_cast<int>(best));
+        best = -1;
+        pos = best_end;
+        state = 0;
+    }
+}
+
+//! Replace all patterns in a string object.
+/*!
+  \brief Replace all patterns in a string object, in place when no replacement
+         is longer than its pattern.
+  \param[out] str string object to replace.
+  \retval ==0 Successed; <0 Not compiled.
+ */
+int d3l_str_replacer::replace(std::string &str) const
+{
+    if(!compiled_)
+        return -1;
+    if(!shrink_)
     {
-        str.replace(idx, str_src.size(), str_dest);
-        idx = idx + str_dest.size();
+        std::string out_str;
+        int rs = replace(str.data(), str.size(), out_str);
+        str.swap(out_str);
+        return rs;
     }
+
+    // Writing never passes reading since no replacement grows.
+    char *data = &str[0];
+    size_t w = 0;
+    size_t r = 0;
+    scan(str.data(), str.size(), [&](size_t start, size_t end, int id)
+    {
+        if(w != r)
+            memmove(data + w, data + r, start - r);
+        w += start - r;
+        memcpy(data + w, replacements_[id].data(), replacements_[id].size());
+        w += replacements_[id].size();
+        r = end;
+    });
+    if(w != r)
+        memmove(data + w, data + r, str.size() - r);
+    str.resize(w + str.size() - r);
+    return 0;
+}
+
+//! Replace all patterns of chars into a string object.
+/*!
+  \brief Replace all patterns of chars into a string object.
+  \param[in] sz_str chars.
+  \param[in] len chars length.
+  \param[out] out_str result string object.
+  \retval ==0 Successed; <0 Not compiled.
+ */
+int d3l_str_replacer::replace(const char *sz_str, size_t len, std::string &out_str) const
+{
+    if(!compiled_)
+        return -1;
+    out_str.clear();
+    out_str.reserve(len);
+    size_t r = 0;
+    scan(sz_str, len, [&](size_t start, size_t end, int id)
+    {
+        out_str.append(sz_str + r, start - r);
+        out_str += replacements_[id];
+        r = end;
+    });
+    out_str.append(sz_str + r, len - r);
     return 0;
 }
@@ -8,7 +8,11 @@
 // Include required *standard* C headers.
 #include <dirent.h>     // DIR..
 #include <sys/time.h>   // time_t,time(),gettimeofday()...
+#include <time.h>       // struct timespec,clock_gettime()..
 #include <fcntl.h>      // O_WRONLY|O_CREAT..
+#include <unistd.h>     // access(),unlink(),read(),write(),close()..
+#include <stdint.h>     // int64_t..
+#include <sys/uio.h>    // struct iovec..
 
 //! Define warning mode.
 #define D3L_NO_WARNING
@@ -16,8 +20,145 @@
 #define D3L_SYS_TIME_VAR
 //! Define gb code mode.
 #define D3L_GB_CODE "GBK"
+//! Define native GBK <-> UTF-8 conversion mode.
+#define D3L_CHARSET_NATIVE
+//! Define cached iconv descriptor number of each thread.
+#define D3L_CHARSET_POOL_SIZE 8
+//! Define durability of d3l_fop_write().
+#define D3L_FOP_SYNC D3L_SYNC_NONE
+//! Define block size of file reading.
+#define D3L_FOP_BLOCK_SIZE (1024 * 1024)
+//! Define file size to be processed by several threads.
+#define D3L_FOP_PARALLEL_SIZE (64 * 1024 * 1024)
+//! Define range size of each pread() in parallel file reading.
+#define D3L_FOP_CHUNK_SIZE (8 * 1024 * 1024)
+//! Define queue depth of batch file reading.
+#define D3L_BATCH_DEPTH 64
+//! Define max thread number of batch file reading without io_uring.
+#define D3L_BATCH_MAX_THREADS 32
+//! Define getdents64 buffer size of each directory walker thread.
+#define D3L_WALK_BUFFER_SIZE (256 * 1024)
+//! Define chunk size of streaming code conversion.
+#define D3L_CHARSET_CHUNK_SIZE (256 * 1024)
+//! Define max input length of string objects kept by the conversion memo.
+#define D3L_CHARSET_MEMO_LEN 48
+//! Define max number of timing sites.
+#define D3L_TIMER_SITES 256
+//! Define max block size of the per-thread memory pool.
+#define D3L_MEM_POOL_MAX 4096
+//! Define free blocks cached by each thread for a size class.
+#define D3L_MEM_POOL_CACHE 512
+//! Define default block size of memory arenas.
+#define D3L_MEM_ARENA_BLOCK (64 * 1024)
+//! Define gzip support of compressed streams, link with -lz.
+// #define D3L_ZLIB
+//! Define zstd support of compressed streams, link with -lzstd.
+// #define D3L_ZSTD
 //! Define log file path.
 #define D3L_LOG_FILE "d3l.log"
+//! Define log ring slot number of each thread.
+#define D3L_LOG_RING_SLOTS 256
+//! Define log ring slot size in bytes.
+#define D3L_LOG_SLOT_SIZE 256
+//! Define log flush latency in milliseconds.
+#define D3L_LOG_FLUSH_MS 100
+
+//! Streaming code conversion: read, convert and write in separate threads.
+#define D3L_CHARSET_PIPELINE 1
+//! String code conversion: keep input unchanged when it is already valid in the dest charset.
+#define D3L_CHARSET_KEEP_VALID 1
+
+//! Charset class: invalid in both GBK and UTF-8.
+#define D3L_CHARSET_UNKNOWN 0
+//! Charset class: pure ASCII, same bytes in GBK and UTF-8.
+#define D3L_CHARSET_ASCII 1
+//! Charset class: valid UTF-8 with non-ASCII characters.
+#define D3L_CHARSET_UTF8 2
+//! Charset class: valid GBK, invalid UTF-8.
+#define D3L_CHARSET_GBK 3
+
+//! Write durability: leave data in page cache.
+#define D3L_SYNC_NONE 0
+//! Write durability: fdatasync() the file before it replaces the old one.
+#define D3L_SYNC_DATA 1
+//! Write durability: fsync() the file and its directory.
+#define D3L_SYNC_FULL 2
+//! Write durability mask of write flags.
+#define D3L_SYNC_MASK 3
+//! Write flag: preallocate file space using fallocate().
+#define D3L_WRITE_PREALLOC 4
+
+//! Timestamp format "D3L::Time:YYYY-MM-DD HH:MM:SS".
+#define D3L_TIME_D3L 0
+//! Timestamp format ISO-8601 "YYYY-MM-DDTHH:MM:SS+hh:mm".
+#define D3L_TIME_ISO 1
+//! Timestamp flag: append milliseconds.
+#define D3L_TIME_MS 2
+//! Timestamp flag: append microseconds.
+#define D3L_TIME_US 4
+//! Timestamp flag: format in UTC instead of local time.
+#define D3L_TIME_UTC 8
+
+//! Memory flag: allocate in huge pages.
+#define D3L_MEM_HUGEPAGE 1
+
+//! Compression format: none.
+#define D3L_ZIP_NONE 0
+//! Compression format: gzip.
+#define D3L_ZIP_GZIP 1
+//! Compression format: zstd.
+#define D3L_ZIP_ZSTD 2
+
+//! Parallel read flag: bypass the page cache using O_DIRECT.
+#define D3L_READ_DIRECT 1
+
+//! Batch read flag: use the thread pool even if io_uring is available.
+#define D3L_BATCH_THREADS 1
+
+//! Metadata flag: don't follow a symbolic link at the end of the path.
+#define D3L_STAT_NOFOLLOW 1
+//! Metadata flag: serve from the cache started by d3l_fop_stat_cache_open().
+#define D3L_STAT_CACHE 2
+
+//! Map the file for sequential access.
+#define D3L_MAP_SEQUENTIAL 1
+//! Map the file for random access.
+#define D3L_MAP_RANDOM 2
+//! Map the file and start reading it ahead.
+#define D3L_MAP_WILLNEED 4
+//! Map the file using huge pages when the kernel supports it.
+#define D3L_MAP_HUGEPAGE 8
+//! Map the file and fault all pages in.
+#define D3L_MAP_POPULATE 16
+
+//! Array pack flag: store a checksum of each array.
+#define D3L_PACK_CHECKSUM 1
+//! Array pack flag: verify checksums of all arrays when opened.
+#define D3L_PACK_VERIFY 2
+
+//! Line index flag: don't save the index to a sidecar file.
+#define D3L_INDEX_NOSAVE 1
+
+//! Line reader flag: strip the '\r' before '\n'.
+#define D3L_LINE_STRIP_CR 1
+//! Line reader flag: keep waiting for a growing file at end of file.
+#define D3L_LINE_FOLLOW 2
+
+//! Walk entry type: regular file.
+#define D3L_WALK_FILE 1
+//! Walk entry type: directory.
+#define D3L_WALK_DIR 2
+//! Walk entry type: symbolic link.
+#define D3L_WALK_LINK 4
+//! Walk entry type: device, fifo or socket.
+#define D3L_WALK_OTHER 8
+
+//! Log policy: wait until the ring has free slots.
+#define D3L_LOG_BLOCK 0
+//! Log policy: drop the record when the ring is full.
+#define D3L_LOG_DROP 1
+//! Log policy: write the record directly when the ring is full.
+#define D3L_LOG_SYNC 2
 
 // Define for standard c.
 #ifdef __cplusplus
@@ -34,6 +175,15 @@ void d3l_sys_err(const char *, const char * = D3L_LOG_FILE);
 //! Get system time.
 int d3l_sys_time(char **);
 
+//! Format a timestamp.
+size_t d3l_sys_time_format_at(const struct timespec *, char *, size_t, int);
+
+//! Format current time.
+size_t d3l_sys_time_format(char *, size_t, int);
+
+//! Reload timezone.
+void d3l_sys_tzset(void);
+
 #ifdef D3L_SYS_TIME_VAR
     //! Timing variable define.
     extern struct timeval d3l_tv_start;
@@ -54,6 +204,83 @@ int d3l_sys_time(char **);
     int d3l_sys_time_up(char **, struct timeval *, struct timezone *);
 #endif
 
+//! Statistics of a timing site in nanoseconds.
+struct d3l_sys_timer_stat
+{
+    uint64_t count;     //!< number of records.
+    uint64_t mean;      //!< mean duration.
+    uint64_t p50;       //!< median duration.
+    uint64_t p99;       //!< 99th percentile duration.
+    uint64_t p999;      //!< 99.9th percentile duration.
+    uint64_t max;       //!< max duration.
+};
+
+//! Get monotonic clock.
+uint64_t d3l_sys_clock_ns(void);
+
+//! Register a timing site.
+int d3l_sys_timer_site(const char *);
+
+//! Record a duration of a timing site.
+void d3l_sys_timer_record(int, uint64_t);
+
+//! Get statistics of a timing site.
+int d3l_sys_timer_stats(int, struct d3l_sys_timer_stat *);
+
+//! Report timing histograms.
+int d3l_sys_timer_report(const char * = D3L_LOG_FILE);
+
+////////////////////////////////////////////////////////////////////////
+// Log Operation
+////////////////////////////////////////////////////////////////////////
+
+//! Start the background log writer.
+int d3l_log_start(int, int);
+
+//! Put a log record into the log writer.
+int d3l_log_write(const char *, const char *);
+
+//! Wait until all queued log records are written.
+int d3l_log_flush(void);
+
+//! Stop the background log writer.
+int d3l_log_stop(void);
+
+//! Get number of dropped log records.
+unsigned long d3l_log_dropped(void);
+
+////////////////////////////////////////////////////////////////////////
+// SIMD Operation
+////////////////////////////////////////////////////////////////////////
+
+//! Count a byte in memory.
+size_t d3l_simd_memcount(const void *, size_t, int);
+
+//! Find the first of two bytes in memory.
+const void *d3l_simd_memchr2(const void *, size_t, int, int);
+
+//! Find a needle in memory.
+const void *d3l_simd_memmem(const void *, size_t, const void *, size_t);
+
+////////////////////////////////////////////////////////////////////////
+// Memory Operation
+////////////////////////////////////////////////////////////////////////
+
+//! Allocate memory from the pool.
+void *d3l_mem_alloc(size_t);
+
+//! Free memory of the pool.
+void d3l_mem_release(void *);
+
+//! Get requested size of pool memory.
+size_t d3l_mem_size(const void *);
+
+//! Allocate aligned memory.
+void *d3l_mem_aligned(size_t, size_t, int);
+
+//! Free aligned memory.
+void d3l_mem_aligned_free(void *, size_t, int);
+
 ////////////////////////////////////////////////////////////////////////
 // File Operation
 ////////////////////////////////////////////////////////////////////////
@@ -65,93 +292,70 @@ int d3l_fop_access(const char *, int);
 int d3l_fop_remove(const char *);
 
 //! Get line number of file.
-int d3l_fop_linenum(const char *);
+int64_t d3l_fop_linenum(const char *);
+
+//! Write a buffer to a file atomically.
+int64_t d3l_fop_write_atomic(const char *, const void *, size_t, int);
+
+//! Write buffers to a file atomically.
+int64_t d3l_fop_writev(const char *, const struct iovec *, int, int);
+
+//! Batch read result of one file.
+struct d3l_fop_batch_item
+{
+    const char *path;   //!< file path.
+    int status;         //!< 0 or -errno.
+    char *buff;         //!< file contents terminated by '\0'.
+    int64_t size;       //!< file size.
+};
+
+//! Read a batch of files.
+int64_t d3l_fop_read_batch(const char **, size_t, struct d3l_fop_batch_item *, unsigned int, int);
+
+//! Free buffers of a batch read.
+void d3l_fop_read_batch_free(struct d3l_fop_batch_item *, size_t);
 
 //! Get the size of file.
-int d3l_fop_size(const char *sz_file);
+int64_t d3l_fop_size(const char *sz_file);
 
-// Define for standard c.
-#ifdef __cplusplus
-}
-#endif
+//! Progress callback of parallel file reading, nonzero return cancels it.
+typedef int (*d3l_fop_progress)(int64_t, int64_t, void *);
 
-#ifdef __cplusplus
-// Include required *standard* C++ headers.
-#include <string>
+//! Read a file into a buffer by several threads.
+int64_t d3l_fop_read_parallel(const char *, void *, uint64_t, unsigned int, int, d3l_fop_progress, void *);
 
-//! Write a file using write().
-/*!
-  \brief Write a file from a buff using ifstream.
-  \param[in] sz_file file path.
-  \param[in] buff memory point to input.
-  \param[in] size input memory size.
-  \retval ==0 Successed; <0 Failed.
- */
-template <class T>
-int d3l_fop_write(const char *sz_file, T* buff, const unsigned int size)
-{
-    if(access(sz_file, F_OK) == 0)
-    {
-        std::string str_err;
-        if(0 == unlink(sz_file))
-        {
-            str_err = "Note d3l::d3l_fop_write(const char *sz_file, T* buff, const unsigned int size) File ";
-            str_err = str_err + sz_file + " has been delete!";
-        }
-        else
-        {
-            str_err = "ERROR d3l::d3l_fop_write(const char *sz_file, T* buff, const unsigned int size) File ";
-            str_err = str_err + sz_file + " can't been delete!";
-        }
-        d3l_sys_err(str_err.c_str());
-    }
+//! Get compression format of a file.
+int d3l_fop_zip_detect(const char *);
 
-    int fout = open(sz_file, O_WRONLY|O_CREAT, 0777);
-    ssize_t rs = write(fout, buff, size * sizeof(T));
-    close(fout);
-    return rs;
-}
+//! Write a buffer to a compressed file atomically.
+int64_t d3l_fop_write_zip(const char *, const void *, size_t, int, int);
 
-//! Read a file using read().
-/*!
-  \brief Write a file from a buff using ifstream.
-  \param[in] sz_file file path.
-  \param[in] buff memory point to input.
-  \retval ==0 Successed; <0 Failed.
- */
-template <class T>
-int d3l_fop_read(const char *sz_file, T *&buff)
+//! File metadata.
+struct d3l_fop_meta
 {
-    if(access(sz_file, F_OK) != 0)
-    {
-        std::string str_err = "ERROR d3l::d3l_fop_read(const char *sz_file, T* buff) File ";
-        str_err = str_err + sz_file + " can't be found!";
-        d3l_sys_err(str_err.c_str());
-        return -1;
-    }
+    int status;         //!< 0 or -errno.
+    int type;           //!< D3L_WALK_FILE, D3L_WALK_DIR, D3L_WALK_LINK or D3L_WALK_OTHER.
+    unsigned int mode;  //!< permission bits.
+    int64_t size;       //!< file size.
+    int64_t mtime;      //!< modification time in nanoseconds since the epoch.
+};
 
-    ssize_t file_size = d3l_fop_size(sz_file);
-    int fin = open(sz_file, O_RDONLY, 0777);
-    ssize_t sum = 0;
-    ssize_t len = 0;
-    T *buff_tmp = NULL;
-    d3l_mem_create(buff, file_size/sizeof(T), static_cast<T>(0));
-    d3l_mem_create(buff_tmp, 1024, static_cast<T>(0));
+//! Get metadata of file.
+int d3l_fop_stat(const char *, struct d3l_fop_meta *, int);
 
-    while((len = read(fin, buff_tmp, 1024)) > 0)
-    {
-        memcpy(buff + sum/sizeof(T), buff_tmp, len);
-        sum += len;
-    }
+//! Get metadata of a batch of files.
+int64_t d3l_fop_stat_batch(const char **, size_t, struct d3l_fop_meta *, int);
 
-    d3l_mem_free(buff_tmp);
-    close(fin);
+//! Start the file metadata cache.
+int d3l_fop_stat_cache_open(void);
 
-    return sum;
-}
-
-#endif // #ifdef __cplusplus
+//! Stop the file metadata cache.
+void d3l_fop_stat_cache_close(void);
 
+// Define for standard c.
+#ifdef __cplusplus
+}
+#endif
 
 // Define for standard c.
 #ifdef __cplusplus
@@ -167,16 +371,71 @@ int d3l_dop_open(DIR **, const char *);
 //! Close dirent.
 int d3l_dop_close(DIR **);
 
+//! Entry visited by the directory walker.
+struct d3l_dop_entry
+{
+    const char *path;   //!< full path, valid during the visitor call.
+    const char *name;   //!< entry name inside path.
+    int type;           //!< one of D3L_WALK_* types.
+    int depth;          //!< 1 for entries of the walked dir.
+    int64_t size;       //!< file size, -1 unless a size filter is set.
+};
+
+//! Entry filter of the directory walker, zero fields are disabled.
+struct d3l_dop_filter
+{
+    const char *glob;   //!< fnmatch() pattern of entry name.
+    const char *suffix; //!< suffix of entry name.
+    int types;          //!< mask of D3L_WALK_* types.
+    int max_depth;      //!< max depth to walk.
+    int64_t min_size;   //!< min size of regular files.
+    int64_t max_size;   //!< max size of regular files.
+};
+
+//! Visitor of the directory walker.
+typedef int (*d3l_dop_visitor)(const struct d3l_dop_entry *, void *);
+
+//! Walk dirent recursively.
+int64_t d3l_dop_walk(const char *, const struct d3l_dop_filter *, d3l_dop_visitor, void *, int);
+
 //! Get file number of dirent.
 int d3l_dop_filenum(const char *);
 
+//! Get file number of dirent recursively.
+int64_t d3l_dop_filenum_r(const char *, int);
+
 //! Create dirent by path.
 int d3l_dop_create(const char *);
 
+//! Create dirents in bulk.
+int d3l_dop_create_bulk(const char **, size_t, int);
+
 ////////////////////////////////////////////////////////////////////////
 // Charset Operation
 ////////////////////////////////////////////////////////////////////////
 
+//! Close cached iconv descriptors of current thread.
+int d3l_charset_pool_clear(void);
+
+//! Statistics of the conversion memo.
+struct d3l_charset_memo_stat
+{
+    uint64_t hits;          //!< conversions served from the memo.
+    uint64_t misses;        //!< conversions run and offered to the memo.
+    uint64_t evictions;     //!< entries replaced by newer ones.
+    uint64_t entries;       //!< entries in use.
+    uint64_t capacity;      //!< max entries.
+};
+
+//! Start the conversion memo of short string objects.
+int d3l_charset_memo_open(size_t);
+
+//! Stop the conversion memo.
+void d3l_charset_memo_close(void);
+
+//! Get statistics of the conversion memo.
+int d3l_charset_memo_stats(struct d3l_charset_memo_stat *);
+
 //! Code convert from one to another.
 int d3l_charset_code_convert(char *from_charset, char *to_charset, char *inbuf, int inlen, char *outbuf, int outlen);
 
@@ -186,9 +445,27 @@ int d3l_charset_u2g(char *inbuf, size_t inlen, char *outbuf, size_t outlen);
 //! Code convert string from GB2312 to UNICODE.
 int d3l_charset_g2u(char *inbuf, size_t inlen, char *outbuf, size_t outlen);
 
+//! Code convert from a file descriptor to another.
+int d3l_charset_convert_fd(const char *, const char *, int, int, int);
+
+//! Code convert a file to another.
+int d3l_charset_convert_file(const char *, const char *, const char *, const char *, int);
+
 //! Print char content using 16bit format.
 int d3l_charset_printc(const char *cc);
 
+//! Check if a string is pure ASCII.
+int d3l_charset_is_ascii(const char *, size_t);
+
+//! Check if a string is valid UTF-8.
+int d3l_charset_is_utf8(const char *, size_t);
+
+//! Check if a string is valid GBK.
+int d3l_charset_is_gbk(const char *, size_t);
+
+//! Classify a string as ASCII, UTF-8 or GBK.
+int d3l_charset_detect(const char *, size_t);
+
 // Define for standard c.
 #ifdef __cplusplus
 }
@@ -197,9 +474,20 @@ int d3l_charset_printc(const char *cc);
 // Define the interfaces only for c++.
 #ifdef __cplusplus
 
+// The c++ interfaces use <charconv>, std::string_view and if constexpr.
+#if __cplusplus < 201703L
+#error "d3l needs C++17, compile with -std=c++17 or later"
+#endif
+
 // Include required *standard* C++ headers.
+#include <string>
 #include <sstream>
 #include <fstream>
+#include <charconv>
+#include <type_traits>
+#include <string_view>
+#include <vector>
+#include <memory>
 //using namespace std;
 #include <memory.h>
 
@@ -207,66 +495,371 @@ int d3l_charset_printc(const char *cc);
 // Define template function.
 ////////////////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////////////////
+// System Operation
+////////////////////////////////////////////////////////////////////////
+
+//! Scoped timer.
+/*!
+  \brief Scoped timer, records the lifetime of the object into a timing site
+         of d3l_sys_timer_site().
+ */
+class d3l_sys_timer
+{
+public:
+    explicit d3l_sys_timer(int site) : site_(site), start_(d3l_sys_clock_ns()) {}
+    ~d3l_sys_timer() { d3l_sys_timer_record(site_, d3l_sys_clock_ns() - start_); }
+
+private:
+    d3l_sys_timer(const d3l_sys_timer &);
+    d3l_sys_timer &operator=(const d3l_sys_timer &);
+
+    int site_;
+    uint64_t start_;
+};
+
+#define D3L_TIMER_CAT_(a, b) a##b
+#define D3L_TIMER_CAT(a, b) D3L_TIMER_CAT_(a, b)
+//! Time the rest of current scope as a named site.
+#define D3L_TIMER_SCOPE(name) \
+    static const int D3L_TIMER_CAT(d3l_timer_site_, __LINE__) = d3l_sys_timer_site(name); \
+    d3l_sys_timer D3L_TIMER_CAT(d3l_timer_, __LINE__)(D3L_TIMER_CAT(d3l_timer_site_, __LINE__))
+
 ////////////////////////////////////////////////////////////////////////
 // Convert Operation
 ////////////////////////////////////////////////////////////////////////
 
+//! Check whether T is converted by from_chars/to_chars.
+/*!
+  \brief Integer and floating types are converted by from_chars/to_chars, bool and
+         character types keep the stream behavior.
+ */
+template <class T>
+struct d3l_convert_is_number
+{
+    static const bool value = std::is_arithmetic<T>::value && !std::is_same<T, bool>::value &&
+        !std::is_same<T, char>::value && !std::is_same<T, signed char>::value &&
+        !std::is_same<T, unsigned char>::value && !std::is_same<T, wchar_t>::value &&
+        !std::is_same<T, char16_t>::value && !std::is_same<T, char32_t>::value;
+};
+
+//! Check whether a char is white space.
+inline bool d3l_convert_is_space(char ch)
+{
+    return ' ' == ch || ('\t' <= ch && ch <= '\r');
+}
+
+//! Parse a number at the front of chars.
+/*!
+  \brief Parse a number at the front of [first, last) using from_chars, a
+         leading '+' is accepted like streams do.
+  \param[in,out] first chars begin, moved past the number.
+  \param[in] last chars end.
+  \param[out] value number.
+  \retval ==0 Successed; -1 Not a number; -2 Out of range.
+ */
+template <class T>
+int d3l_convert_parse(const char *&first, const char *last, T &value)
+{
+    static_assert(d3l_convert_is_number<T>::value, "d3l_convert_parse needs an integer or floating type");
+    const char *begin = first;
+    if(begin != last && '+' == *begin && begin + 1 != last && '-' != begin[1])
+        begin++;
+    std::from_chars_result rs = std::from_chars(begin, last, value);
+    if(std::errc::invalid_argument == rs.ec)
+        return -1;
+    if(std::errc::result_out_of_range == rs.ec)
+        return -2;
+    first = rs.ptr;
+    return 0;
+}
+
+//! Convert chars to other type.
+/*!
+  \brief Convert chars to other type, numbers use from_chars and other types use
+         stringstream. White space around the value is skipped, anything else
+         left over is an error.
+  \param[in] sz_str chars.
+  \param[in] len chars length.
+  \param[out] value value (int, double and so on...).
+  \retval ==0 Successed; -1 Invalid; -2 Out of range.
+ */
+template <class T>
+int d3l_convert_from_chars(const char *sz_str, size_t len, T &value)
+{
+    const char *first = sz_str;
+    const char *last = sz_str + len;
+    if constexpr(d3l_convert_is_number<T>::value)
+    {
+        while(first != last && d3l_convert_is_space(*first))
+            first++;
+        int rs = d3l_convert_parse(first, last, value);
+        if(rs < 0)
+            return rs;
+    }
+    else
+    {
+        std::stringstream ss(std::string(sz_str, len));
+        if(!(ss >> value))
+            return -1;
+        std::streamoff pos = ss.eof() ? static_cast<std::streamoff>(len) : static_cast<std::streamoff>(ss.tellg());
+        first += pos;
+    }
+    while(first != last && d3l_convert_is_space(*first))
+        first++;
+    return (first == last) ? 0 : -1;
+}
+
 //! Convert a std::string to other type.
 /*!
-  \brief Convert a std::string to other type using stringstream.
+  \brief Convert a std::string to other type using d3l_convert_from_chars().
   \param[in]  s_str string.
   \param[out] value string value (int, double and so on...).
+  \retval ==0 Successed; -1 Invalid; -2 Out of range.
  */
 template <class T>
-void d3l_convert_from_string(const std::string &s_str, T &value)
+int d3l_convert_from_string(const std::string &s_str, T &value)
 {
-    std::stringstream ss(s_str);
-    ss >> value;
+    return d3l_convert_from_chars(s_str.data(), s_str.size(), value);
+}
+
+//! Convert an other type value to chars.
+/*!
+  \brief Convert a value to chars, numbers use to_chars with the shortest
+         representation that round-trips and other types use stringstream.
+  \param[in] value value (int, double and so on...).
+  \param[out] buff output buff, not terminated.
+  \param[in] len buff length.
+  \retval >=0 Chars length; <0 Buff is too small.
+ */
+template <class T>
+int d3l_convert_to_chars(const T &value, char *buff, size_t len)
+{
+    if constexpr(d3l_convert_is_number<T>::value)
+    {
+        std::to_chars_result rs = std::to_chars(buff, buff + len, value);
+        if(std::errc() != rs.ec)
+            return -1;
+        return static_cast<int>(rs.ptr - buff);
+    }
+    else
+    {
+        std::stringstream ss;
+        ss << value;
+        std::string str = ss.str();
+        if(str.size() > len)
+            return -1;
+        memcpy(buff, str.data(), str.size());
+        return static_cast<int>(str.size());
+    }
 }
 
 //! Convert an other type value to std::string.
 /*!
-  \brief Convert a std::string to other type using stringstream.
+  \brief Convert a value to std::string using d3l_convert_to_chars().
   \param[in] value string value (int, double and so on...).
   \param[out]  s_str string.
+  \retval ==0 Successed; <0 Failed.
  */
 template <class T>
-void d3l_convert_to_string(const T &value, std::string &s_str)
+int d3l_convert_to_string(const T &value, std::string &s_str)
 {
-    std::stringstream ss;
-    ss << value;
-    ss >> s_str;
+    if constexpr(d3l_convert_is_number<T>::value)
+    {
+        char buff[128];
+        int len = d3l_convert_to_chars(value, buff, sizeof(buff));
+        if(len < 0)
+            return -1;
+        s_str.assign(buff, len);
+    }
+    else
+    {
+        std::stringstream ss;
+        ss << value;
+        ss >> s_str;
+    }
+    return 0;
+}
+
+//! Convert chars to an array of numbers.
+/*!
+  \brief Parse numbers separated by delim and white space from one buffer using
+         from_chars.
+  \param[in] sz_str chars.
+  \param[in] len chars length.
+  \param[out] values numbers, values before a failed one are stored.
+  \param[in] num max number of values.
+  \param[in] delim separator, white space always separates values.
+  \retval >=0 Value number; -1 Invalid; -2 Out of range.
+ */
+template <class T>
+int64_t d3l_convert_from_chars_n(const char *sz_str, size_t len, T *values, size_t num, char delim = ' ')
+{
+    const char *first = sz_str;
+    const char *last = sz_str + len;
+    size_t count = 0;
+    for(;;)
+    {
+        while(first != last && d3l_convert_is_space(*first))
+            first++;
+        if(first == last || count == num)
+            break;
+        int rs = d3l_convert_parse(first, last, values[count]);
+        if(rs < 0)
+            return rs;
+        count++;
+        while(first != last && d3l_convert_is_space(*first))
+            first++;
+        if(first != last && delim == *first)
+            first++;
+        else if(first != last && !d3l_convert_is_space(delim))
+            return -1;
+    }
+    return static_cast<int64_t>(count);
+}
+
+//! Convert an array of numbers to chars.
+/*!
+  \brief Format numbers separated by delim into one buffer using to_chars.
+  \param[in] values numbers.
+  \param[in] num value number.
+  \param[out] buff output buff, not terminated.
+  \param[in] len buff length.
+  \param[in] delim separator.
+  \retval >=0 Chars length; <0 Buff is too small.
+ */
+template <class T>
+int64_t d3l_convert_to_chars_n(const T *values, size_t num, char *buff, size_t len, char delim = ' ')
+{
+    static_assert(d3l_convert_is_number<T>::value, "d3l_convert_to_chars_n needs an integer or floating type");
+    char *pos = buff;
+    char *last = buff + len;
+    for(size_t i = 0; i < num; i++)
+    {
+        if(i > 0)
+        {
+            if(pos == last)
+                return -1;
+            *pos++ = delim;
+        }
+        std::to_chars_result rs = std::to_chars(pos, last, values[i]);
+        if(std::errc() != rs.ec)
+            return -1;
+        pos = rs.ptr;
+    }
+    return static_cast<int64_t>(pos - buff);
+}
+
+//! Append an array of numbers to std::string.
+/*!
+  \brief Append numbers separated by delim to a std::string using to_chars.
+  \param[in] values numbers.
+  \param[in] num value number.
+  \param[out] s_str string to append.
+  \param[in] delim separator.
+  \retval ==0 Successed; <0 Failed.
+ */
+template <class T>
+int d3l_convert_to_string_n(const T *values, size_t num, std::string &s_str, char delim = ' ')
+{
+    static_assert(d3l_convert_is_number<T>::value, "d3l_convert_to_string_n needs an integer or floating type");
+    char buff[4096];
+    size_t used = 0;
+    for(size_t i = 0; i < num; i++)
+    {
+        if(sizeof(buff) - used < 129)
+        {
+            s_str.append(buff, used);
+            used = 0;
+        }
+        if(i > 0)
+            buff[used++] = delim;
+        std::to_chars_result rs = std::to_chars(buff + used, buff + sizeof(buff), values[i]);
+        if(std::errc() != rs.ec)
+            return -1;
+        used = rs.ptr - buff;
+    }
+    s_str.append(buff, used);
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////
 // Memory Operation
 ////////////////////////////////////////////////////////////////////////
 
+//! Create memory space and value-initialize it.
+/*!
+  \brief Create memory space from d3l_mem_alloc() and value-initialize it, so
+         numbers and pointers are zero and classes are default constructed.
+  \param[in]  p_ptr point.
+  \param[in]  size element number.
+  \retval memory point.
+ */
+template <class T>
+T* d3l_mem_create(T *&p_ptr, const size_t &size)
+{
+    static_assert(alignof(T) <= 16, "d3l_mem_create supports alignment up to 16 bytes");
+    // A wrapped byte size would give a block smaller than size elements.
+    p_ptr = (size > SIZE_MAX / sizeof(T)) ? NULL : static_cast<T *>(d3l_mem_alloc(size * sizeof(T)));
+    if(NULL == p_ptr)
+    {
+        std::string err_str = "ERROR d3l::T *d3l_mem_create(T *&, const size_t) ";
+        d3l_sys_err(err_str.c_str());
+        return NULL;
+    }
+    std::uninitialized_value_construct_n(p_ptr, size);
+    return p_ptr;
+}
+
 //! Create memory space and set to default value.
 /*!
-  \brief Create memory space and set to default value using <memory.h>.
+  \brief Create memory space from d3l_mem_alloc() and copy value to each element.
   \param[in]  p_ptr point.
-  \param[in]  size memory size.
-  \param[in]  value default value(default is 0).
+  \param[in]  size element number.
+  \param[in]  value default value.
   \retval memory point.
  */
 template <class T>
-T* d3l_mem_create(T *&p_ptr, const unsigned int &size, T value = 0)
+T* d3l_mem_create(T *&p_ptr, const size_t &size, const T &value)
 {
-    p_ptr = new T[size];
+    static_assert(alignof(T) <= 16, "d3l_mem_create supports alignment up to 16 bytes");
+    p_ptr = (size > SIZE_MAX / sizeof(T)) ? NULL : static_cast<T *>(d3l_mem_alloc(size * sizeof(T)));
     if(NULL == p_ptr)
     {
-        std::string err_str = "ERROR d3l::T *d3l_mem_create(const unsigned int, const int = 0) ";
+        std::string err_str = "ERROR d3l::T *d3l_mem_create(T *&, const size_t, const T &) ";
+        d3l_sys_err(err_str.c_str());
+        return NULL;
+    }
+    std::uninitialized_fill_n(p_ptr, size, value);
+    return p_ptr;
+}
+
+//! Create memory space without initialization.
+/*!
+  \brief Create memory space from d3l_mem_alloc() for a trivial type, leaving
+         it uninitialized.
+  \param[in]  p_ptr point.
+  \param[in]  size element number.
+  \retval memory point.
+ */
+template <class T>
+T* d3l_mem_create_uninit(T *&p_ptr, const size_t &size)
+{
+    static_assert(std::is_trivially_default_constructible<T>::value && alignof(T) <= 16,
+            "d3l_mem_create_uninit needs a trivial type aligned up to 16 bytes");
+    p_ptr = (size > SIZE_MAX / sizeof(T)) ? NULL : static_cast<T *>(d3l_mem_alloc(size * sizeof(T)));
+    if(NULL == p_ptr)
+    {
+        std::string err_str = "ERROR d3l::T *d3l_mem_create_uninit(T *&, const size_t) ";
         d3l_sys_err(err_str.c_str());
     }
-    else
-        memset(p_ptr, value, size * sizeof(T));
     return p_ptr;
 }
 
 //! Free memory space.
 /*!
-  \brief Free memory space using delete.
+  \brief Destroy the elements and free memory space of d3l_mem_create() using
+         d3l_mem_release().
   \param[in]  p_ptr point.
   \retval memory point.
  */
@@ -275,21 +868,125 @@ T* d3l_mem_free(T *&p_ptr)
 {
     if(NULL != p_ptr)
     {
-        delete[] p_ptr;
+        if constexpr(!std::is_trivially_destructible<T>::value)
+            std::destroy_n(p_ptr, d3l_mem_size(p_ptr) / sizeof(T));
+        d3l_mem_release(p_ptr);
         p_ptr = NULL;
     }
     return p_ptr;
 }
 
+//! Position of an arena.
+struct d3l_mem_arena_mark
+{
+    size_t block;       //!< index + 1 of current block, 0 before the first one.
+    uintptr_t cur;      //!< next free byte.
+};
+
+//! Bump arena.
+/*!
+  \brief Bump arena for short-lived scratch memory. Allocation moves a pointer
+         inside cache-line aligned blocks, memory is only given back by reset()
+         to a mark or by d3l_mem_arena_scope, and blocks are kept for reuse.
+         Objects must be trivially destructible.
+ */
+class d3l_mem_arena
+{
+public:
+    explicit d3l_mem_arena(size_t block_size = D3L_MEM_ARENA_BLOCK);
+    ~d3l_mem_arena();
+
+    //! Allocate memory.
+    void *alloc(size_t size, size_t align = 16)
+    {
+        uintptr_t ptr = (cur_ + align - 1) & ~static_cast<uintptr_t>(align - 1);
+        if(0 != cur_ && ptr + size <= end_)
+        {
+            cur_ = ptr + size;
+            return reinterpret_cast<void *>(ptr);
+        }
+        return grow(size, align);
+    }
+
+    //! Allocate value-initialized elements.
+    template <class T>
+    T *create(size_t num)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "d3l_mem_arena never runs destructors");
+        T *ptr = static_cast<T *>(alloc(num * sizeof(T), alignof(T)));
+        if(NULL != ptr)
+            std::uninitialized_value_construct_n(ptr, num);
+        return ptr;
+    }
+
+    //! Allocate uninitialized elements.
+    template <class T>
+    T *create_uninit(size_t num)
+    {
+        static_assert(std::is_trivial<T>::value, "d3l_mem_arena::create_uninit needs a trivial type");
+        return static_cast<T *>(alloc(num * sizeof(T), alignof(T)));
+    }
+
+    //! Get current position.
+    d3l_mem_arena_mark mark() const
+    {
+        d3l_mem_arena_mark mark = {block_, cur_};
+        return mark;
+    }
+
+    //! Reset the arena to a mark.
+    void reset(const d3l_mem_arena_mark &mark);
+
+    //! Reset the arena to empty.
+    void reset()
+    {
+        d3l_mem_arena_mark mark = {0, 0};
+        reset(mark);
+    }
+
+private:
+    d3l_mem_arena(const d3l_mem_arena &);
+    d3l_mem_arena &operator=(const d3l_mem_arena &);
+    void *grow(size_t size, size_t align);
+
+    std::vector<char *> blocks_;
+    std::vector<size_t> sizes_;
+    uintptr_t cur_;
+    uintptr_t end_;
+    size_t block_;
+    size_t block_size_;
+};
+
+//! Reset an arena when leaving scope.
+class d3l_mem_arena_scope
+{
+public:
+    explicit d3l_mem_arena_scope(d3l_mem_arena &arena) : arena_(arena), mark_(arena.mark()) {}
+    ~d3l_mem_arena_scope() { arena_.reset(mark_); }
+
+private:
+    d3l_mem_arena_scope(const d3l_mem_arena_scope &);
+    d3l_mem_arena_scope &operator=(const d3l_mem_arena_scope &);
+
+    d3l_mem_arena &arena_;
+    d3l_mem_arena_mark mark_;
+};
+
 ////////////////////////////////////////////////////////////////////////
 // Charset Operation
 ////////////////////////////////////////////////////////////////////////
 
 //! Code convert string object from UNICODE to GB2312.
-int d3l_charset_u2g(const std::string &in_str, std::string &out_str);
+int d3l_charset_u2g(const std::string &in_str, std::string &out_str, int flags = 0);
+
+//! Code convert string object from UNICODE to GB2312, move input when no work is needed.
+int d3l_charset_u2g(std::string &&in_str, std::string &out_str, int flags = 0);
 
 //! Code convert string object from GB2312 to UNICODE.
-int d3l_charset_g2u(const std::string &in_str, std::string &out_str);
+int d3l_charset_g2u(const std::string &in_str, std::string &out_str, int flags = 0);
+
+//! Code convert string object from GB2312 to UNICODE, move input when no work is needed.
+int d3l_charset_g2u(std::string &&in_str, std::string &out_str, int flags = 0);
 
 ////////////////////////////////////////////////////////////////////////
 // STL String Object Operation
@@ -301,6 +998,46 @@ int d3l_str_erase(std::string& str, const std::string& sub_str);
 //! Replace sub string from string object.
 int d3l_str_replace(std::string &str, const std::string &str_src, const std::string &str_dest);
 
+//! Multi-pattern string replacer.
+/*!
+  \brief Replace a table of (pattern -> replacement) pairs in one pass using an
+         Aho-Corasick automaton compiled once and reused. Matches are leftmost
+         longest and don't overlap, replacements are not scanned again. A later
+         pair with the same pattern overrides the earlier one.
+ */
+class d3l_str_replacer
+{
+public:
+    d3l_str_replacer() : shrink_(true), compiled_(false) {}
+
+    //! Add a pattern and its replacement.
+    int add(const std::string &pattern, const std::string &replacement);
+
+    //! Compile the automaton.
+    int compile();
+
+    //! Replace all patterns in a string object.
+    int replace(std::string &str) const;
+
+    //! Replace all patterns of chars into a string object.
+    int replace(const char *sz_str, size_t len, std::string &out_str) const;
+
+    //! Get pattern number.
+    size_t size() const { return patterns_.size(); }
+
+private:
+    template <class F>
+    void scan(const char *sz_str, size_t len, F emit) const;
+
+    std::vector<std::string> patterns_;
+    std::vector<std::string> replacements_;
+    std::vector<int> next_;     //!< 256 transitions of each state.
+    std::vector<int> depth_;    //!< depth of each state.
+    std::vector<int> out_;      //!< longest pattern ending at each state, -1 if none.
+    bool shrink_;               //!< no replacement is longer than its pattern.
+    bool compiled_;
+};
+
 ////////////////////////////////////////////////////////////////////////
 // File Operation
 ////////////////////////////////////////////////////////////////////////
@@ -308,6 +1045,551 @@ int d3l_str_replace(std::string &str, const std::string &str_src, const std::str
 //! Open a file by ifstream.
 int d3l_fop_open_ifstream(std::ifstream &, const char *);
 
+//! Typed read-only view of memory.
+template <class T>
+struct d3l_span
+{
+    const T *ptr;
+    size_t len;
+
+    d3l_span() : ptr(NULL), len(0) {}
+    d3l_span(const T *p, size_t n) : ptr(p), len(n) {}
+    const T *data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return 0 == len; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + len; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+};
+
+//! Read-only memory mapped file.
+/*!
+  \brief Read-only memory mapped file, unmapped when destroyed. The contents
+         are used in place as typed views, trailing bytes that don't make a
+         whole element are left out of the view.
+ */
+class d3l_fop_map
+{
+public:
+    d3l_fop_map() : addr_(NULL), size_(0) {}
+    ~d3l_fop_map() { close(); }
+    d3l_fop_map(d3l_fop_map &&other) : addr_(other.addr_), size_(other.size_)
+    {
+        other.addr_ = NULL;
+        other.size_ = 0;
+    }
+    d3l_fop_map &operator=(d3l_fop_map &&other)
+    {
+        if(this != &other)
+        {
+            close();
+            addr_ = other.addr_;
+            size_ = other.size_;
+            other.addr_ = NULL;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    //! Map a file.
+    int open(const char *sz_file, int flags = 0);
+
+    //! Unmap the file.
+    void close();
+
+    //! Get file contents.
+    const char *data() const { return static_cast<const char *>(addr_); }
+
+    //! Get file size.
+    size_t size() const { return size_; }
+
+    //! Get file contents as a view of T.
+    template <class T>
+    d3l_span<T> span() const { return d3l_span<T>(static_cast<const T *>(addr_), size_ / sizeof(T)); }
+
+    //! Get number of trailing bytes not in the view of T.
+    template <class T>
+    size_t tail() const { return size_ % sizeof(T); }
+
+private:
+    d3l_fop_map(const d3l_fop_map &);
+    d3l_fop_map &operator=(const d3l_fop_map &);
+
+    void *addr_;
+    size_t size_;
+};
+
+//! Decompression state of d3l_fop_zreader.
+struct d3l_zip_stream;
+
+//! Reader of compressed files.
+/*!
+  \brief Read a file compressed by gzip or zstd, found by magic bytes, and
+         uncompressed input as is. A background thread reads and decompresses
+         blocks ahead of the consumer.
+ */
+class d3l_fop_zreader
+{
+public:
+    d3l_fop_zreader() : stream_(NULL) {}
+    ~d3l_fop_zreader() { close(); }
+
+    //! Open a file, "-" is stdin.
+    int open(const char *sz_file);
+
+    //! Read an opened fd, it is not closed by the reader.
+    int attach(int fd);
+
+    //! Get compression format of the input.
+    int format() const;
+
+    //! Read decompressed data.
+    int64_t read(void *buff, size_t size);
+
+    //! Close the reader.
+    void close();
+
+private:
+    d3l_fop_zreader(const d3l_fop_zreader &);
+    d3l_fop_zreader &operator=(const d3l_fop_zreader &);
+
+    d3l_zip_stream *stream_;
+};
+
+//! Stream buffer of d3l_fop_zreader.
+/*!
+  \brief Stream buffer reading through d3l_fop_zreader, so an std::istream
+         reads compressed files like an ifstream reads plain ones.
+ */
+class d3l_fop_zstreambuf : public std::streambuf
+{
+public:
+    //! Open a file, "-" is stdin.
+    int open(const char *sz_file) { return reader_.open(sz_file); }
+
+    //! Close the file.
+    void close() { reader_.close(); setg(buff_, buff_, buff_); }
+
+protected:
+    int_type underflow()
+    {
+        if(gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        int64_t len = reader_.read(buff_, sizeof(buff_));
+        if(len <= 0)
+            return traits_type::eof();
+        setg(buff_, buff_, buff_ + len);
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    d3l_fop_zreader reader_;
+    char buff_[64 * 1024];
+};
+
+//! Read a whole compressed file.
+int64_t d3l_fop_zip_read(const char *, std::string &);
+
+//! Read a whole compressed file into a memory block from d3l_mem_alloc().
+int64_t d3l_fop_zip_read(const char *, void *&, size_t);
+
+//! Line reader of a file descriptor.
+/*!
+  \brief Read lines of a file, pipe or stdin in large aligned blocks. Each
+         line is a view into the reader buffer without '\n', valid until the
+         next call of next(); a line spanning blocks is moved to the buffer
+         head, and the buffer grows for lines longer than it. Compressed files
+         are read through d3l_fop_zreader.
+ */
+class d3l_fop_lines
+{
+public:
+    d3l_fop_lines() : fd_(-1), own_(false), flags_(0), kernel_(NULL), zin_(NULL), buff_(NULL), cap_(0),
+                      begin_(0), base_(0), scan_(0), end_(0), mask_(0), eof_(false), num_(0) {}
+    ~d3l_fop_lines() { close(); }
+
+    //! Open a file, "-" is stdin.
+    int open(const char *sz_file, int flags = 0);
+
+    //! Read lines of an opened fd, it is not closed by the reader.
+    int attach(int fd, int flags = 0);
+
+    //! Close the reader.
+    void close();
+
+    //! Get next line.
+    int next(std::string_view &line);
+
+    //! Get number of lines read.
+    int64_t num() const { return num_; }
+
+private:
+    d3l_fop_lines(const d3l_fop_lines &);
+    d3l_fop_lines &operator=(const d3l_fop_lines &);
+
+    int fill();
+
+    int fd_;
+    bool own_;
+    int flags_;
+    uint64_t (*kernel_)(const unsigned char *, size_t, unsigned char);
+    d3l_fop_zreader *zin_;
+    char *buff_;
+    size_t cap_;
+    size_t begin_;
+    size_t base_;
+    size_t scan_;
+    size_t end_;
+    uint64_t mask_;
+    bool eof_;
+    int64_t num_;
+};
+
+//! Element type code of arrays in a pack file, 0 is a raw trivially copyable type.
+template <class T> struct d3l_fop_pack_type { static const uint32_t value = 0; };
+template <> struct d3l_fop_pack_type<int8_t> { static const uint32_t value = 1; };
+template <> struct d3l_fop_pack_type<uint8_t> { static const uint32_t value = 2; };
+template <> struct d3l_fop_pack_type<int16_t> { static const uint32_t value = 3; };
+template <> struct d3l_fop_pack_type<uint16_t> { static const uint32_t value = 4; };
+template <> struct d3l_fop_pack_type<int32_t> { static const uint32_t value = 5; };
+template <> struct d3l_fop_pack_type<uint32_t> { static const uint32_t value = 6; };
+template <> struct d3l_fop_pack_type<int64_t> { static const uint32_t value = 7; };
+template <> struct d3l_fop_pack_type<uint64_t> { static const uint32_t value = 8; };
+template <> struct d3l_fop_pack_type<float> { static const uint32_t value = 9; };
+template <> struct d3l_fop_pack_type<double> { static const uint32_t value = 10; };
+template <> struct d3l_fop_pack_type<char> { static const uint32_t value = 11; };
+
+//! Array entry of a pack file index.
+struct d3l_fop_pack_entry
+{
+    char name[64];          //!< array name terminated by '\0'.
+    uint32_t type;          //!< element type code of d3l_fop_pack_type.
+    uint32_t elem_size;     //!< element size.
+    uint32_t align;         //!< data alignment in the file.
+    uint32_t flags;         //!< D3L_PACK_CHECKSUM when checksum is set.
+    uint64_t count;         //!< element number.
+    uint64_t offset;        //!< data offset in the file.
+    uint64_t checksum;      //!< data checksum.
+    char reserved[24];
+};
+
+//! Writer of pack files.
+/*!
+  \brief Collect named arrays and write them to a pack file: a header with
+         magic, version and byte order, each array at an aligned offset, and
+         an index of their name, type, count, alignment and checksum. Arrays
+         are not copied, they must outlive write().
+ */
+class d3l_fop_pack_writer
+{
+public:
+    //! Add an array.
+    template <class T>
+    int add(const char *name, const T *data, size_t count, size_t align = 64)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "d3l_fop_pack_writer: T must be trivially copyable");
+        return add_raw(name, d3l_fop_pack_type<T>::value, sizeof(T), data, count, align);
+    }
+
+    //! Write all arrays to a file.
+    int64_t write(const char *sz_file, int flags = D3L_PACK_CHECKSUM) const;
+
+    //! Drop all arrays.
+    void clear() { items_.clear(); }
+
+private:
+    struct item
+    {
+        std::string name;
+        uint32_t type;
+        uint32_t elem_size;
+        uint32_t align;
+        const void *data;
+        uint64_t count;
+    };
+
+    int add_raw(const char *name, uint32_t type, uint32_t elem_size, const void *data, size_t count, size_t align);
+
+    std::vector<item> items_;
+};
+
+//! Memory mapped pack file.
+/*!
+  \brief Map a pack file and use its arrays in place. Header, byte order,
+         index and bounds are checked when opened; views stay valid until the
+         pack is closed.
+ */
+class d3l_fop_pack
+{
+public:
+    d3l_fop_pack() : index_(NULL), num_(0) {}
+
+    //! Map a pack file.
+    int open(const char *sz_file, int flags = 0, int map_flags = 0);
+
+    //! Unmap the pack file.
+    void close();
+
+    //! Get number of arrays.
+    size_t size() const { return num_; }
+
+    //! Get an array entry by position.
+    const d3l_fop_pack_entry &entry(size_t i) const { return index_[i]; }
+
+    //! Find an array entry by name.
+    const d3l_fop_pack_entry *find(const char *name) const;
+
+    //! Verify checksum of an array.
+    int verify(const d3l_fop_pack_entry &entry) const;
+
+    //! Get an array as a view of T.
+    template <class T>
+    int get(const char *name, d3l_span<T> &view) const
+    {
+        const d3l_fop_pack_entry *entry = find(name);
+        if(NULL == entry)
+            return -1;
+        if(d3l_fop_pack_type<T>::value != entry->type || sizeof(T) != entry->elem_size ||
+           0 != entry->offset % alignof(T))
+            return -2;
+        view = d3l_span<T>(reinterpret_cast<const T *>(map_.data() + entry->offset), entry->count);
+        return 0;
+    }
+
+private:
+    d3l_fop_map map_;
+    const d3l_fop_pack_entry *index_;
+    size_t num_;
+};
+
+//! Line offset index of a text file.
+/*!
+  \brief Index byte offsets of every stride-th line of a mapped file, so line n
+         is found by one lookup and at most stride - 1 newline searches. The
+         index is saved to a pack file sz_file + ".lidx", checked against the
+         size and mtime of the file, and extended by scanning only the
+         appended bytes when the file grows. Views are valid until the next
+         refresh() or close().
+ */
+class d3l_fop_line_index
+{
+public:
+    d3l_fop_line_index() : offsets_(NULL), offset_num_(0), stride_(1), size_(0),
+                           mtime_(0), newlines_(0), sum_(0), flags_(0) {}
+
+    //! Open a file and load or build its line index.
+    int open(const char *sz_file, size_t stride = 1, int flags = 0);
+
+    //! Update the index to the current file contents.
+    int refresh();
+
+    //! Close the index and the file.
+    void close();
+
+    //! Get number of lines, a last line without '\n' is counted too.
+    int64_t line_count() const
+    {
+        // Nothing is indexed while the file isn't mapped, as after a failed refresh().
+        if(NULL == offsets_ || map_.size() < size_)
+            return 0;
+        return newlines_ + (size_ > 0 && '\n' != map_.data()[size_ - 1] ? 1 : 0);
+    }
+
+    //! Get line n from 0, without '\n'.
+    int line(int64_t n, std::string_view &view) const { return range(n, n + 1, view); }
+
+    //! Get lines [a, b) from 0, without the last '\n'.
+    int range(int64_t a, int64_t b, std::string_view &view) const;
+
+private:
+    d3l_fop_line_index(const d3l_fop_line_index &);
+    d3l_fop_line_index &operator=(const d3l_fop_line_index &);
+
+    const char *line_start(int64_t n) const;
+    int build(uint64_t from);
+    int load();
+    void save();
+
+    std::string file_;
+    d3l_fop_map map_;
+    d3l_fop_pack pack_;
+    std::vector<uint64_t> grown_;
+    const uint64_t *offsets_;   //!< offsets of lines 0, stride, 2 * stride.., in pack_ or grown_.
+    size_t offset_num_;
+    uint64_t stride_;
+    uint64_t size_;             //!< indexed bytes.
+    int64_t mtime_;             //!< mtime of the file when indexed.
+    int64_t newlines_;          //!< '\n' number in indexed bytes.
+    uint64_t sum_;              //!< checksum of sampled indexed bytes.
+    int flags_;
+};
+
+//! Write a file using d3l_fop_write_atomic().
+/*!
+  \brief Write a file from a buff, the file is replaced atomically with the
+         durability given by D3L_FOP_SYNC.
+  \param[in] sz_file file path.
+  \param[in] buff memory point to input.
+  \param[in] size input element number.
+  \retval >=0 Written size; <0 Failed.
+ */
+template <class T>
+int64_t d3l_fop_write(const char *sz_file, T* buff, const size_t size)
+{
+    return d3l_fop_write_atomic(sz_file, buff, size * sizeof(T), D3L_FOP_SYNC);
+}
+
+//! Write a compressed file using d3l_fop_write_zip().
+/*!
+  \brief Write a file from a buff compressed by gzip or zstd, the file is
+         replaced atomically with the durability given by D3L_FOP_SYNC.
+  \param[in] sz_file file path.
+  \param[in] buff memory point to input.
+  \param[in] size input element number.
+  \param[in] format D3L_ZIP_NONE, D3L_ZIP_GZIP or D3L_ZIP_ZSTD.
+  \param[in] level compression level of the format.
+  \retval >=0 Written size; <0 Failed.
+ */
+template <class T>
+int64_t d3l_fop_write(const char *sz_file, T* buff, const size_t size, int format, int level)
+{
+    return d3l_fop_write_zip(sz_file, buff, size * sizeof(T), format, level);
+}
+
+//! Read a file using d3l_fop_read_parallel().
+/*!
+  \brief Read a file into a new buffer, by several threads when the file is
+         larger than D3L_FOP_PARALLEL_SIZE. Compressed files are decompressed,
+         and read as is only when the decompressor rejects the data before any
+         output, as for magic bytes matched by chance. Corrupt or truncated
+         compressed files fail.
+         The last element is zero padded when the size is not a multiple of
+         sizeof(T).
+  \param[in] sz_file file path.
+  \param[out] buff memory point to output, free it with d3l_mem_free().
+  \retval >=0 File size, decompressed; <0 Failed.
+ */
+template <class T>
+int64_t d3l_fop_read(const char *sz_file, T *&buff)
+{
+    if(d3l_fop_zip_detect(sz_file) > D3L_ZIP_NONE)
+    {
+        static_assert(std::is_trivially_default_constructible<T>::value && alignof(T) <= 16,
+                "d3l_fop_read needs a trivial type aligned up to 16 bytes");
+        void *data = NULL;
+        int64_t len = d3l_fop_zip_read(sz_file, data, sizeof(T));
+        if(len >= 0)
+        {
+            buff = static_cast<T *>(data);
+            return len;
+        }
+        // Not a valid compressed stream after all, read the raw bytes.
+        if(-4 != len)
+            return -3;
+    }
+
+    int64_t size = d3l_fop_size(sz_file);
+    if(size < 0)
+        return -1;
+
+    size_t num = std::max<size_t>((size + sizeof(T) - 1) / sizeof(T), 1);
+    if(NULL == d3l_mem_create_uninit(buff, num))
+        return -2;
+    memset(reinterpret_cast<char *>(buff) + (num - 1) * sizeof(T), 0, sizeof(T));
+    int64_t len = d3l_fop_read_parallel(sz_file, buff, num * sizeof(T),
+            size >= D3L_FOP_PARALLEL_SIZE ? 0 : 1, 0, NULL, NULL);
+    if(len < 0)
+        d3l_mem_free(buff);
+    return len;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Record Operation
+////////////////////////////////////////////////////////////////////////
+
+//! Fields of one delimited record.
+/*!
+  \brief Fields of one delimited record as views into the parsed buffer, valid
+         until the next record is read.
+ */
+class d3l_rec_record
+{
+public:
+    d3l_rec_record() : fields_(NULL), num_(0) {}
+
+    //! Get field number.
+    size_t size() const { return num_; }
+    bool empty() const { return 0 == num_; }
+    const std::string_view *begin() const { return fields_; }
+    const std::string_view *end() const { return fields_ + num_; }
+
+    //! Get a field.
+    std::string_view operator[](size_t i) const { return fields_[i]; }
+
+    //! Convert a field using d3l_convert_from_chars().
+    /*!
+      \param[in] i field index.
+      \param[out] value field value.
+      \retval ==0 Successed; <0 Failed.
+     */
+    template <class T>
+    int get(size_t i, T &value) const
+    {
+        if(i >= num_)
+            return -1;
+        return d3l_convert_from_chars(fields_[i].data(), fields_[i].size(), value);
+    }
+
+private:
+    friend class d3l_rec_parser;
+    const std::string_view *fields_;
+    size_t num_;
+};
+
+//! Zero-copy delimited record parser.
+/*!
+  \brief Delimited record parser over a buffer or a mapped file. Delimiters and
+         newlines are found with SIMD scanning, fields are views into the
+         buffer and only quoted fields with escaped quotes are copied, into a
+         scratch buffer reused for every record. A quote of 0 disables quoting
+         for TSV-like data. Empty lines are skipped and "\r\n" is accepted.
+ */
+class d3l_rec_parser
+{
+public:
+    d3l_rec_parser() : data_(NULL), end_(NULL), pos_(NULL), delim_(','), quote_('"') {}
+    d3l_rec_parser(const char *data, size_t len, char delim = ',', char quote = '"')
+    {
+        reset(data, len, delim, quote);
+    }
+
+    //! Parse a buffer.
+    void reset(const char *data, size_t len, char delim = ',', char quote = '"');
+
+    //! Map and parse a file.
+    int open(const char *sz_file, char delim = ',', char quote = '"');
+
+    //! Read next record.
+    int next(d3l_rec_record &rec);
+
+    //! Get offset of next record.
+    size_t offset() const { return pos_ - data_; }
+
+private:
+    d3l_fop_map map_;
+    const char *data_;
+    const char *end_;
+    const char *pos_;
+    char delim_;
+    char quote_;
+    std::vector<std::string_view> fields_;
+    std::vector<size_t> escaped_;
+    std::string scratch_;
+};
+
+//! Split a buffer at record boundaries.
+int d3l_rec_split(const char *, size_t, size_t, std::vector<size_t> &, char = '"');
+
 #endif // #ifdef __cplusplus
 
 #endif // #ifndef d3l_version